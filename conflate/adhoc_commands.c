@@ -37,10 +37,8 @@ static enum conflate_mgmt_cb_result process_serverlist(void *opaque,
                       "Processing a serverlist");
 
     /* Persist the config lists */
-    if (!save_kvpairs(handle, conf, handle->conf->save_path)) {
-        handle->conf->log(handle->conf->userdata, LOG_LVL_ERROR,
-                          "Can not save config to %s",
-                          handle->conf->save_path);
+    if (handle->conf->save_path) {
+        conflate_save_async(handle, conf);
     }
 
     /* Send the config to the callback */
@@ -140,6 +138,56 @@ static enum conflate_mgmt_cb_result process_delete_private(void *opaque,
     return rv;
 }
 
+static enum conflate_mgmt_cb_result process_update_private(void *opaque,
+                                                           conflate_handle_t *handle,
+                                                           const char *cmd,
+                                                           bool direct,
+                                                           kvpair_t *form,
+                                                           conflate_form_result *r)
+{
+    enum conflate_mgmt_cb_result rv = RV_ERROR;
+    (void)opaque;
+    (void)cmd;
+    (void)r;
+
+    /* Only direct stat requests are handled. */
+    assert(direct);
+
+    /* Every field is a key: set to its value, or deleted if it has none */
+    if (form) {
+        if (conflate_update_private(handle, form, handle->conf->save_path)) {
+            rv = RV_OK;
+        }
+    } else {
+        rv = RV_BADARG;
+    }
+
+    return rv;
+}
+
+static enum conflate_mgmt_cb_result process_stats(void *opaque,
+                                                  conflate_handle_t *handle,
+                                                  const char *cmd,
+                                                  bool direct,
+                                                  kvpair_t *form,
+                                                  conflate_form_result *r)
+{
+    kvpair_t *stats, *pair;
+    (void)opaque;
+    (void)cmd;
+    (void)direct;
+    (void)form;
+
+    conflate_init_form(r);
+    stats = conflate_get_stats(handle);
+    for (pair = stats; pair; pair = pair->next) {
+        conflate_add_field_multi(r, pair->key, (const char **)pair->values);
+    }
+    free_kvpair(stats);
+
+    return RV_OK;
+}
+
 void conflate_init_commands(void)
 {
     if (commands_initialized) {
@@ -155,9 +203,15 @@ void conflate_init_commands(void)
     conflate_register_mgmt_cb("rm_private",
                               "Delete a private value from the agent.",
                               process_delete_private);
+    conflate_register_mgmt_cb("update_private",
+                              "Set and delete several private values at once.",
+                              process_update_private);
 
     conflate_register_mgmt_cb("serverlist", "Configure a server list.",
                               process_serverlist);
 
+    conflate_register_mgmt_cb("stats", "Report the agent's counters.",
+                              process_stats);
+
     commands_initialized = true;
 }
@@ -17,6 +17,9 @@ conflate_config_t* dup_conf(conflate_config_t c) {
     conflate_config_t *rv = calloc(sizeof(conflate_config_t), 1);
     assert(rv);
 
+    /* Take the callbacks and flags as they are, then copy the strings */
+    *rv = c;
+
     rv->jid = safe_strdup(c.jid);
     rv->pass = safe_strdup(c.pass);
     if (c.host) {
@@ -24,51 +27,102 @@ conflate_config_t* dup_conf(conflate_config_t c) {
     }
     rv->software = safe_strdup(c.software);
     rv->version = safe_strdup(c.version);
-    rv->save_path = safe_strdup(c.save_path);
-    rv->userdata = c.userdata;
-    rv->log = c.log;
-    rv->new_config = c.new_config;
+    if (c.save_path) {
+        rv->save_path = safe_strdup(c.save_path);
+    }
+    if (c.mgmt_socket_path) {
+        rv->mgmt_socket_path = safe_strdup(c.mgmt_socket_path);
+    }
 
     rv->initialization_marker = (void*)INITIALIZATION_MAGIC;
 
     return rv;
 }
 
+static void free_conf(conflate_config_t *c) {
+    free(c->jid);
+    free(c->pass);
+    free(c->host);
+    free(c->software);
+    free(c->version);
+    free(c->save_path);
+    free(c->mgmt_socket_path);
+    free(c);
+}
+
 void init_conflate(conflate_config_t *conf)
 {
     assert(conf);
     memset(conf, 0x00, sizeof(conflate_config_t));
     conf->log = conflate_stderr_logger;
+    conf->save_fsync = true;
+    conf->retry_min_ms = RETRY_MIN_MS;
+    conf->retry_max_ms = RETRY_MAX_MS;
+    conf->retry_jitter = RETRY_JITTER;
+    conf->connect_timeout_ms = CONNECT_TIMEOUT_MS;
+    conf->idle_timeout_ms = IDLE_TIMEOUT_MS;
+    conf->keepalive_idle = KEEPALIVE_IDLE;
+    conf->keepalive_interval = KEEPALIVE_INTERVAL;
     conf->initialization_marker = (void*)INITIALIZATION_MAGIC;
 }
 
 bool start_conflate(conflate_config_t conf) {
+    return start_conflate_handle(conf) != NULL;
+}
+
+static bool start_thread(conflate_handle_t *handle, void (*run_func)(void*)) {
+    if (cb_create_thread(&handle->thread, run_func, handle, 1) != 0) {
+        perror("Failed to create thread");
+        return false;
+    }
+    return true;
+}
+
+conflate_handle_t *start_conflate_handle(conflate_config_t conf) {
     conflate_handle_t *handle;
-    void (*run_func)(void*) = NULL;
+    bool started;
 
     /* Don't start if we don't believe initialization has occurred. */
     if (conf.initialization_marker != (void*)INITIALIZATION_MAGIC) {
         assert(conf.initialization_marker == (void*)INITIALIZATION_MAGIC);
-        return false;
+        return NULL;
     }
 
     handle = calloc(1, sizeof(conflate_handle_t));
     assert(handle);
 
+    handle->conf = dup_conf(conf);
+
+    /* Nothing's served on the socket until the handle is running */
+    if (conf.mgmt_socket_path && !conflate_open_mgmt_server(handle)) {
+        free_conf(handle->conf);
+        free(handle);
+        return NULL;
+    }
+
     if (strncmp(HTTP_PREFIX, conf.host, strlen(HTTP_PREFIX))) {
-        run_func = &run_rest_conflate;
+        init_rest_conflate();
+        if (conf.shared_rest_engine) {
+            started = register_rest_conflate(handle);
+        } else {
+            started = start_thread(handle, run_rest_conflate);
+        }
     } else {
-        run_func = &run_conflate;
         conflate_init_commands();
+        started = start_thread(handle, run_conflate);
     }
 
-    handle->conf = dup_conf(conf);
-
-    if (cb_create_thread(&handle->thread, run_func, handle, 1) == 0) {
-        return true;
-    } else {
-        perror("Failed to create thread");
+    if (!started) {
+        if (handle->mgmt_server) {
+            conflate_close_mgmt_server(handle);
+        }
+        free_conf(handle->conf);
+        free(handle);
+        return NULL;
     }
 
-    return false;
+    if (handle->mgmt_server) {
+        conflate_serve_mgmt_server(handle);
+    }
+    return handle;
 }
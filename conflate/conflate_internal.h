@@ -2,7 +2,11 @@
 #ifndef CONFLATE_INTERNAL_H
 #define CONFLATE_INTERNAL_H 1
 
+#include <stdint.h>
 #include <platform/platform.h>
+#include <curl/curl.h>
+
+#include "json.h"
 
 #ifdef CONFLATE_USE_XMPP
 #include <strophe.h>
@@ -11,6 +15,105 @@
 #define xmpp_conn_t void
 #endif
 
+struct rest_engine;
+struct rest_endpoint;
+
+/* Histogram resolution: 2^STATS_SUB_BITS buckets per power of two. */
+#define STATS_SUB_BITS 3
+#define STATS_BUCKETS (40 << STATS_SUB_BITS)
+/* curl error codes counted separately; the rest share the last slot. */
+#define STATS_CURL_CODES 100
+
+/*
+ * A histogram of times in microseconds, in the style of HdrHistogram:
+ * each power of two is split into 2^STATS_SUB_BITS linear buckets, so
+ * a few hundred counters keep every value to within 12.5%, and
+ * recording one is a single atomic increment.
+ */
+struct conflate_histogram {
+    volatile int64_t counts[STATS_BUCKETS];
+    volatile int64_t total; /* Sum of everything recorded. */
+    volatile int64_t max;
+};
+
+/*
+ * What a handle has been up to.  Every field is updated atomically
+ * from whichever thread does the work, and read without locks.
+ */
+struct conflate_stats {
+    volatile int64_t bytes_received;
+    volatile int64_t configs_received;
+    volatile int64_t configs_delivered;
+    volatile int64_t configs_unchanged; /* Identical ones not delivered. */
+    volatile int64_t not_modified;
+    volatile int64_t connections;
+    volatile int64_t curl_errors[STATS_CURL_CODES];
+    volatile int64_t last_config_at; /* gethrtime() of the last config. */
+
+    struct conflate_histogram parse_time;
+    struct conflate_histogram callback_time;
+    struct conflate_histogram first_config_time; /* From connecting. */
+
+    /* The handle's REST urls, published once they're all set up. */
+    struct rest_endpoint * volatile endpoints;
+};
+
+/* Where a REST handle is in its connect/retry cycle. */
+enum rest_state {
+    REST_WAITING,      /* Waiting for retry_at to start a transfer. */
+    REST_TRANSFERRING, /* A transfer is running in the engine. */
+    REST_DELIVERING    /* Waiting on the callback for a final config. */
+};
+
+/* A config being received from a REST server. */
+struct response_buffer {
+    char *data;
+    size_t bytes_used;
+    size_t buffer_size;
+};
+
+/*
+ * One of a handle's REST urls, with a curl handle set up for it once
+ * and reused for every connection, and what we've learned about it.
+ */
+struct rest_endpoint {
+    char *url;
+    CURL *curl;
+    char curl_error[CURL_ERROR_SIZE];
+    struct rest_attempt *attempt; /* The one using it, if any. */
+    volatile int64_t connections;
+
+    /* Validators of the config we're using, if it came from here, and
+       the conditional request headers made of them. */
+    char *etag;
+    char *last_modified;
+    struct curl_slist *headers;
+    bool streams;     /* Configs have come before a transfer ended. */
+
+    int failures;     /* Failed attempts since it last gave us a config. */
+    hrtime_t latency; /* Moving average of the time to a first config. */
+    bool measured;    /* Whether latency holds anything yet. */
+};
+
+/* One connection to one of a handle's REST urls. */
+struct rest_attempt {
+    struct _conflate_handle *handle;
+    char *url;
+    struct rest_endpoint *endpoint;
+    bool active;       /* Added to the engine's curl_multi. */
+    hrtime_t started;
+    hrtime_t last_activity; /* When anything last came in. */
+    hrtime_t parse_time;    /* Spent on the message so far. */
+    bool got_config;   /* Its latency has been recorded. */
+    bool not_modified; /* The answer was a 304. */
+    char *etag;        /* Validators of the response, if it had any. */
+    char *last_modified;
+
+    struct response_buffer response;
+    struct json_tokenizer tokenizer;
+    struct json_flattener flattener;
+};
+
 struct _conflate_handle {
 
     xmpp_ctx_t *ctx;
@@ -21,8 +124,212 @@ struct _conflate_handle {
     cb_thread_t thread;
 
     char *url; /* Current URL for debuggability. */
+
+    /* REST state, private to the engine thread driving this handle. */
+    struct rest_engine *engine;
+    struct _conflate_handle *next; /* Next handle in the same engine. */
+    enum rest_state rest_state;
+    hrtime_t retry_at;
+    int worker; /* Callback worker delivering this handle's configs. */
+
+    /* The '|' delimited url list and the credentials, prepared once.
+       Each pass tries the urls in order of health, the ones that
+       failed least first. */
+    char *url_list;
+    struct rest_endpoint *endpoints;
+    int num_endpoints;
+    int *order;
+    int next_endpoint; /* Position in order of the next url to try. */
+    bool in_pass;
+    int failed_passes; /* Passes in a row that got no config at all. */
+    uint32_t random;   /* State for jittering the retries. */
+    char *userpass;
+
+    /* Connections racing to deliver a config, or just the one when
+       urls are tried in turn.  The winner is the one being listened
+       to; once there is one, every other attempt gets cancelled. */
+    struct rest_attempt *attempts;
+    int num_attempts;
+    int running;
+    struct rest_attempt *winner;
+
+    kvpair_t *last_config; /* The last config the application accepted. */
+    int tot_process_new_configs;
+    int tot_at_transfer_start;
+    int tot_at_last_failure;
+
+    struct conflate_stats stats;
+
+    struct mgmt_server *mgmt_server;
+};
+
+/* Bytes appended to as they're needed. */
+struct conflate_buffer {
+    char *data;
+    size_t used;
+    size_t size;
+};
+
+/*
+ * Room left at the front of a form result for the management socket's
+ * reply header (the frame length, the result and the number of forms),
+ * so the whole buffer can go out as the reply without being copied.
+ */
+#define FORM_RESULT_HEADER 12
+
+/*
+ * The reply a management command builds: one or more forms (field
+ * sets), written one after the other in a single buffer just as the
+ * management socket sends them.  After FORM_RESULT_HEADER bytes each
+ * form is its number of pairs, then for each pair its key, the number
+ * of values and the values.  Numbers are four bytes, most significant
+ * first, and strings are their length and then their bytes.
+ *
+ * Only the last form can be added to, so its pair count is updated in
+ * place.
+ */
+struct _conflate_form_result {
+    struct conflate_buffer buffer;
+    size_t current;   /* Where the last form's pair count is. */
+    int num_forms;
+
+    struct command_def *command;  /* The command building it. */
+    hrtime_t started;             /* When the command was called. */
+    struct mgmt_server *server;   /* Set if it can take a deferred reply. */
+    conflate_mgmt_pending_t *deferred;
 };
 
+void conflate_init_form_result(conflate_form_result *r);
+void conflate_free_form_result(conflate_form_result *r);
+
+/*
+ * The forms as a JSON array of objects, each value an array of
+ * strings: [{"key":["value",...],...},...].  The caller frees it.
+ */
+char *conflate_form_result_json(const conflate_form_result *r, size_t *len);
+
+/*
+ * Serve management commands on the handle's mgmt_socket_path, from a
+ * thread of its own.
+ */
+bool conflate_start_mgmt_server(conflate_handle_t *handle);
+
+/*
+ * The same in two steps, for a handle that may still fail to start.
+ * Opening does everything that can fail, but nothing is served until
+ * conflate_serve_mgmt_server().  Until then conflate_close_mgmt_server()
+ * shuts it down again and removes the socket.
+ */
+bool conflate_open_mgmt_server(conflate_handle_t *handle);
+void conflate_serve_mgmt_server(conflate_handle_t *handle);
+void conflate_close_mgmt_server(conflate_handle_t *handle);
+
 void conflate_init_commands(void);
 
+/* How long a deferred reply has, unless the command says otherwise. */
+#define MGMT_TIMEOUT_MS 30000
+
+/* A registered management command, and how it's been used. */
+struct command_def {
+    char *name;
+    char *description;
+    conflate_mgmt_cb_t cb;
+    int timeout_ms;            /* For deferred replies, or 0 for none. */
+    volatile int64_t calls;
+    volatile int64_t failures; /* Calls that didn't return RV_OK. */
+    volatile int64_t timeouts; /* Deferred replies that came too late. */
+    struct conflate_histogram latency;
+};
+
+/* Call visit with every registered command, in no particular order. */
+void conflate_foreach_mgmt_cb(void (*visit)(void *arg, struct command_def *c),
+                              void *arg);
+
+/*
+ * Save a config to the handle's save_path on a background thread.
+ * Only the newest config waiting for a handle is written.
+ */
+void conflate_save_async(conflate_handle_t *handle, kvpair_t *config);
+
+/* Atomically replace *ptr with newval if it's still oldval. */
+#ifdef _MSC_VER
+#define conflate_cas_ptr(ptr, oldval, newval) \
+    (InterlockedCompareExchangePointer((PVOID volatile *)(ptr), \
+                                       (newval), (oldval)) == (oldval))
+#else
+#define conflate_cas_ptr(ptr, oldval, newval) \
+    __sync_bool_compare_and_swap((ptr), (oldval), (newval))
+#endif
+
+/* Atomically add or subtract one, returning the new value. */
+#ifdef _MSC_VER
+#define conflate_atomic_incr(ptr) InterlockedIncrement((LONG volatile *)(ptr))
+#define conflate_atomic_decr(ptr) InterlockedDecrement((LONG volatile *)(ptr))
+#else
+#define conflate_atomic_incr(ptr) __sync_add_and_fetch((ptr), 1)
+#define conflate_atomic_decr(ptr) __sync_sub_and_fetch((ptr), 1)
+#endif
+
+/* Atomically add to a 64 bit counter, or replace it if unchanged. */
+#ifdef _MSC_VER
+#define conflate_atomic_add64(ptr, n) \
+    InterlockedExchangeAdd64((LONGLONG volatile *)(ptr), (n))
+#define conflate_cas_int64(ptr, oldval, newval) \
+    (InterlockedCompareExchange64((LONGLONG volatile *)(ptr), \
+                                  (newval), (oldval)) == (oldval))
+#else
+#define conflate_atomic_add64(ptr, n) __sync_add_and_fetch((ptr), (n))
+#define conflate_cas_int64(ptr, oldval, newval) \
+    __sync_bool_compare_and_swap((ptr), (oldval), (newval))
+#endif
+
+/* Keep the memory accesses on either side of it in order. */
+#ifdef _MSC_VER
+#define conflate_barrier() MemoryBarrier()
+#else
+#define conflate_barrier() __sync_synchronize()
+#endif
+
+/*
+ * How many messages the async logger has written and dropped.  False
+ * if it hasn't been used.
+ */
+bool conflate_async_log_stats(int64_t *written, int64_t *dropped);
+
+/* Record how long something took, in nanoseconds. */
+void conflate_histogram_record(struct conflate_histogram *h, hrtime_t ns);
+
+/* Count a finished transfer's curl error. */
+void conflate_count_curl_error(struct conflate_stats *stats, CURLcode code);
+
+/* A fast, non-cryptographic hash of a string. */
+uint32_t conflate_hash(const char *str);
+
+/* The standard (zlib, ethernet) CRC-32 of some bytes. */
+uint32_t conflate_crc32(const void *data, size_t len);
+
+#ifndef WIN32
+/* Make a rename into the file's directory durable. */
+void conflate_sync_parent_dir(const char *filename);
+#endif
+
+/*
+ * Whether two chains hold the same keys and values, in any order, as
+ * ::diff_kvpair would decide without copying anything out.
+ */
+bool kvpair_chains_equal(kvpair_t *a, kvpair_t *b);
+
+/* Carve some memory out of an arena.  It's 8-byte aligned. */
+void *kvpair_arena_alloc(kvpair_arena_t *arena, size_t size);
+
+/* Make the arena responsible for freeing some malloc()ed memory. */
+void kvpair_arena_adopt(kvpair_arena_t *arena, void *ptr);
+
+/*
+ * Make the arena responsible for a file mapping its pairs point into.
+ * It's unmapped with the arena (or free()d on WIN32, where it's read
+ * into memory instead).
+ */
+void kvpair_arena_adopt_mapping(kvpair_arena_t *arena, void *addr, size_t size);
+
 #endif /* CONFLATE_INTERNAL_H */
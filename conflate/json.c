@@ -0,0 +1,547 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "json.h"
+
+enum json_state {
+    S_BETWEEN,
+    S_STRING,
+    S_ESCAPE,
+    S_UNICODE,
+    S_NUMBER,
+    S_LITERAL
+};
+
+enum json_expect {
+    EXPECT_VALUE,
+    EXPECT_VALUE_OR_END,  /* Just after '[' */
+    EXPECT_KEY,
+    EXPECT_KEY_OR_END,    /* Just after '{' */
+    EXPECT_COLON,
+    EXPECT_COMMA_OR_END,
+    EXPECT_NOTHING        /* The top-level value is done. */
+};
+
+void json_init(struct json_tokenizer *t, int delimiter,
+               json_event_handler handler, void *opaque)
+{
+    memset(t, 0, sizeof(struct json_tokenizer));
+    t->handler = handler;
+    t->opaque = opaque;
+    t->delimiter = delimiter;
+    json_reset(t);
+}
+
+void json_reset(struct json_tokenizer *t)
+{
+    t->state = S_BETWEEN;
+    t->expect = EXPECT_VALUE;
+    t->depth = 0;
+    t->text_used = 0;
+    t->literal_used = 0;
+    t->high_surrogate = 0;
+    t->newlines = 0;
+    t->seen_value = false;
+    t->complete = false;
+    t->error = false;
+    t->end_of_message = false;
+}
+
+void json_destroy(struct json_tokenizer *t)
+{
+    free(t->stack);
+    free(t->text);
+    t->stack = NULL;
+    t->text = NULL;
+}
+
+static void append_text(struct json_tokenizer *t, char c)
+{
+    if (t->handler == NULL) {
+        return;
+    }
+
+    /* Always leave room for the terminating '\0' */
+    if (t->text_used + 2 > t->text_size) {
+        t->text_size = t->text_size ? t->text_size << 1 : 64;
+        t->text = realloc(t->text, t->text_size);
+        assert(t->text);
+    }
+    t->text[t->text_used++] = c;
+}
+
+static void append_codepoint(struct json_tokenizer *t, unsigned int cp)
+{
+    if (cp < 0x80) {
+        append_text(t, (char)cp);
+    } else if (cp < 0x800) {
+        append_text(t, (char)(0xc0 | (cp >> 6)));
+        append_text(t, (char)(0x80 | (cp & 0x3f)));
+    } else if (cp < 0x10000) {
+        append_text(t, (char)(0xe0 | (cp >> 12)));
+        append_text(t, (char)(0x80 | ((cp >> 6) & 0x3f)));
+        append_text(t, (char)(0x80 | (cp & 0x3f)));
+    } else {
+        append_text(t, (char)(0xf0 | (cp >> 18)));
+        append_text(t, (char)(0x80 | ((cp >> 12) & 0x3f)));
+        append_text(t, (char)(0x80 | ((cp >> 6) & 0x3f)));
+        append_text(t, (char)(0x80 | (cp & 0x3f)));
+    }
+}
+
+static void emit(struct json_tokenizer *t, enum json_event event,
+                 const char *text, size_t len)
+{
+    if (t->handler && !t->error) {
+        t->handler(t->opaque, event, text, len);
+    }
+}
+
+static void emit_text(struct json_tokenizer *t, enum json_event event)
+{
+    if (t->handler) {
+        append_text(t, '\0');
+        t->text_used--;
+        emit(t, event, t->text, t->text_used);
+    }
+    t->text_used = 0;
+}
+
+static bool begin_value(struct json_tokenizer *t)
+{
+    if (t->expect != EXPECT_VALUE && t->expect != EXPECT_VALUE_OR_END) {
+        t->error = true;
+        return false;
+    }
+    t->seen_value = true;
+    return true;
+}
+
+static void end_value(struct json_tokenizer *t)
+{
+    if (t->depth == 0) {
+        t->expect = EXPECT_NOTHING;
+        t->complete = true;
+    } else {
+        t->expect = EXPECT_COMMA_OR_END;
+    }
+}
+
+static void begin_container(struct json_tokenizer *t, char c)
+{
+    if (!begin_value(t)) {
+        return;
+    }
+
+    if (t->depth == t->stack_size) {
+        t->stack_size = t->stack_size ? t->stack_size << 1 : 16;
+        t->stack = realloc(t->stack, t->stack_size);
+        assert(t->stack);
+    }
+    t->stack[t->depth++] = c;
+
+    if (c == '{') {
+        emit(t, JSON_BEGIN_OBJECT, NULL, 0);
+        t->expect = EXPECT_KEY_OR_END;
+    } else {
+        emit(t, JSON_BEGIN_ARRAY, NULL, 0);
+        t->expect = EXPECT_VALUE_OR_END;
+    }
+}
+
+static void end_container(struct json_tokenizer *t, char c)
+{
+    char open = c == '}' ? '{' : '[';
+    bool can_end = t->expect == EXPECT_COMMA_OR_END ||
+        (open == '{' && t->expect == EXPECT_KEY_OR_END) ||
+        (open == '[' && t->expect == EXPECT_VALUE_OR_END);
+
+    if (t->depth == 0 || t->stack[t->depth - 1] != open || !can_end) {
+        t->error = true;
+        return;
+    }
+
+    t->depth--;
+    emit(t, c == '}' ? JSON_END_OBJECT : JSON_END_ARRAY, NULL, 0);
+    end_value(t);
+}
+
+static void end_string(struct json_tokenizer *t)
+{
+    if (t->text_is_key) {
+        emit_text(t, JSON_KEY);
+        t->expect = EXPECT_COLON;
+    } else {
+        emit_text(t, JSON_STRING);
+        end_value(t);
+    }
+}
+
+static void end_literal(struct json_tokenizer *t)
+{
+    t->literal[t->literal_used] = '\0';
+    if (strcmp(t->literal, "true") != 0 &&
+        strcmp(t->literal, "false") != 0 &&
+        strcmp(t->literal, "null") != 0) {
+        t->error = true;
+        return;
+    }
+    emit(t, JSON_LITERAL, t->literal, t->literal_used);
+    end_value(t);
+}
+
+static char unescape(char c)
+{
+    switch (c) {
+    case 'b': return '\b';
+    case 'f': return '\f';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 't': return '\t';
+    default: return c;  /* '"', '\\' and '/' stand for themselves */
+    }
+}
+
+static void add_hex_digit(struct json_tokenizer *t, char c)
+{
+    unsigned int v;
+
+    if (c >= '0' && c <= '9') {
+        v = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        v = c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        v = c - 'A' + 10;
+    } else {
+        t->error = true;
+        t->state = S_STRING;
+        return;
+    }
+
+    t->codepoint = (t->codepoint << 4) | v;
+    if (++t->hex_digits < 4) {
+        return;
+    }
+
+    t->state = S_STRING;
+    if (t->codepoint >= 0xd800 && t->codepoint < 0xdc00) {
+        /* Wait for the low half of the surrogate pair */
+        t->high_surrogate = t->codepoint;
+    } else if (t->codepoint >= 0xdc00 && t->codepoint < 0xe000 &&
+               t->high_surrogate) {
+        append_codepoint(t, 0x10000 + ((t->high_surrogate - 0xd800) << 10) +
+                         (t->codepoint - 0xdc00));
+        t->high_surrogate = 0;
+    } else {
+        append_codepoint(t, t->codepoint);
+    }
+}
+
+size_t json_feed(struct json_tokenizer *t, const char *data, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        char c = data[i];
+
+        if (c == '\n' && (t->state == S_STRING || t->state == S_ESCAPE ||
+                          t->state == S_UNICODE)) {
+            /* Strings can't hold raw newlines, so this one never ended.
+               Its newlines still count towards the delimiter, or one
+               stray quote would swallow the rest of the stream. */
+            t->error = true;
+            t->state = S_BETWEEN;
+        }
+
+        switch (t->state) {
+        case S_STRING:
+            if (c == '"') {
+                t->state = S_BETWEEN;
+                end_string(t);
+            } else if (c == '\\') {
+                t->state = S_ESCAPE;
+            } else {
+                append_text(t, c);
+            }
+            continue;
+        case S_ESCAPE:
+            if (c == 'u') {
+                t->state = S_UNICODE;
+                t->codepoint = 0;
+                t->hex_digits = 0;
+            } else {
+                t->state = S_STRING;
+                append_text(t, unescape(c));
+            }
+            continue;
+        case S_UNICODE:
+            add_hex_digit(t, c);
+            continue;
+        case S_NUMBER:
+            if ((c >= '0' && c <= '9') || c == '.' || c == 'e' ||
+                c == 'E' || c == '+' || c == '-') {
+                append_text(t, c);
+                continue;
+            }
+            t->state = S_BETWEEN;
+            emit_text(t, JSON_NUMBER);
+            end_value(t);
+            break;
+        case S_LITERAL:
+            if (c >= 'a' && c <= 'z') {
+                if (t->literal_used < (int)sizeof(t->literal) - 1) {
+                    t->literal[t->literal_used++] = c;
+                } else {
+                    t->error = true;
+                }
+                continue;
+            }
+            t->state = S_BETWEEN;
+            end_literal(t);
+            break;
+        }
+
+        /* Between tokens, which is the only place a delimiter can be. */
+        if (c == '\n') {
+            if (++t->newlines == t->delimiter) {
+                t->end_of_message = true;
+                return i + 1;
+            }
+            continue;
+        }
+        t->newlines = 0;
+
+        if (t->error) {
+            /* Just look for the end of the message. */
+            continue;
+        }
+
+        switch (c) {
+        case ' ':
+        case '\t':
+        case '\r':
+            break;
+        case '{':
+        case '[':
+            begin_container(t, c);
+            break;
+        case '}':
+        case ']':
+            end_container(t, c);
+            break;
+        case ':':
+            if (t->expect == EXPECT_COLON) {
+                t->expect = EXPECT_VALUE;
+            } else {
+                t->error = true;
+            }
+            break;
+        case ',':
+            if (t->expect == EXPECT_COMMA_OR_END) {
+                t->expect = t->stack[t->depth - 1] == '{' ?
+                    EXPECT_KEY : EXPECT_VALUE;
+            } else {
+                t->error = true;
+            }
+            break;
+        case '"':
+            if (t->expect == EXPECT_KEY || t->expect == EXPECT_KEY_OR_END) {
+                t->text_is_key = true;
+            } else if (begin_value(t)) {
+                t->text_is_key = false;
+            } else {
+                break;
+            }
+            t->state = S_STRING;
+            t->text_used = 0;
+            t->high_surrogate = 0;
+            break;
+        default:
+            if (!begin_value(t)) {
+                break;
+            }
+            if ((c >= '0' && c <= '9') || c == '-') {
+                t->state = S_NUMBER;
+                t->text_used = 0;
+                append_text(t, c);
+            } else if (c >= 'a' && c <= 'z') {
+                t->state = S_LITERAL;
+                t->literal[0] = c;
+                t->literal_used = 1;
+            } else {
+                t->error = true;
+            }
+        }
+    }
+
+    return len;
+}
+
+void json_flattener_init(struct json_flattener *f)
+{
+    memset(f, 0, sizeof(struct json_flattener));
+    json_flattener_reset(f);
+}
+
+void json_flattener_reset(struct json_flattener *f)
+{
+    /* Releases the arena along with the pairs in it */
+    free_kvpair(f->head);
+    f->arena = NULL;
+    f->head = NULL;
+    f->tail = &f->head;
+    f->path_used = 0;
+    f->depth = 0;
+}
+
+void json_flattener_destroy(struct json_flattener *f)
+{
+    json_flattener_reset(f);
+    free(f->path);
+    free(f->marks);
+    free(f->indexes);
+    free(f->key);
+    f->path = NULL;
+    f->marks = NULL;
+    f->indexes = NULL;
+    f->key = NULL;
+}
+
+static void append_path(struct json_flattener *f, const char *s, size_t len)
+{
+    /* Always leave room for the terminating '\0' */
+    if (f->path_used + len + 1 > f->path_size) {
+        while (f->path_used + len + 1 > f->path_size) {
+            f->path_size = f->path_size ? f->path_size << 1 : 128;
+        }
+        f->path = realloc(f->path, f->path_size);
+        assert(f->path);
+    }
+    memcpy(&f->path[f->path_used], s, len);
+    f->path_used += len;
+    f->path[f->path_used] = '\0';
+}
+
+/*
+ * Extend the path with the name of the value that's starting: the
+ * last key inside an object, or the next index inside an array.
+ */
+static void push_value_name(struct json_flattener *f)
+{
+    char index[16];
+    const char *name = index;
+
+    if (f->depth == 0) {
+        append_path(f, "", 0);
+        return;
+    }
+
+    if (f->indexes[f->depth - 1] < 0) {
+        name = f->key ? f->key : "";
+    } else {
+        snprintf(index, sizeof(index), "%d", f->indexes[f->depth - 1]++);
+    }
+
+    if (f->path_used > 0) {
+        append_path(f, ".", 1);
+    }
+    append_path(f, name, strlen(name));
+}
+
+static void append_pair(struct json_flattener *f, const char *key,
+                        const char *value)
+{
+    kvpair_t *pair;
+    char *values[2];
+
+    if (f->arena == NULL) {
+        f->arena = mk_kvpair_arena(0);
+    }
+
+    values[0] = (char *) value;
+    values[1] = NULL;
+    pair = mk_kvpair_in(f->arena, key, values);
+
+    *f->tail = pair;
+    f->tail = &pair->next;
+}
+
+static void add_scalar(struct json_flattener *f, const char *text)
+{
+    size_t mark = f->path_used;
+
+    push_value_name(f);
+    append_pair(f, f->path, text);
+    f->path_used = mark;
+}
+
+static void open_container(struct json_flattener *f, bool array)
+{
+    size_t mark = f->path_used;
+
+    push_value_name(f);
+
+    if (f->depth == f->stack_size) {
+        f->stack_size = f->stack_size ? f->stack_size << 1 : 16;
+        f->marks = realloc(f->marks, f->stack_size * sizeof(size_t));
+        f->indexes = realloc(f->indexes, f->stack_size * sizeof(int));
+        assert(f->marks && f->indexes);
+    }
+    f->marks[f->depth] = mark;
+    f->indexes[f->depth] = array ? 0 : -1;
+    f->depth++;
+}
+
+void json_flatten_event(void *opaque, enum json_event event,
+                        const char *text, size_t len)
+{
+    struct json_flattener *f = (struct json_flattener *) opaque;
+
+    switch (event) {
+    case JSON_BEGIN_OBJECT:
+        open_container(f, false);
+        break;
+    case JSON_BEGIN_ARRAY:
+        open_container(f, true);
+        break;
+    case JSON_END_OBJECT:
+    case JSON_END_ARRAY:
+        f->depth--;
+        f->path_used = f->marks[f->depth];
+        if (f->path) {
+            f->path[f->path_used] = '\0';
+        }
+        break;
+    case JSON_KEY:
+        if (len + 1 > f->key_size) {
+            f->key_size = len + 1;
+            f->key = realloc(f->key, f->key_size);
+            assert(f->key);
+        }
+        memcpy(f->key, text, len + 1);
+        break;
+    case JSON_STRING:
+    case JSON_NUMBER:
+    case JSON_LITERAL:
+        add_scalar(f, text);
+        break;
+    }
+}
+
+void json_flattener_add(struct json_flattener *f, const char *key,
+                        const char *value)
+{
+    append_pair(f, key, value);
+}
+
+kvpair_t *json_flattener_take(struct json_flattener *f)
+{
+    kvpair_t *rv = f->head;
+
+    f->head = NULL;
+    json_flattener_reset(f);
+
+    return rv;
+}
@@ -0,0 +1,131 @@
+#ifndef JSON_H
+#define JSON_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <libconflate/conflate.h>
+
+/*
+ * A push-style JSON tokenizer.
+ *
+ * Bytes are fed in as they come off the wire, in chunks of any size,
+ * and tokens are reported to the handler as soon as they complete.  It
+ * also finds the end of each message in a stream of JSON documents
+ * separated by a run of newlines, no matter how that run is split up
+ * between chunks.
+ */
+
+enum json_event {
+    JSON_BEGIN_OBJECT,
+    JSON_END_OBJECT,
+    JSON_BEGIN_ARRAY,
+    JSON_END_ARRAY,
+    JSON_KEY,
+    JSON_STRING,
+    JSON_NUMBER,
+    JSON_LITERAL  /* true, false or null */
+};
+
+/*
+ * Called for each token.  The text is only meaningful for keys and
+ * scalars; strings are unescaped and '\0' terminated.
+ */
+typedef void (*json_event_handler)(void *opaque, enum json_event event,
+                                   const char *text, size_t len);
+
+struct json_tokenizer {
+    json_event_handler handler;
+    void *opaque;
+    int delimiter;     /* Newlines in a row that end a message. */
+
+    int state;
+    int expect;
+    char *stack;       /* '{' or '[' for each open container. */
+    int depth;
+    int stack_size;
+
+    char *text;        /* The token being read (with a handler only). */
+    size_t text_used;
+    size_t text_size;
+    char literal[8];
+    int literal_used;
+    bool text_is_key;
+    unsigned int codepoint;
+    int hex_digits;
+    unsigned int high_surrogate;
+
+    int newlines;
+    bool seen_value;     /* The message has something besides whitespace. */
+    bool complete;       /* A whole top-level value has been read. */
+    bool error;          /* The message isn't valid JSON. */
+    bool end_of_message;
+};
+
+void json_init(struct json_tokenizer *t, int delimiter,
+               json_event_handler handler, void *opaque);
+
+/* Get ready for the next message. */
+void json_reset(struct json_tokenizer *t);
+
+void json_destroy(struct json_tokenizer *t);
+
+/*
+ * Feed bytes to the tokenizer.
+ *
+ * Returns how many bytes were consumed.  That's all of them unless the
+ * end of a message was found, in which case it stops right after the
+ * delimiter and sets end_of_message.  The caller deals with that
+ * message, calls json_reset() and feeds the rest.
+ */
+size_t json_feed(struct json_tokenizer *t, const char *data, size_t len);
+
+/*
+ * Builds a flat kvpair list out of tokenizer events.
+ *
+ * Every scalar becomes one pair keyed by its path from the top-level
+ * value, with object keys and array indexes joined by dots.  So
+ * {"nodes":[{"hostname":"a"}]} yields the key "nodes.0.hostname" with
+ * the value "a".  Literals come out as "true", "false" or "null".
+ */
+struct json_flattener {
+    char *path;        /* Path of the innermost open container. */
+    size_t path_used;
+    size_t path_size;
+
+    size_t *marks;     /* path_used before each open container. */
+    int *indexes;      /* Next array index, or -1 in an object. */
+    int depth;
+    int stack_size;
+
+    char *key;         /* The last key read in the current object. */
+    size_t key_size;
+
+    kvpair_arena_t *arena; /* Holds every pair built for this value. */
+    kvpair_t *head;
+    kvpair_t **tail;
+};
+
+void json_flattener_init(struct json_flattener *f);
+
+/* Throw away anything built so far. */
+void json_flattener_reset(struct json_flattener *f);
+
+void json_flattener_destroy(struct json_flattener *f);
+
+/* A json_event_handler, with the flattener as its opaque value. */
+void json_flatten_event(void *opaque, enum json_event event,
+                        const char *text, size_t len);
+
+/* Append a pair of our own to the list built so far. */
+void json_flattener_add(struct json_flattener *f, const char *key,
+                        const char *value);
+
+/*
+ * Take the list built so far and start over.  The list lives in an
+ * arena that ::free_kvpair releases in one go.  Returns NULL if
+ * nothing was built.
+ */
+kvpair_t *json_flattener_take(struct json_flattener *f);
+
+#endif /* JSON_H */
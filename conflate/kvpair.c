@@ -2,8 +2,179 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sched.h>
+#endif
 
 #include <libconflate/conflate.h>
+#include "conflate_internal.h"
+
+struct kvpair_slot {
+    uint32_t hash;
+    kvpair_t *pair;
+};
+
+/*
+ * An open addressing hash of a chain's keys.  It's built once and
+ * never modified, so any number of threads may search it.
+ */
+struct kvpair_index {
+    size_t mask;
+    struct kvpair_slot slots[1];
+};
+
+/* Arena blocks grow up to this size, unless a single request is bigger. */
+#define ARENA_MAX_BLOCK_SIZE (1024 * 1024)
+#define ARENA_ALIGN 8
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+};
+
+/* Memory the arena owns without having carved it out of a block. */
+struct arena_adoption {
+    struct arena_adoption *next;
+    void *ptr;
+};
+
+/*
+ * Everything for a chain of kvpairs carved out of a few big blocks,
+ * all released at once.
+ */
+struct kvpair_arena {
+    struct arena_block *blocks;
+    size_t next_block_size;
+    struct arena_adoption *adopted;
+    void *mapping; /* A mapped file the pairs point into, if any. */
+    size_t mapping_size;
+    volatile long refs; /* Chains still being held, see free_kvpair(). */
+};
+
+/*
+ * Where the current snapshot is published.  Readers announce
+ * themselves in the count for the generation they found while they
+ * take a reference.  A writer moves the slot on a generation, so
+ * readers arriving later count themselves elsewhere, and only waits
+ * for the ones that may have seen the snapshot it replaced.
+ */
+struct conflate_snapshot_slot {
+    kvpair_t * volatile current;
+    volatile long generation;
+    volatile long readers[2];
+    cb_mutex_t mutex; /* Writers take turns. */
+};
+
+/* Spins a waiting writer makes before it starts yielding the CPU. */
+#define SNAPSHOT_SPINS 64
+
+static size_t arena_align(size_t size)
+{
+    return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+void *kvpair_arena_alloc(kvpair_arena_t *arena, size_t size)
+{
+    struct arena_block *block = arena->blocks;
+    size_t header = arena_align(sizeof(struct arena_block));
+    void *rv;
+
+    size = arena_align(size);
+
+    if (block == NULL || block->used + size > block->size) {
+        size_t block_size = arena->next_block_size;
+        if (block_size < header + size) {
+            block_size = header + size;
+        }
+
+        block = malloc(block_size);
+        assert(block);
+        block->size = block_size;
+        block->used = header;
+        block->next = arena->blocks;
+        arena->blocks = block;
+
+        if (arena->next_block_size < ARENA_MAX_BLOCK_SIZE) {
+            arena->next_block_size <<= 1;
+        }
+    }
+
+    rv = (char *)block + block->used;
+    block->used += size;
+    return rv;
+}
+
+static char *arena_strdup(kvpair_arena_t *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *rv = kvpair_arena_alloc(arena, len);
+    memcpy(rv, str, len);
+    return rv;
+}
+
+/* Lookups on shared chains may adopt concurrently, so it's lock-free. */
+void kvpair_arena_adopt(kvpair_arena_t *arena, void *ptr)
+{
+    struct arena_adoption *a = malloc(sizeof(struct arena_adoption));
+    assert(a);
+    a->ptr = ptr;
+    do {
+        a->next = arena->adopted;
+    } while (!conflate_cas_ptr(&arena->adopted, a->next, a));
+}
+
+void kvpair_arena_adopt_mapping(kvpair_arena_t *arena, void *addr, size_t size)
+{
+    assert(arena->mapping == NULL);
+    arena->mapping = addr;
+    arena->mapping_size = size;
+}
+
+kvpair_arena_t *mk_kvpair_arena(size_t size_hint)
+{
+    kvpair_arena_t *arena = calloc(1, sizeof(kvpair_arena_t));
+    assert(arena);
+    arena->refs = 1;
+    arena->next_block_size = 4096;
+    if (size_hint > 0) {
+        /* A known size goes in a single block, however big */
+        size_hint += arena_align(sizeof(struct arena_block));
+        if (size_hint > arena->next_block_size) {
+            arena->next_block_size = size_hint;
+        }
+    }
+    return arena;
+}
+
+void free_kvpair_arena(kvpair_arena_t *arena)
+{
+    if (arena) {
+        struct arena_block *block = arena->blocks;
+        struct arena_adoption *adopted = arena->adopted;
+
+        while (block) {
+            struct arena_block *next = block->next;
+            free(block);
+            block = next;
+        }
+        while (adopted) {
+            struct arena_adoption *next = adopted->next;
+            free(adopted->ptr);
+            free(adopted);
+            adopted = next;
+        }
+        if (arena->mapping) {
+#ifdef WIN32
+            free(arena->mapping);
+#else
+            munmap(arena->mapping, arena->mapping_size);
+#endif
+        }
+        free(arena);
+    }
+}
 
 kvpair_t* mk_kvpair(const char* k, char** v)
 {
@@ -11,7 +182,7 @@ kvpair_t* mk_kvpair(const char* k, char** v)
     assert(rv);
 
     rv->key = safe_strdup(k);
-    if (v) {
+    if (v && v[0]) {
         int i = 0;
         for (i = 0; v[i]; i++) {
             add_kvpair_value(rv, v[i]);
@@ -25,11 +196,34 @@ kvpair_t* mk_kvpair(const char* k, char** v)
     return rv;
 }
 
-void add_kvpair_value(kvpair_t* pair, const char* value)
+kvpair_t* mk_kvpair_in(kvpair_arena_t* arena, const char* k, char** v)
 {
-    assert(pair);
-    assert(value);
+    kvpair_t* rv = kvpair_arena_alloc(arena, sizeof(kvpair_t));
+    int count = 0;
+
+    memset(rv, 0, sizeof(kvpair_t));
+    rv->arena = arena;
+    rv->key = arena_strdup(arena, k);
+
+    if (v) {
+        while (v[count]) {
+            count++;
+        }
+    }
+
+    /* Size the values for what we have, with room for the sentinal */
+    rv->allocated_values = count < 3 ? 4 : count + 1;
+    rv->values = kvpair_arena_alloc(arena, sizeof(char*) * rv->allocated_values);
+    for (rv->used_values = 0; rv->used_values < count; rv->used_values++) {
+        rv->values[rv->used_values] = arena_strdup(arena, v[rv->used_values]);
+    }
+    rv->values[rv->used_values] = 0;
+
+    return rv;
+}
 
+static void append_kvpair_value(kvpair_t* pair, char* value)
+{
     /* The last item in the values list must be null as it acts a sentinal */
     if (pair->allocated_values == 0 ||
             (pair->used_values + 1) == pair->allocated_values) {
@@ -38,22 +232,66 @@ void add_kvpair_value(kvpair_t* pair, const char* value)
             pair->allocated_values = 4;
         }
 
-        pair->values = realloc(pair->values,
-                               sizeof(char*) * pair->allocated_values);
-        assert(pair->values);
+        if (pair->arena) {
+            /* The old list just stays in the arena until it's freed */
+            char **values;
+            values = kvpair_arena_alloc(pair->arena,
+                                        sizeof(char*) * pair->allocated_values);
+            memcpy(values, pair->values, sizeof(char*) * pair->used_values);
+            pair->values = values;
+        } else {
+            pair->values = realloc(pair->values,
+                                   sizeof(char*) * pair->allocated_values);
+            assert(pair->values);
+        }
     }
 
-    pair->values[pair->used_values++] = safe_strdup(value);
+    pair->values[pair->used_values++] = value;
     pair->values[pair->used_values] = 0;
 }
 
+void add_kvpair_value(kvpair_t* pair, const char* value)
+{
+    assert(pair);
+    assert(value);
+
+    if (pair->arena) {
+        append_kvpair_value(pair, arena_strdup(pair->arena, value));
+    } else {
+        append_kvpair_value(pair, safe_strdup(value));
+    }
+}
+
+void add_kvpair_value_nocopy(kvpair_t* pair, char* value)
+{
+    assert(pair);
+    assert(value);
+
+    if (pair->arena) {
+        kvpair_arena_adopt(pair->arena, value);
+    }
+    append_kvpair_value(pair, value);
+}
+
 void free_kvpair(kvpair_t* pair)
 {
-    if (pair) {
-        free_kvpair(pair->next);
+    while (pair) {
+        kvpair_t *next = pair->next;
+
+        if (pair->arena) {
+            /* The rest of the chain is in the arena too, and goes
+               when the last reference to it does */
+            if (conflate_atomic_decr(&pair->arena->refs) == 0) {
+                free_kvpair_arena(pair->arena);
+            }
+            return;
+        }
+
+        free(pair->index);
         free(pair->key);
         free_string_list(pair->values);
         free(pair);
+        pair = next;
     }
 }
 
@@ -68,10 +306,108 @@ void walk_kvpair(kvpair_t *pair, void *opaque, kvpair_visitor_t visitor)
     }
 }
 
+static struct kvpair_index *mk_kvpair_index(kvpair_t *pair)
+{
+    struct kvpair_index *idx;
+    size_t count = 0;
+    size_t nslots, i;
+    kvpair_t *p;
+
+    for (p = pair; p; p = p->next) {
+        count++;
+    }
+    for (nslots = 4; nslots < count * 2; nslots <<= 1) {
+    }
+
+    idx = calloc(1, sizeof(struct kvpair_index) +
+                 (nslots - 1) * sizeof(struct kvpair_slot));
+    assert(idx);
+    idx->mask = nslots - 1;
+
+    for (p = pair; p; p = p->next) {
+        uint32_t h = conflate_hash(p->key);
+        for (i = h & idx->mask; idx->slots[i].pair; i = (i + 1) & idx->mask) {
+            if (idx->slots[i].hash == h &&
+                strcmp(idx->slots[i].pair->key, p->key) == 0) {
+                break;
+            }
+        }
+        /* Only the first of any duplicate keys can be found */
+        if (idx->slots[i].pair == NULL) {
+            idx->slots[i].hash = h;
+            idx->slots[i].pair = p;
+        }
+    }
+
+    return idx;
+}
+
+static kvpair_t *kvpair_index_lookup(struct kvpair_index *idx, const char *key)
+{
+    uint32_t h = conflate_hash(key);
+    size_t i;
+
+    for (i = h & idx->mask; idx->slots[i].pair; i = (i + 1) & idx->mask) {
+        if (idx->slots[i].hash == h &&
+            strcmp(idx->slots[i].pair->key, key) == 0) {
+            return idx->slots[i].pair;
+        }
+    }
+    return NULL;
+}
+
+void index_kvpair(kvpair_t *pair)
+{
+    struct kvpair_index *idx;
+
+    assert(pair);
+    if (pair->index) {
+        return;
+    }
+
+    idx = mk_kvpair_index(pair);
+    if (!conflate_cas_ptr(&pair->index, NULL, idx)) {
+        /* Another thread got there first */
+        free(idx);
+    } else if (pair->arena) {
+        kvpair_arena_adopt(pair->arena, idx);
+    }
+}
+
+void drop_kvpair_index(kvpair_t *pair)
+{
+    if (pair) {
+        if (!pair->arena) {
+            free(pair->index);
+        }
+        pair->index = NULL;
+    }
+}
+
+/*
+ * The chain's index if it has one, or else one made just for the
+ * caller, who gives it back with put_kvpair_index().
+ */
+static struct kvpair_index *borrow_kvpair_index(kvpair_t *pair)
+{
+    return pair->index ? pair->index : mk_kvpair_index(pair);
+}
+
+static void put_kvpair_index(kvpair_t *pair, struct kvpair_index *idx)
+{
+    if (idx != pair->index) {
+        free(idx);
+    }
+}
+
 kvpair_t* find_kvpair(kvpair_t* pair, const char* key)
 {
     assert(key);
 
+    if (pair && pair->index) {
+        return kvpair_index_lookup(pair->index, key);
+    }
+
     while (pair && strcmp(pair->key, key) != 0) {
         pair = pair->next;
     }
@@ -93,13 +429,274 @@ char *get_simple_kvpair_val(kvpair_t *pair, const char *key)
     return rv;
 }
 
+kvpair_t *dup_kvpair_in(kvpair_arena_t *arena, kvpair_t *pair)
+{
+    kvpair_t *rv = NULL;
+    kvpair_t **tail = &rv;
+
+    assert(arena);
+    for (; pair; pair = pair->next) {
+        *tail = mk_kvpair_in(arena, pair->key, pair->values);
+        tail = &(*tail)->next;
+    }
+    return rv;
+}
+
+/* What mk_kvpair_in() will take from an arena to copy a pair. */
+static size_t kvpair_arena_size(kvpair_t *pair)
+{
+    size_t rv = arena_align(sizeof(kvpair_t)) + arena_align(strlen(pair->key) + 1);
+    int i;
+
+    rv += arena_align(sizeof(char*) *
+                      (pair->used_values < 3 ? 4 : pair->used_values + 1));
+    for (i = 0; i < pair->used_values; i++) {
+        rv += arena_align(strlen(pair->values[i]) + 1);
+    }
+    return rv;
+}
+
 kvpair_t *dup_kvpair(kvpair_t *pair)
 {
-    kvpair_t *copy;
+    kvpair_t *rv = NULL;
+    kvpair_t **tail = &rv;
+
+    assert(pair);
+    for (; pair; pair = pair->next) {
+        *tail = mk_kvpair(pair->key, pair->values);
+        tail = &(*tail)->next;
+    }
+    return rv;
+}
+
+kvpair_t *dup_kvpair_packed(kvpair_t *pair)
+{
+    kvpair_t *p;
+    size_t size = 0;
+
     assert(pair);
-    copy = mk_kvpair(pair->key, pair->values);
-    if (pair->next) {
-        copy->next = dup_kvpair(pair->next);
+
+    /* Measure the chain first so the copy fits in one allocation */
+    for (p = pair; p; p = p->next) {
+        size += kvpair_arena_size(p);
+    }
+    return dup_kvpair_in(mk_kvpair_arena(size), pair);
+}
+
+static bool same_values(kvpair_t *a, kvpair_t *b)
+{
+    int i;
+
+    if (a->used_values != b->used_values) {
+        return false;
+    }
+    for (i = 0; i < a->used_values; i++) {
+        if (strcmp(a->values[i], b->values[i]) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void append_copy(kvpair_t ***tail, kvpair_t *pair)
+{
+    kvpair_t *copy = mk_kvpair(pair->key, pair->values);
+    **tail = copy;
+    *tail = &copy->next;
+}
+
+bool diff_kvpair(kvpair_t *before, kvpair_t *after,
+                 kvpair_t **added, kvpair_t **removed, kvpair_t **changed)
+{
+    kvpair_t **added_tail = added;
+    kvpair_t **removed_tail = removed;
+    kvpair_t **changed_tail = changed;
+    struct kvpair_index *before_idx, *after_idx;
+    kvpair_t *p;
+
+    *added = *removed = *changed = NULL;
+
+    /* Pushed configs usually list their keys in the same order, so
+       walk both lists side by side for as long as that holds. */
+    while (before && after && strcmp(before->key, after->key) == 0) {
+        if (!same_values(before, after)) {
+            append_copy(&changed_tail, after);
+        }
+        before = before->next;
+        after = after->next;
     }
-    return copy;
+
+    if (before == NULL || after == NULL) {
+        for (; after; after = after->next) {
+            append_copy(&added_tail, after);
+        }
+        for (; before; before = before->next) {
+            append_copy(&removed_tail, before);
+        }
+        return *added || *removed || *changed;
+    }
+
+    /* Otherwise match up what's left by key */
+    before_idx = borrow_kvpair_index(before);
+    after_idx = borrow_kvpair_index(after);
+
+    for (p = after; p; p = p->next) {
+        kvpair_t *found = kvpair_index_lookup(before_idx, p->key);
+        if (found == NULL) {
+            append_copy(&added_tail, p);
+        } else if (!same_values(found, p)) {
+            append_copy(&changed_tail, p);
+        }
+    }
+
+    for (p = before; p; p = p->next) {
+        if (kvpair_index_lookup(after_idx, p->key) == NULL) {
+            append_copy(&removed_tail, p);
+        }
+    }
+
+    put_kvpair_index(before, before_idx);
+    put_kvpair_index(after, after_idx);
+    return *added || *removed || *changed;
+}
+
+bool kvpair_chains_equal(kvpair_t *a, kvpair_t *b)
+{
+    struct kvpair_index *a_idx, *b_idx;
+    kvpair_t *p;
+    bool rv = true;
+
+    while (a && b && strcmp(a->key, b->key) == 0) {
+        if (!same_values(a, b)) {
+            return false;
+        }
+        a = a->next;
+        b = b->next;
+    }
+
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+
+    /* The same keys in a different order, maybe */
+    a_idx = borrow_kvpair_index(a);
+    b_idx = borrow_kvpair_index(b);
+
+    for (p = b; p && rv; p = p->next) {
+        kvpair_t *found = kvpair_index_lookup(a_idx, p->key);
+        rv = found != NULL && same_values(found, p);
+    }
+    for (p = a; p && rv; p = p->next) {
+        rv = kvpair_index_lookup(b_idx, p->key) != NULL;
+    }
+
+    put_kvpair_index(a, a_idx);
+    put_kvpair_index(b, b_idx);
+    return rv;
+}
+
+kvpair_t *conflate_snapshot_retain(kvpair_t *config)
+{
+    assert(config);
+    if (config->arena == NULL) {
+        return dup_kvpair_packed(config);
+    }
+    conflate_atomic_incr(&config->arena->refs);
+    return config;
+}
+
+void conflate_snapshot_release(kvpair_t *snapshot)
+{
+    free_kvpair(snapshot);
+}
+
+conflate_snapshot_slot_t *mk_conflate_snapshot_slot(void)
+{
+    conflate_snapshot_slot_t *slot = calloc(1, sizeof(conflate_snapshot_slot_t));
+    assert(slot);
+    cb_mutex_initialize(&slot->mutex);
+    return slot;
+}
+
+void free_conflate_snapshot_slot(conflate_snapshot_slot_t *slot)
+{
+    if (slot) {
+        assert(slot->readers[0] == 0 && slot->readers[1] == 0);
+        conflate_snapshot_release(slot->current);
+        cb_mutex_destroy(&slot->mutex);
+        free(slot);
+    }
+}
+
+/* Wait a little longer each time a spin loop comes round. */
+static void backoff(int *spins)
+{
+    if (++*spins < SNAPSHOT_SPINS) {
+#if defined(_MSC_VER)
+        YieldProcessor();
+#elif defined(__i386__) || defined(__x86_64__)
+        __asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+        __asm__ __volatile__("yield");
+#endif
+    } else {
+#ifdef WIN32
+        SwitchToThread();
+#else
+        sched_yield();
+#endif
+    }
+}
+
+void conflate_snapshot_publish(conflate_snapshot_slot_t *slot, kvpair_t *config)
+{
+    kvpair_t *snapshot = config ? conflate_snapshot_retain(config) : NULL;
+    kvpair_t *old;
+    long generation;
+    int spins = 0;
+
+    cb_mutex_enter(&slot->mutex);
+    old = slot->current;
+    slot->current = snapshot;
+    conflate_barrier();
+    generation = slot->generation;
+    slot->generation = generation + 1;
+    conflate_barrier();
+
+    /* Readers in the new generation can only see the new snapshot;
+       wait out the ones that may have picked up the old one before
+       letting it go */
+    while (slot->readers[generation & 1] != 0) {
+        backoff(&spins);
+    }
+    cb_mutex_exit(&slot->mutex);
+
+    conflate_snapshot_release(old);
+}
+
+kvpair_t *conflate_snapshot_acquire(conflate_snapshot_slot_t *slot)
+{
+    volatile long *readers;
+    kvpair_t *rv;
+
+    while (true) {
+        long generation = slot->generation;
+        readers = &slot->readers[generation & 1];
+        conflate_atomic_incr(readers);
+        if (slot->generation == generation) {
+            break;
+        }
+        /* A writer moved on before we were counted, so it may not
+           wait for us.  Count ourselves in the new generation. */
+        conflate_atomic_decr(readers);
+    }
+
+    rv = slot->current;
+    if (rv) {
+        /* Published snapshots are always arena chains */
+        conflate_atomic_incr(&rv->arena->refs);
+    }
+    conflate_atomic_decr(readers);
+
+    return rv;
 }
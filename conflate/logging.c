@@ -1,6 +1,15 @@
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <assert.h>
+
+#ifndef WIN32
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#endif
 
 #include <libconflate/conflate.h>
 #include "conflate_internal.h"
@@ -20,15 +29,676 @@ static char* lvl_name(enum conflate_log_level lvl)
     return rv;
 }
 
+static void log_to_stderr(enum conflate_log_level lvl, const char *msg,
+                          va_list ap)
+{
+    char fmt[512];
+
+    snprintf(fmt, sizeof(fmt), "%s: %s\n", lvl_name(lvl), msg);
+    vfprintf(stderr, fmt, ap);
+}
+
 void conflate_stderr_logger(void *userdata, enum conflate_log_level lvl,
                             const char *msg, ...)
 {
-    char fmt[512];
     va_list ap;
 
-    snprintf(fmt, sizeof(fmt), "%s: %s\n", lvl_name(lvl), msg);
     va_start(ap, msg);
-    vfprintf(stderr, fmt, ap);
+    log_to_stderr(lvl, msg, ap);
     va_end(ap);
     (void)userdata;
 }
+
+/* ------------------------------------------------------------------------ */
+
+#ifndef WIN32
+
+/*
+ * The async logger.
+ *
+ * Each thread that logs gets a ring of its own, which only it writes
+ * and only the logger's thread reads, so neither ever waits for the
+ * other.  A message goes in as a record holding its level, when it
+ * was logged, its format and its arguments, with strings copied in.
+ * The logger's thread formats the records and writes them out.
+ *
+ * Rings are never freed.  When a thread exits, the next thread to
+ * start logging takes its ring over.
+ */
+
+#define LOG_RING_SIZE (64 * 1024)
+#define LOG_MAX_RECORD 4096
+#define LOG_POLL_MS 10
+#define LOG_OUTPUT_SIZE (64 * 1024)
+
+struct log_ring {
+    char *data;
+    volatile uint64_t head;    /* Bytes ever written, by the owner. */
+    volatile uint64_t tail;    /* Bytes ever read, by the logger. */
+    volatile int64_t dropped;  /* Messages that didn't fit. */
+    int64_t reported;          /* Drops the logger has owned up to. */
+    volatile int64_t owned;    /* A thread is writing to it. */
+    struct log_ring *next;
+};
+
+/*
+ * Records are 8-byte aligned, and a record with a size of 0 pads out
+ * the end of the ring.  The arguments follow the header, each in an
+ * 8-byte slot.  A string is its length and then its bytes and a '\0',
+ * padded to a whole number of slots.
+ */
+struct log_record {
+    uint32_t size;
+    uint32_t level;
+    hrtime_t when;
+    const char *format;
+    uint32_t args;        /* How many conversions were recorded. */
+    uint32_t padding;
+};
+
+union log_slot {
+    int64_t i;
+    double d;
+    void *p;
+};
+
+enum log_arg {
+    ARG_NONE,      /* %% */
+    ARG_INT,
+    ARG_LONG,
+    ARG_LLONG,
+    ARG_SIZE,
+    ARG_INTMAX,
+    ARG_PTRDIFF,
+    ARG_DOUBLE,
+    ARG_LDOUBLE,
+    ARG_STRING,
+    ARG_POINTER,
+    ARG_COUNT,     /* %n, which is skipped */
+    ARG_UNKNOWN    /* Anything else; the rest is written as it is. */
+};
+
+/* A conversion in a format, from its '%' up to end. */
+struct log_spec {
+    const char *end;
+    int stars;     /* '*' widths and precisions, each an int argument. */
+    int precision; /* -1 if there's none, or it's the last '*'. */
+    bool precision_star;
+    enum log_arg arg;
+};
+
+static struct {
+    pthread_once_t once;
+    pthread_key_t key;
+    bool started;
+    struct log_ring * volatile rings;
+
+    cb_mutex_t mutex;
+    cb_cond_t wake;       /* Someone wants a pass made now. */
+    cb_cond_t passed;     /* A pass over every ring has finished. */
+    uint64_t passes;
+    bool hurry;
+
+    volatile int64_t written;
+    struct timeval started_at;
+    hrtime_t started_hrtime;
+} logger = { PTHREAD_ONCE_INIT };
+
+static __thread struct log_ring *my_ring = NULL;
+
+static const char *parse_spec(const char *p, struct log_spec *spec)
+{
+    enum { NONE, HH, H, L, LL, Z, J, T, BIG_L } length = NONE;
+
+    spec->stars = 0;
+    spec->precision = -1;
+    spec->precision_star = false;
+    /* Flags and width */
+    for (p++; *p && strchr("-+ #0123456789*'", *p); p++) {
+        if (*p == '*') {
+            spec->stars++;
+        }
+    }
+    if (*p == '.') {
+        if (*++p == '*') {
+            spec->stars++;
+            spec->precision_star = true;
+            p++;
+        } else {
+            spec->precision = 0;
+            for (; *p >= '0' && *p <= '9'; p++) {
+                spec->precision = spec->precision * 10 + (*p - '0');
+            }
+        }
+    }
+
+    switch (*p) {
+    case 'h': length = p[1] == 'h' ? HH : H; break;
+    case 'l': length = p[1] == 'l' ? LL : L; break;
+    case 'q': length = LL; break;
+    case 'z': length = Z; break;
+    case 'j': length = J; break;
+    case 't': length = T; break;
+    case 'L': length = BIG_L; break;
+    }
+    if (length == HH || length == LL) {
+        p += *p == 'q' ? 1 : 2;
+    } else if (length != NONE) {
+        p++;
+    }
+
+    switch (*p) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+        switch (length) {
+        case L: spec->arg = ARG_LONG; break;
+        case LL: spec->arg = ARG_LLONG; break;
+        case Z: spec->arg = ARG_SIZE; break;
+        case J: spec->arg = ARG_INTMAX; break;
+        case T: spec->arg = ARG_PTRDIFF; break;
+        default: spec->arg = ARG_INT; break;
+        }
+        break;
+    case 'c':
+        spec->arg = ARG_INT;
+        break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+    case 'a': case 'A':
+        spec->arg = length == BIG_L ? ARG_LDOUBLE : ARG_DOUBLE;
+        break;
+    case 's':
+        spec->arg = ARG_STRING;
+        break;
+    case 'p':
+        spec->arg = ARG_POINTER;
+        break;
+    case 'n':
+        spec->arg = ARG_COUNT;
+        break;
+    case '%':
+        spec->arg = ARG_NONE;
+        break;
+    default:
+        spec->arg = ARG_UNKNOWN;
+        return p;
+    }
+    spec->end = p + 1;
+    return spec->end;
+}
+
+/* Builds a record in a buffer of LOG_MAX_RECORD bytes. */
+struct record_builder {
+    char *data;
+    size_t used;
+};
+
+static bool put_slot(struct record_builder *b, union log_slot slot)
+{
+    if (b->used + sizeof(slot) > LOG_MAX_RECORD) {
+        return false;
+    }
+    memcpy(b->data + b->used, &slot, sizeof(slot));
+    b->used += sizeof(slot);
+    return true;
+}
+
+static bool put_int(struct record_builder *b, int64_t i)
+{
+    union log_slot slot;
+    slot.i = i;
+    return put_slot(b, slot);
+}
+
+/*
+ * Copy a string in, cutting it short if there isn't room for it all.
+ * With a precision, the string needn't be terminated.
+ */
+static bool put_str(struct record_builder *b, const char *s, int precision)
+{
+    size_t len;
+    size_t room;
+
+    if (s == NULL) {
+        s = "(null)";
+    }
+    len = precision < 0 ? strlen(s) : strnlen(s, (size_t)precision);
+
+    if (b->used + 2 * sizeof(union log_slot) > LOG_MAX_RECORD) {
+        return false;
+    }
+    room = LOG_MAX_RECORD - b->used - sizeof(union log_slot) - 1;
+    if (len > room) {
+        len = room;
+    }
+    put_int(b, (int64_t)len);
+    memcpy(b->data + b->used, s, len);
+    b->data[b->used + len] = '\0';
+    b->used += (len + 8) & ~(size_t)7;
+    return true;
+}
+
+/* Record the arguments a format calls for, as many as will fit. */
+static uint32_t put_args(struct record_builder *b, const char *format,
+                         va_list ap)
+{
+    struct log_spec spec;
+    const char *p = format;
+    uint32_t rv = 0;
+    bool fits = true;
+
+    while (fits && (p = strchr(p, '%')) != NULL) {
+        union log_slot slot;
+        int precision, i;
+
+        p = parse_spec(p, &spec);
+        if (spec.arg == ARG_UNKNOWN) {
+            break;
+        }
+        precision = spec.precision;
+        for (i = 0; i < spec.stars; i++) {
+            int star = va_arg(ap, int);
+            fits = fits && put_int(b, star);
+            if (spec.precision_star && i == spec.stars - 1) {
+                /* A negative one is taken as if there were none */
+                precision = star < 0 ? -1 : star;
+            }
+        }
+
+        slot.i = 0;
+        switch (spec.arg) {
+        case ARG_INT: slot.i = va_arg(ap, int); break;
+        case ARG_LONG: slot.i = va_arg(ap, long); break;
+        case ARG_LLONG: slot.i = va_arg(ap, long long); break;
+        case ARG_SIZE: slot.i = (int64_t)va_arg(ap, size_t); break;
+        case ARG_INTMAX: slot.i = (int64_t)va_arg(ap, intmax_t); break;
+        case ARG_PTRDIFF: slot.i = va_arg(ap, ptrdiff_t); break;
+        case ARG_DOUBLE: slot.d = va_arg(ap, double); break;
+        case ARG_LDOUBLE: slot.d = (double)va_arg(ap, long double); break;
+        case ARG_POINTER: slot.p = va_arg(ap, void *); break;
+        case ARG_COUNT: (void)va_arg(ap, int *); break;
+        default: break;
+        }
+
+        if (spec.arg == ARG_STRING) {
+            fits = fits && put_str(b, va_arg(ap, const char *), precision);
+        } else if (spec.arg != ARG_NONE && spec.arg != ARG_COUNT) {
+            fits = fits && put_slot(b, slot);
+        }
+        if (fits) {
+            rv++;
+        }
+    }
+    return rv;
+}
+
+/* The bytes to append formatted output to. */
+static void reserve(struct conflate_buffer *b, size_t len)
+{
+    if (b->used + len > b->size) {
+        size_t new_size = b->size ? b->size : 1024;
+        while (new_size < b->used + len) {
+            new_size <<= 1;
+        }
+        b->data = realloc(b->data, new_size);
+        assert(b->data);
+        b->size = new_size;
+    }
+}
+
+static void append(struct conflate_buffer *b, const char *data, size_t len)
+{
+    reserve(b, len);
+    memcpy(b->data + b->used, data, len);
+    b->used += len;
+}
+
+static void appendf(struct conflate_buffer *b, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    reserve(b, 64);
+    va_start(ap, fmt);
+    len = vsnprintf(b->data + b->used, b->size - b->used, fmt, ap);
+    va_end(ap);
+    if (len > 0 && (size_t)len >= b->size - b->used) {
+        reserve(b, (size_t)len + 1);
+        va_start(ap, fmt);
+        len = vsnprintf(b->data + b->used, b->size - b->used, fmt, ap);
+        va_end(ap);
+    }
+    if (len > 0) {
+        b->used += (size_t)len;
+    }
+}
+
+/* Start a line with when it was logged and how bad it is. */
+static void append_prefix(struct conflate_buffer *out, hrtime_t when,
+                          enum conflate_log_level level)
+{
+    hrtime_t since = when - logger.started_hrtime;
+    time_t secs = logger.started_at.tv_sec + (time_t)(since / 1000000000);
+    long usecs = logger.started_at.tv_usec + (long)(since % 1000000000 / 1000);
+    struct tm tm;
+    char stamp[32];
+
+    if (usecs >= 1000000) {
+        secs++;
+        usecs -= 1000000;
+    }
+    localtime_r(&secs, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    appendf(out, "%s.%03ld %s: ", stamp, usecs / 1000, lvl_name(level));
+}
+
+/*
+ * Write a conversion with its recorded argument.  Any '*' in it is
+ * replaced by the recorded width or precision.
+ */
+static const union log_slot *append_spec(struct conflate_buffer *out,
+                                         const char *start,
+                                         const struct log_spec *spec,
+                                         const union log_slot *slot)
+{
+    char fmt[64];
+    size_t used = 0;
+    const char *p;
+
+    for (p = start; p < spec->end && used < sizeof(fmt) - 24; p++) {
+        int value;
+        if (*p != '*') {
+            fmt[used++] = *p;
+            continue;
+        }
+        value = (int)(slot++)->i;
+        if (value < 0 && fmt[used - 1] == '.') {
+            /* A negative precision is as good as none */
+            used--;
+        } else {
+            used += (size_t)snprintf(fmt + used, sizeof(fmt) - used, "%d",
+                                     value);
+        }
+    }
+    fmt[used] = '\0';
+
+    switch (spec->arg) {
+    case ARG_INT: appendf(out, fmt, (int)slot->i); break;
+    case ARG_LONG: appendf(out, fmt, (long)slot->i); break;
+    case ARG_LLONG: appendf(out, fmt, (long long)slot->i); break;
+    case ARG_SIZE: appendf(out, fmt, (size_t)slot->i); break;
+    case ARG_INTMAX: appendf(out, fmt, (intmax_t)slot->i); break;
+    case ARG_PTRDIFF: appendf(out, fmt, (ptrdiff_t)slot->i); break;
+    case ARG_DOUBLE: appendf(out, fmt, slot->d); break;
+    case ARG_LDOUBLE: appendf(out, fmt, (long double)slot->d); break;
+    case ARG_POINTER: appendf(out, fmt, slot->p); break;
+    case ARG_STRING:
+        appendf(out, fmt, (const char *)(slot + 1));
+        return slot + 1 + (slot->i + 8) / 8;
+    case ARG_NONE:
+        append(out, "%", 1);
+        return slot;
+    default:
+        return slot;
+    }
+    return slot + 1;
+}
+
+static void append_record(struct conflate_buffer *out,
+                          const struct log_record *record)
+{
+    const union log_slot *slot = (const union log_slot *)(record + 1);
+    const char *p = record->format;
+    uint32_t i;
+
+    append_prefix(out, record->when, (enum conflate_log_level)record->level);
+    for (i = 0; i < record->args; i++) {
+        struct log_spec spec;
+        const char *start = strchr(p, '%');
+        append(out, p, (size_t)(start - p));
+        p = parse_spec(start, &spec);
+        slot = append_spec(out, start, &spec, slot);
+    }
+    /* Everything after the last argument we have goes out as it is */
+    append(out, p, strlen(p));
+    append(out, "\n", 1);
+}
+
+static void write_out(struct conflate_buffer *out)
+{
+    if (out->used > 0) {
+        fwrite(out->data, 1, out->used, stderr);
+        fflush(stderr);
+        out->used = 0;
+    }
+}
+
+/* Format everything in a ring.  True if there was anything. */
+static bool drain_ring(struct log_ring *ring, struct conflate_buffer *out)
+{
+    uint64_t head = ring->head;
+    uint64_t tail = ring->tail;
+    int64_t dropped = ring->dropped;
+    bool rv = tail < head;
+
+    conflate_barrier();
+    while (tail < head) {
+        const struct log_record *record;
+        record = (const struct log_record *)(ring->data + tail % LOG_RING_SIZE);
+        if (record->size == 0) {
+            tail += LOG_RING_SIZE - tail % LOG_RING_SIZE;
+            continue;
+        }
+        append_record(out, record);
+        tail += record->size;
+        conflate_atomic_add64(&logger.written, 1);
+        if (out->used >= LOG_OUTPUT_SIZE) {
+            write_out(out);
+        }
+    }
+    /* Done with the records before the owner can reuse their space */
+    conflate_barrier();
+    ring->tail = tail;
+
+    if (dropped > ring->reported) {
+        append_prefix(out, gethrtime(), LOG_LVL_WARN);
+        appendf(out, "Dropped %lld log messages that came too fast\n",
+                (long long)(dropped - ring->reported));
+        ring->reported = dropped;
+    }
+    return rv;
+}
+
+static void run_logger(void *arg)
+{
+    struct conflate_buffer out;
+    (void)arg;
+
+    memset(&out, 0, sizeof(out));
+    while (true) {
+        struct log_ring *ring;
+        bool busy = false;
+
+        for (ring = logger.rings; ring; ring = ring->next) {
+            busy = drain_ring(ring, &out) || busy;
+        }
+        write_out(&out);
+
+        cb_mutex_enter(&logger.mutex);
+        logger.passes++;
+        cb_cond_broadcast(&logger.passed);
+        if (!busy && !logger.hurry) {
+            cb_cond_timedwait(&logger.wake, &logger.mutex, LOG_POLL_MS);
+        }
+        logger.hurry = false;
+        cb_mutex_exit(&logger.mutex);
+    }
+}
+
+/* When its thread exits, a ring is free for another to take. */
+static void release_ring(void *arg)
+{
+    struct log_ring *ring = arg;
+    conflate_barrier();
+    ring->owned = 0;
+}
+
+static void start_logger(void)
+{
+    cb_thread_t thread;
+
+    pthread_key_create(&logger.key, release_ring);
+    cb_mutex_initialize(&logger.mutex);
+    cb_cond_initialize(&logger.wake);
+    cb_cond_initialize(&logger.passed);
+    gettimeofday(&logger.started_at, NULL);
+    logger.started_hrtime = gethrtime();
+
+    if (cb_create_thread(&thread, run_logger, NULL, 1) != 0) {
+        perror("Failed to create logging thread");
+        return;
+    }
+    logger.started = true;
+}
+
+static struct log_ring *get_ring(void)
+{
+    struct log_ring *ring;
+
+    if (my_ring) {
+        return my_ring;
+    }
+
+    for (ring = logger.rings; ring; ring = ring->next) {
+        if (!ring->owned && conflate_cas_int64(&ring->owned, 0, 1)) {
+            break;
+        }
+    }
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(struct log_ring));
+        assert(ring);
+        ring->data = malloc(LOG_RING_SIZE);
+        assert(ring->data);
+        ring->owned = 1;
+        do {
+            ring->next = logger.rings;
+        } while (!conflate_cas_ptr(&logger.rings, ring->next, ring));
+    }
+
+    pthread_setspecific(logger.key, ring);
+    my_ring = ring;
+    return ring;
+}
+
+/* Copy a record into the ring, or count it as dropped if it's full. */
+static void push_record(struct log_ring *ring, const char *record,
+                        uint32_t size)
+{
+    uint64_t head = ring->head;
+    uint64_t tail = ring->tail;
+    size_t offset = head % LOG_RING_SIZE;
+    size_t pad = offset + size > LOG_RING_SIZE ? LOG_RING_SIZE - offset : 0;
+
+    conflate_barrier();
+    if (head + pad + size - tail > LOG_RING_SIZE) {
+        conflate_atomic_add64(&ring->dropped, 1);
+        return;
+    }
+    if (pad > 0) {
+        memset(ring->data + offset, 0, sizeof(uint32_t));
+        offset = 0;
+    }
+    memcpy(ring->data + offset, record, size);
+    conflate_barrier();
+    ring->head = head + pad + size;
+}
+
+void conflate_async_logger(void *userdata, enum conflate_log_level lvl,
+                           const char *msg, ...)
+{
+    union log_slot space[LOG_MAX_RECORD / sizeof(union log_slot)];
+    struct record_builder b;
+    struct log_record *record = (struct log_record *)space;
+    va_list ap;
+    (void)userdata;
+
+    pthread_once(&logger.once, start_logger);
+    if (!logger.started) {
+        va_start(ap, msg);
+        log_to_stderr(lvl, msg, ap);
+        va_end(ap);
+        return;
+    }
+
+    b.data = (char *)space;
+    b.used = sizeof(struct log_record);
+    record->level = (uint32_t)lvl;
+    record->when = gethrtime();
+    record->format = msg;
+    va_start(ap, msg);
+    record->args = put_args(&b, msg, ap);
+    va_end(ap);
+    record->size = (uint32_t)b.used;
+
+    push_record(get_ring(), b.data, record->size);
+}
+
+void conflate_async_logger_flush(void)
+{
+    uint64_t target;
+
+    if (!logger.started) {
+        return;
+    }
+
+    /* Wait for a whole pass that began after we got here */
+    cb_mutex_enter(&logger.mutex);
+    target = logger.passes + 2;
+    while (logger.passes < target) {
+        logger.hurry = true;
+        cb_cond_signal(&logger.wake);
+        cb_cond_wait(&logger.passed, &logger.mutex);
+    }
+    cb_mutex_exit(&logger.mutex);
+}
+
+bool conflate_async_log_stats(int64_t *written, int64_t *dropped)
+{
+    struct log_ring *ring;
+
+    if (!logger.started) {
+        return false;
+    }
+    *written = logger.written;
+    *dropped = 0;
+    for (ring = logger.rings; ring; ring = ring->next) {
+        *dropped += ring->dropped;
+    }
+    return true;
+}
+
+#else /* WIN32 */
+
+/* Without the thread-local rings this just writes to stderr. */
+void conflate_async_logger(void *userdata, enum conflate_log_level lvl,
+                           const char *msg, ...)
+{
+    va_list ap;
+
+    va_start(ap, msg);
+    log_to_stderr(lvl, msg, ap);
+    va_end(ap);
+    (void)userdata;
+}
+
+void conflate_async_logger_flush(void)
+{
+    fflush(stderr);
+}
+
+bool conflate_async_log_stats(int64_t *written, int64_t *dropped)
+{
+    (void)written;
+    (void)dropped;
+    return false;
+}
+
+#endif /* WIN32 */
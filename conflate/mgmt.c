@@ -0,0 +1,1262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+#include <libconflate/conflate.h>
+#include "conflate_internal.h"
+
+/*
+ * Management commands over a Unix domain socket.
+ *
+ * Every message is a frame: a four byte length, then that many bytes.
+ * Numbers are four bytes, most significant first, and strings are
+ * their length and then their bytes, with no terminating '\0'.
+ *
+ *   request: the command name, then a form
+ *   reply:   the result code, the number of forms, then the forms
+ *   form:    the number of pairs, then for each pair its key, the
+ *            number of values and the values
+ */
+
+/* Anything bigger is taken to be garbage, and the connection closed. */
+#define MGMT_MAX_FRAME (16 * 1024 * 1024)
+
+/* The most of a client's requests buffered, which always fits a frame. */
+#define MGMT_MAX_INPUT (MGMT_MAX_FRAME + 4)
+
+/* A client's requests wait while this much is waiting to go to it. */
+#define MGMT_MAX_OUTPUT (1024 * 1024)
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* ------------------------------------------------------------------------ */
+
+static void buffer_reserve(struct conflate_buffer *b, size_t len)
+{
+    if (b->used + len > b->size) {
+        size_t new_size = b->size ? b->size : 256;
+        while (new_size < b->used + len) {
+            new_size <<= 1;
+        }
+        b->data = realloc(b->data, new_size);
+        assert(b->data);
+        b->size = new_size;
+    }
+}
+
+static void store_u32(char *p, uint32_t v)
+{
+    p[0] = (char)(v >> 24);
+    p[1] = (char)(v >> 16);
+    p[2] = (char)(v >> 8);
+    p[3] = (char)v;
+}
+
+static uint32_t load_u32(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) |
+        ((uint32_t)u[2] << 8) | (uint32_t)u[3];
+}
+
+static void put_u32(struct conflate_buffer *b, uint32_t v)
+{
+    buffer_reserve(b, 4);
+    store_u32(b->data + b->used, v);
+    b->used += 4;
+}
+
+static void put_string(struct conflate_buffer *b, const char *s)
+{
+    size_t len = strlen(s);
+    put_u32(b, (uint32_t)len);
+    buffer_reserve(b, len);
+    memcpy(b->data + b->used, s, len);
+    b->used += len;
+}
+
+static void put_form(struct conflate_buffer *b, kvpair_t *form)
+{
+    kvpair_t *pair;
+    uint32_t count = 0;
+    int i;
+
+    for (pair = form; pair; pair = pair->next) {
+        count++;
+    }
+    put_u32(b, count);
+    for (pair = form; pair; pair = pair->next) {
+        put_string(b, pair->key);
+        for (count = 0; pair->values && pair->values[count]; count++) {
+        }
+        put_u32(b, count);
+        for (i = 0; pair->values && pair->values[i]; i++) {
+            put_string(b, pair->values[i]);
+        }
+    }
+}
+
+/* Leave room for a frame's length, filled in by end_frame(). */
+static size_t begin_frame(struct conflate_buffer *b)
+{
+    size_t rv = b->used;
+    put_u32(b, 0);
+    return rv;
+}
+
+static void end_frame(struct conflate_buffer *b, size_t start)
+{
+    store_u32(b->data + start, (uint32_t)(b->used - start - 4));
+}
+
+/* Reads a frame, noting rather than overrunning a short one. */
+struct mgmt_reader {
+    const char *data;
+    size_t left;
+    bool error;
+};
+
+static uint32_t get_u32(struct mgmt_reader *r)
+{
+    uint32_t rv;
+    if (r->error || r->left < 4) {
+        r->error = true;
+        return 0;
+    }
+    rv = load_u32(r->data);
+    r->data += 4;
+    r->left -= 4;
+    return rv;
+}
+
+static char *get_string(struct mgmt_reader *r)
+{
+    uint32_t len = get_u32(r);
+    char *rv;
+
+    if (r->error || r->left < len) {
+        r->error = true;
+        return NULL;
+    }
+    rv = malloc(len + 1);
+    assert(rv);
+    memcpy(rv, r->data, len);
+    rv[len] = '\0';
+    r->data += len;
+    r->left -= len;
+    return rv;
+}
+
+static kvpair_t *get_form(struct mgmt_reader *r)
+{
+    kvpair_t *head = NULL;
+    kvpair_t **tail = &head;
+    uint32_t pairs = get_u32(r);
+    uint32_t i, j;
+
+    for (i = 0; i < pairs && !r->error; i++) {
+        char *key = get_string(r);
+        uint32_t values = get_u32(r);
+        kvpair_t *pair;
+        if (r->error) {
+            free(key);
+            break;
+        }
+        pair = mk_kvpair(key, NULL);
+        free(key);
+        *tail = pair;
+        tail = &pair->next;
+        for (j = 0; j < values && !r->error; j++) {
+            char *value = get_string(r);
+            if (value) {
+                add_kvpair_value_nocopy(pair, value);
+            }
+        }
+    }
+    return head;
+}
+
+/* ------------------------------------------------------------------------ */
+
+void conflate_init_form_result(conflate_form_result *r)
+{
+    memset(r, 0, sizeof(conflate_form_result));
+}
+
+void conflate_free_form_result(conflate_form_result *r)
+{
+    free(r->buffer.data);
+    conflate_init_form_result(r);
+}
+
+void conflate_init_form(conflate_form_result *r)
+{
+    if (r->num_forms == 0) {
+        conflate_next_fieldset(r);
+    }
+}
+
+void conflate_next_fieldset(conflate_form_result *r)
+{
+    if (r->buffer.used == 0) {
+        /* Most replies are small, but a stats dump isn't */
+        buffer_reserve(&r->buffer, 4096);
+        r->buffer.used = FORM_RESULT_HEADER;
+    }
+    r->current = r->buffer.used;
+    put_u32(&r->buffer, 0);
+    r->num_forms++;
+}
+
+void conflate_add_field_multi(conflate_form_result *r, const char *k,
+                              const char **v)
+{
+    uint32_t count;
+
+    conflate_init_form(r);
+    put_string(&r->buffer, k);
+    for (count = 0; v[count]; count++) {
+    }
+    put_u32(&r->buffer, count);
+    for (count = 0; v[count]; count++) {
+        put_string(&r->buffer, v[count]);
+    }
+
+    count = load_u32(r->buffer.data + r->current);
+    store_u32(r->buffer.data + r->current, count + 1);
+}
+
+void conflate_add_field(conflate_form_result *r, const char *k, const char *v)
+{
+    const char *values[2];
+    values[0] = v;
+    values[1] = NULL;
+    conflate_add_field_multi(r, k, values);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void put_bytes(struct conflate_buffer *b, const char *data, size_t len)
+{
+    buffer_reserve(b, len);
+    memcpy(b->data + b->used, data, len);
+    b->used += len;
+}
+
+/* A string from the reader as a JSON string. */
+static void put_json_string(struct conflate_buffer *b, struct mgmt_reader *r)
+{
+    uint32_t len = get_u32(r);
+    uint32_t i, plain = 0;
+
+    if (r->error || r->left < len) {
+        r->error = true;
+        return;
+    }
+
+    put_bytes(b, "\"", 1);
+    for (i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)r->data[i];
+        char escape[8];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        /* Copy the run of characters that needed nothing done */
+        put_bytes(b, r->data + plain, i - plain);
+        plain = i + 1;
+        switch (c) {
+        case '"': put_bytes(b, "\\\"", 2); break;
+        case '\\': put_bytes(b, "\\\\", 2); break;
+        case '\n': put_bytes(b, "\\n", 2); break;
+        case '\r': put_bytes(b, "\\r", 2); break;
+        case '\t': put_bytes(b, "\\t", 2); break;
+        default:
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            put_bytes(b, escape, 6);
+        }
+    }
+    put_bytes(b, r->data + plain, len - plain);
+    put_bytes(b, "\"", 1);
+
+    r->data += len;
+    r->left -= len;
+}
+
+/* Write the forms a reader is at as JSON, straight from their encoding. */
+static bool put_json_forms(struct conflate_buffer *b, struct mgmt_reader *r,
+                           uint32_t num_forms)
+{
+    uint32_t i, j, k;
+
+    put_bytes(b, "[", 1);
+    for (i = 0; i < num_forms && !r->error; i++) {
+        uint32_t pairs = get_u32(r);
+        put_bytes(b, i ? ",{" : "{", i ? 2 : 1);
+        for (j = 0; j < pairs && !r->error; j++) {
+            uint32_t values;
+            if (j > 0) {
+                put_bytes(b, ",", 1);
+            }
+            put_json_string(b, r);
+            put_bytes(b, ":[", 2);
+            values = get_u32(r);
+            for (k = 0; k < values && !r->error; k++) {
+                if (k > 0) {
+                    put_bytes(b, ",", 1);
+                }
+                put_json_string(b, r);
+            }
+            put_bytes(b, "]", 1);
+        }
+        put_bytes(b, "}", 1);
+    }
+    /* Terminated, though the '\0' isn't counted */
+    put_bytes(b, "]", 2);
+    b->used--;
+
+    return !r->error;
+}
+
+char *conflate_form_result_json(const conflate_form_result *r, size_t *len)
+{
+    struct conflate_buffer b;
+    struct mgmt_reader reader;
+
+    memset(&b, 0, sizeof(b));
+    reader.data = r->buffer.data + FORM_RESULT_HEADER;
+    reader.left = r->num_forms ? r->buffer.used - FORM_RESULT_HEADER : 0;
+    reader.error = false;
+
+    /* What we wrote ourselves can't be malformed */
+    buffer_reserve(&b, reader.left + 64);
+    put_json_forms(&b, &reader, (uint32_t)r->num_forms);
+    assert(!reader.error);
+    if (len) {
+        *len = b.used;
+    }
+    return b.data;
+}
+
+/* ------------------------------------------------------------------------ */
+
+#ifndef WIN32
+
+enum pending_state {
+    PENDING_WAITING,   /* The command is still working on it. */
+    PENDING_DONE,      /* Ready to be sent. */
+    PENDING_ABANDONED  /* Not wanted any more; freed when it's completed. */
+};
+
+struct conflate_mgmt_pending {
+    struct mgmt_server *server;
+    struct command_def *command;
+    enum pending_state state;
+    enum conflate_mgmt_cb_result rv;
+    conflate_form_result result;
+    hrtime_t started;    /* When the command was called. */
+    hrtime_t deadline;   /* 0 if it can take as long as it likes. */
+    struct conflate_mgmt_pending *next;
+};
+
+struct mgmt_conn {
+    int fd;
+    struct conflate_buffer in;
+    struct conflate_buffer out;
+    size_t sent;
+    /* Replies held up behind a deferred one, in the order requested */
+    struct conflate_mgmt_pending *replies;
+    struct mgmt_conn *next;
+};
+
+/* Whether the server's thread has been let loose yet. */
+enum mgmt_state {
+    MGMT_OPENED,  /* Waiting for the handle to finish starting. */
+    MGMT_SERVING,
+    MGMT_CLOSED   /* The handle didn't start, so the thread has to go. */
+};
+
+/*
+ * One thread polls the listening socket and every client.  Commands
+ * run on it one at a time, in the order their requests arrive, though
+ * a command may defer its reply and complete it later from elsewhere.
+ */
+struct mgmt_server {
+    conflate_handle_t *handle;
+    int listen_fd;
+    cb_thread_t thread;
+    volatile enum mgmt_state state;
+    struct mgmt_conn *conns;
+    int num_conns;
+
+    cb_mutex_t mutex;  /* Guards the state of deferred replies. */
+    int wake[2];       /* A byte is written here when one is completed. */
+};
+
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static struct conflate_mgmt_pending *mk_pending(struct mgmt_server *server,
+                                               enum pending_state state)
+{
+    struct conflate_mgmt_pending *p = calloc(1, sizeof(struct conflate_mgmt_pending));
+    assert(p);
+    p->server = server;
+    p->state = state;
+    conflate_init_form_result(&p->result);
+    return p;
+}
+
+static void free_pending(struct conflate_mgmt_pending *p)
+{
+    conflate_free_form_result(&p->result);
+    free(p);
+}
+
+static void close_conn(struct mgmt_server *server, struct mgmt_conn *c)
+{
+    struct conflate_mgmt_pending *p, *next;
+
+    /* Replies still being worked on are freed when they're completed */
+    cb_mutex_enter(&server->mutex);
+    for (p = c->replies; p; p = next) {
+        next = p->next;
+        if (p->state == PENDING_WAITING) {
+            p->state = PENDING_ABANDONED;
+        } else {
+            free_pending(p);
+        }
+    }
+    cb_mutex_exit(&server->mutex);
+
+    close(c->fd);
+    free(c->in.data);
+    free(c->out.data);
+    free(c);
+}
+
+/* Put a reply on the connection's output. */
+static void send_reply(struct mgmt_conn *c, enum conflate_mgmt_cb_result rv,
+                       conflate_form_result *result)
+{
+    /* The forms are already encoded, after room for the header */
+    if (result->buffer.used == 0) {
+        buffer_reserve(&result->buffer, FORM_RESULT_HEADER);
+        result->buffer.used = FORM_RESULT_HEADER;
+    }
+    store_u32(result->buffer.data, (uint32_t)(result->buffer.used - 4));
+    store_u32(result->buffer.data + 4, (uint32_t)rv);
+    store_u32(result->buffer.data + 8, (uint32_t)result->num_forms);
+
+    if (c->out.used == 0) {
+        /* Nothing waiting to go out, so the reply can be sent as it is */
+        struct conflate_buffer empty = c->out;
+        c->out = result->buffer;
+        result->buffer = empty;
+    } else {
+        put_bytes(&c->out, result->buffer.data, result->buffer.used);
+    }
+}
+
+static void queue_reply(struct mgmt_conn *c, struct conflate_mgmt_pending *p)
+{
+    struct conflate_mgmt_pending **tail = &c->replies;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = p;
+}
+
+/* Send the replies at the front of the queue that are ready. */
+static void flush_replies(struct mgmt_server *server, struct mgmt_conn *c)
+{
+    cb_mutex_enter(&server->mutex);
+    while (c->replies && c->replies->state == PENDING_DONE) {
+        struct conflate_mgmt_pending *p = c->replies;
+        c->replies = p->next;
+        send_reply(c, p->rv, &p->result);
+        free_pending(p);
+    }
+    cb_mutex_exit(&server->mutex);
+}
+
+/*
+ * Answer RV_TIMEOUT for deferred replies that have run out of time,
+ * and lower timeout_ms to when the next one will.
+ */
+static void expire_replies(struct mgmt_server *server, struct mgmt_conn *c,
+                           hrtime_t now, int *timeout_ms)
+{
+    struct conflate_mgmt_pending **pp;
+
+    cb_mutex_enter(&server->mutex);
+    for (pp = &c->replies; *pp; pp = &(*pp)->next) {
+        struct conflate_mgmt_pending *p = *pp;
+        if (p->state != PENDING_WAITING || p->deadline == 0) {
+            continue;
+        }
+        if (p->deadline <= now) {
+            struct conflate_mgmt_pending *expired = mk_pending(server,
+                                                              PENDING_DONE);
+            expired->rv = RV_TIMEOUT;
+            expired->next = p->next;
+            *pp = expired;
+            p->state = PENDING_ABANDONED;
+            p->next = NULL;
+            if (p->command) {
+                conflate_atomic_add64(&p->command->timeouts, 1);
+            }
+        } else {
+            int left = (int)((p->deadline - now + 999999) / 1000000);
+            if (*timeout_ms < 0 || left < *timeout_ms) {
+                *timeout_ms = left;
+            }
+        }
+    }
+    cb_mutex_exit(&server->mutex);
+}
+
+/* Run a request and queue its reply.  False if it's malformed. */
+static bool handle_request(struct mgmt_server *server, struct mgmt_conn *c,
+                           const char *data, size_t len)
+{
+    struct mgmt_reader r;
+    conflate_form_result result;
+    enum conflate_mgmt_cb_result rv;
+    kvpair_t *form;
+    char *cmd;
+
+    r.data = data;
+    r.left = len;
+    r.error = false;
+    cmd = get_string(&r);
+    form = get_form(&r);
+    if (r.error || r.left != 0) {
+        free(cmd);
+        free_kvpair(form);
+        return false;
+    }
+
+    conflate_init_form_result(&result);
+    result.server = server;
+    rv = conflate_dispatch_mgmt_cb(server->handle, cmd, true, form, &result);
+
+    if (result.deferred) {
+        queue_reply(c, result.deferred);
+    } else if (c->replies) {
+        /* It has to wait for the deferred reply ahead of it */
+        struct conflate_mgmt_pending *p = mk_pending(server, PENDING_DONE);
+        p->rv = rv == RV_PENDING ? RV_ERROR : rv;
+        p->result = result;
+        conflate_init_form_result(&result);
+        queue_reply(c, p);
+    } else {
+        /* Nothing will ever complete a reply that wasn't deferred */
+        send_reply(c, rv == RV_PENDING ? RV_ERROR : rv, &result);
+    }
+
+    conflate_free_form_result(&result);
+    free_kvpair(form);
+    free(cmd);
+    return true;
+}
+
+/*
+ * Whether a client has to wait for what it already asked for before
+ * any more of its requests are run, or even read.
+ */
+static bool backlogged(const struct mgmt_conn *c)
+{
+    return c->replies != NULL || c->out.used - c->sent > MGMT_MAX_OUTPUT;
+}
+
+/* Whether there's a whole request (or garbage) ready to run. */
+static bool have_request(const struct mgmt_conn *c)
+{
+    return c->in.used >= 4 && c->in.used - 4 >= load_u32(c->in.data);
+}
+
+/* Read what the client sent, up to MGMT_MAX_INPUT. */
+static bool read_requests(struct mgmt_conn *c)
+{
+    while (c->in.used < MGMT_MAX_INPUT) {
+        size_t room;
+        ssize_t r;
+        buffer_reserve(&c->in, 4096);
+        room = c->in.size - c->in.used;
+        if (room > MGMT_MAX_INPUT - c->in.used) {
+            room = MGMT_MAX_INPUT - c->in.used;
+        }
+        r = recv(c->fd, c->in.data + c->in.used, room, 0);
+        if (r > 0) {
+            c->in.used += (size_t)r;
+        } else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (r < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Run the complete requests that have been read, until it's backlogged. */
+static bool run_requests(struct mgmt_server *server, struct mgmt_conn *c)
+{
+    size_t consumed = 0;
+
+    while (!backlogged(c) && c->in.used - consumed >= 4) {
+        uint32_t len = load_u32(c->in.data + consumed);
+        if (len > MGMT_MAX_FRAME) {
+            return false;
+        }
+        if (c->in.used - consumed - 4 < len) {
+            break;
+        }
+        if (!handle_request(server, c, c->in.data + consumed + 4, len)) {
+            return false;
+        }
+        consumed += 4 + len;
+    }
+
+    if (consumed > 0) {
+        memmove(c->in.data, c->in.data + consumed, c->in.used - consumed);
+        c->in.used -= consumed;
+    }
+    return true;
+}
+
+static bool write_replies(struct mgmt_conn *c)
+{
+    while (c->sent < c->out.used) {
+        ssize_t w = send(c->fd, c->out.data + c->sent, c->out.used - c->sent,
+                         MSG_NOSIGNAL);
+        if (w > 0) {
+            c->sent += (size_t)w;
+        } else if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        } else if (w < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return false;
+        }
+    }
+    c->out.used = c->sent = 0;
+    return true;
+}
+
+static void accept_conns(struct mgmt_server *server)
+{
+    int fd;
+
+    while ((fd = accept(server->listen_fd, NULL, NULL)) >= 0) {
+        struct mgmt_conn *c;
+        if (!set_nonblocking(fd)) {
+            close(fd);
+            continue;
+        }
+        c = calloc(1, sizeof(struct mgmt_conn));
+        assert(c);
+        c->fd = fd;
+        c->next = server->conns;
+        server->conns = c;
+        server->num_conns++;
+    }
+}
+
+static void run_mgmt_server(void *arg)
+{
+    struct mgmt_server *server = (struct mgmt_server *) arg;
+    struct pollfd *fds = NULL;
+    int allocated = 0;
+    char drain[64];
+
+    /* Nothing is accepted until the handle is sure to start */
+    while (server->state == MGMT_OPENED) {
+        struct pollfd wake;
+        wake.fd = server->wake[0];
+        wake.events = POLLIN;
+        if (poll(&wake, 1, -1) > 0) {
+            while (read(server->wake[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+    }
+    if (server->state == MGMT_CLOSED) {
+        return;
+    }
+
+    while (true) {
+        struct mgmt_conn *c, **cp;
+        hrtime_t now = gethrtime();
+        int i, n = 2, timeout_ms = -1;
+
+        if (allocated < server->num_conns + 2) {
+            allocated = (server->num_conns + 2) * 2;
+            fds = realloc(fds, sizeof(struct pollfd) * allocated);
+            assert(fds);
+        }
+        fds[0].fd = server->listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = server->wake[0];
+        fds[1].events = POLLIN;
+        for (c = server->conns; c; c = c->next, n++) {
+            expire_replies(server, c, now, &timeout_ms);
+            flush_replies(server, c);
+            fds[n].fd = c->fd;
+            fds[n].events = 0;
+            if (!backlogged(c)) {
+                fds[n].events |= POLLIN;
+                if (have_request(c)) {
+                    /* Left over from when it was backlogged */
+                    timeout_ms = 0;
+                }
+            }
+            if (c->sent < c->out.used) {
+                fds[n].events |= POLLOUT;
+            }
+        }
+
+        if (poll(fds, n, timeout_ms) < 0) {
+            if (errno != EINTR) {
+                server->handle->conf->log(server->handle->conf->userdata,
+                                          LOG_LVL_ERROR,
+                                          "Management socket poll failed: %s",
+                                          strerror(errno));
+                sleep(1);
+            }
+            continue;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            while (read(server->wake[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+
+        /* New connections go on the front of the list, so take them
+           after the ones that were polled */
+        for (i = 2, cp = &server->conns; *cp; i++) {
+            bool keep = true;
+            c = *cp;
+            if (!(fds[i].events & POLLIN) &&
+                (fds[i].revents & (POLLHUP | POLLERR))) {
+                /* Gone, and there's no reading what's left */
+                keep = false;
+            } else if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                keep = read_requests(c);
+            }
+            if (keep) {
+                keep = run_requests(server, c);
+            }
+            if (keep) {
+                flush_replies(server, c);
+            }
+            if (keep && c->sent < c->out.used) {
+                keep = write_replies(c);
+            }
+            if (keep) {
+                cp = &c->next;
+            } else {
+                *cp = c->next;
+                close_conn(server, c);
+                server->num_conns--;
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            accept_conns(server);
+        }
+    }
+}
+
+/*
+ * Make a listening socket at path that only we can connect to.  It's
+ * bound in a directory nobody else can get into, made private, and
+ * only then moved to where clients look for it.
+ */
+static int listen_privately(conflate_config_t *conf, const char *path)
+{
+    size_t dir_len = strlen(path) + sizeof(".XXXXXX");
+    char *dir = malloc(dir_len);
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    assert(dir);
+    /* Room for the socket's name in the directory, "/s" */
+    if (dir_len + 2 > sizeof(addr.sun_path)) {
+        conf->log(conf->userdata, LOG_LVL_ERROR,
+                  "Management socket path is too long: %s", path);
+        free(dir);
+        return -1;
+    }
+
+    /* A socket left behind by an agent that went away gets replaced,
+       but don't go replacing anything else */
+    if (lstat(path, &st) == 0 && !S_ISSOCK(st.st_mode)) {
+        conf->log(conf->userdata, LOG_LVL_ERROR,
+                  "%s is in the way of the management socket", path);
+        free(dir);
+        return -1;
+    }
+
+    snprintf(dir, dir_len, "%s.XXXXXX", path);
+    if (mkdtemp(dir) == NULL) {
+        conf->log(conf->userdata, LOG_LVL_ERROR,
+                  "Failed to create a directory for %s: %s", path,
+                  strerror(errno));
+        free(dir);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/s", dir);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        chmod(addr.sun_path, S_IRUSR | S_IWUSR) != 0 ||
+        listen(fd, 128) != 0 || !set_nonblocking(fd) ||
+        rename(addr.sun_path, path) != 0) {
+        conf->log(conf->userdata, LOG_LVL_ERROR,
+                  "Failed to listen on %s: %s", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        unlink(addr.sun_path);
+        fd = -1;
+    }
+
+    rmdir(dir);
+    free(dir);
+    return fd;
+}
+
+bool conflate_open_mgmt_server(conflate_handle_t *handle)
+{
+    conflate_config_t *conf = handle->conf;
+    struct mgmt_server *server;
+    int fd = listen_privately(conf, conf->mgmt_socket_path);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    server = calloc(1, sizeof(struct mgmt_server));
+    assert(server);
+    if (pipe(server->wake) != 0 || !set_nonblocking(server->wake[0]) ||
+        !set_nonblocking(server->wake[1])) {
+        conf->log(conf->userdata, LOG_LVL_ERROR,
+                  "Failed to create the management wakeup pipe: %s",
+                  strerror(errno));
+        close(fd);
+        unlink(conf->mgmt_socket_path);
+        free(server);
+        return false;
+    }
+    server->handle = handle;
+    server->listen_fd = fd;
+    server->state = MGMT_OPENED;
+    cb_mutex_initialize(&server->mutex);
+
+    conflate_init_commands();
+    handle->mgmt_server = server;
+
+    /* Joinable, so conflate_close_mgmt_server() can wait for it */
+    if (cb_create_thread(&server->thread, run_mgmt_server, server, 0) != 0) {
+        perror("Failed to create management thread");
+        handle->mgmt_server = NULL;
+        cb_mutex_destroy(&server->mutex);
+        close(server->wake[0]);
+        close(server->wake[1]);
+        close(fd);
+        unlink(conf->mgmt_socket_path);
+        free(server);
+        return false;
+    }
+
+    return true;
+}
+
+static void set_state(struct mgmt_server *server, enum mgmt_state state)
+{
+    server->state = state;
+    conflate_barrier();
+    if (write(server->wake[1], "", 1) < 0) {
+        /* The pipe's full, so the server has wakeups waiting anyway */
+    }
+}
+
+void conflate_serve_mgmt_server(conflate_handle_t *handle)
+{
+    set_state(handle->mgmt_server, MGMT_SERVING);
+}
+
+void conflate_close_mgmt_server(conflate_handle_t *handle)
+{
+    struct mgmt_server *server = handle->mgmt_server;
+
+    set_state(server, MGMT_CLOSED);
+    cb_join_thread(server->thread);
+
+    handle->mgmt_server = NULL;
+    cb_mutex_destroy(&server->mutex);
+    close(server->wake[0]);
+    close(server->wake[1]);
+    close(server->listen_fd);
+    unlink(handle->conf->mgmt_socket_path);
+    free(server);
+}
+
+bool conflate_start_mgmt_server(conflate_handle_t *handle)
+{
+    if (!conflate_open_mgmt_server(handle)) {
+        return false;
+    }
+    conflate_serve_mgmt_server(handle);
+    return true;
+}
+
+conflate_mgmt_pending_t *conflate_mgmt_defer(conflate_form_result *r)
+{
+    struct conflate_mgmt_pending *p;
+
+    if (r->server == NULL) {
+        return NULL;
+    }
+    if (r->deferred == NULL) {
+        p = mk_pending(r->server, PENDING_WAITING);
+        p->command = r->command;
+        p->started = r->started;
+        if (p->command && p->command->timeout_ms > 0) {
+            p->deadline = gethrtime() +
+                (hrtime_t)p->command->timeout_ms * 1000000;
+        }
+        r->deferred = p;
+    }
+    return r->deferred;
+}
+
+conflate_form_result *conflate_mgmt_pending_form(conflate_mgmt_pending_t *p)
+{
+    return &p->result;
+}
+
+void conflate_mgmt_complete(conflate_mgmt_pending_t *p,
+                            enum conflate_mgmt_cb_result rv)
+{
+    struct mgmt_server *server = p->server;
+    bool abandoned;
+
+    if (p->command) {
+        conflate_histogram_record(&p->command->latency,
+                                  gethrtime() - p->started);
+        if (rv != RV_OK) {
+            conflate_atomic_add64(&p->command->failures, 1);
+        }
+    }
+
+    cb_mutex_enter(&server->mutex);
+    abandoned = p->state == PENDING_ABANDONED;
+    if (!abandoned) {
+        p->rv = rv == RV_PENDING ? RV_ERROR : rv;
+        p->state = PENDING_DONE;
+    }
+    cb_mutex_exit(&server->mutex);
+
+    if (abandoned) {
+        free_pending(p);
+    } else if (write(server->wake[1], "", 1) < 0) {
+        /* The pipe's full, so the server has wakeups waiting anyway */
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+
+struct conflate_mgmt_client {
+    int fd;
+    struct conflate_buffer buffer;
+};
+
+static bool send_fully(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t w = send(fd, data, len, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return false;
+        }
+        data += w;
+        len -= (size_t)w;
+    }
+    return true;
+}
+
+static bool recv_fully(int fd, char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t r = recv(fd, data, len, 0);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        data += r;
+        len -= (size_t)r;
+    }
+    return true;
+}
+
+conflate_mgmt_client_t *conflate_mgmt_connect(const char *path)
+{
+    conflate_mgmt_client_t *client;
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    client = calloc(1, sizeof(conflate_mgmt_client_t));
+    assert(client);
+    client->fd = fd;
+    return client;
+}
+
+/*
+ * Send a request and read the reply.  The reader is left at the reply's
+ * forms, which are in the client's buffer until the next call.
+ */
+static bool round_trip(conflate_mgmt_client_t *client, const char *cmd,
+                       kvpair_t *form, enum conflate_mgmt_cb_result *rv,
+                       uint32_t *num_forms, struct mgmt_reader *r)
+{
+    struct conflate_buffer *b = &client->buffer;
+    uint32_t len;
+    size_t start;
+
+    b->used = 0;
+    start = begin_frame(b);
+    put_string(b, cmd);
+    put_form(b, form);
+    end_frame(b, start);
+
+    if (!send_fully(client->fd, b->data, b->used) ||
+        !recv_fully(client->fd, b->data, 4)) {
+        return false;
+    }
+    len = load_u32(b->data);
+    if (len > MGMT_MAX_FRAME) {
+        return false;
+    }
+    b->used = 4;
+    buffer_reserve(b, len);
+    if (!recv_fully(client->fd, b->data + 4, len)) {
+        return false;
+    }
+
+    r->data = b->data + 4;
+    r->left = len;
+    r->error = false;
+    *rv = (enum conflate_mgmt_cb_result)get_u32(r);
+    *num_forms = get_u32(r);
+    /* Every form takes at least four bytes */
+    return !r->error && *num_forms <= r->left / 4;
+}
+
+enum conflate_mgmt_cb_result conflate_mgmt_call(conflate_mgmt_client_t *client,
+                                                const char *cmd,
+                                                kvpair_t *form,
+                                                kvpair_t ***reply,
+                                                int *num_reply)
+{
+    struct mgmt_reader r;
+    enum conflate_mgmt_cb_result rv;
+    kvpair_t **forms;
+    uint32_t num_forms, i;
+
+    if (reply) {
+        *reply = NULL;
+        *num_reply = 0;
+    }
+
+    if (!round_trip(client, cmd, form, &rv, &num_forms, &r)) {
+        return RV_ERROR;
+    }
+
+    forms = calloc(num_forms + 1, sizeof(kvpair_t *));
+    assert(forms);
+    for (i = 0; i < num_forms && !r.error; i++) {
+        forms[i] = get_form(&r);
+    }
+    if (r.error) {
+        conflate_mgmt_free_reply(forms, (int)num_forms);
+        return RV_ERROR;
+    }
+
+    if (reply) {
+        *reply = forms;
+        *num_reply = (int)num_forms;
+    } else {
+        conflate_mgmt_free_reply(forms, (int)num_forms);
+    }
+    return rv;
+}
+
+enum conflate_mgmt_cb_result conflate_mgmt_call_json(conflate_mgmt_client_t *client,
+                                                     const char *cmd,
+                                                     kvpair_t *form,
+                                                     char **json)
+{
+    struct conflate_buffer b;
+    struct mgmt_reader r;
+    enum conflate_mgmt_cb_result rv;
+    uint32_t num_forms;
+
+    *json = NULL;
+    if (!round_trip(client, cmd, form, &rv, &num_forms, &r)) {
+        return RV_ERROR;
+    }
+
+    memset(&b, 0, sizeof(b));
+    buffer_reserve(&b, r.left + 64);
+    if (!put_json_forms(&b, &r, num_forms)) {
+        free(b.data);
+        return RV_ERROR;
+    }
+    *json = b.data;
+    return rv;
+}
+
+void conflate_mgmt_close(conflate_mgmt_client_t *client)
+{
+    if (client) {
+        close(client->fd);
+        free(client->buffer.data);
+        free(client);
+    }
+}
+
+#else /* WIN32 */
+
+bool conflate_open_mgmt_server(conflate_handle_t *handle)
+{
+    handle->conf->log(handle->conf->userdata, LOG_LVL_ERROR,
+                      "Management sockets aren't supported on this platform");
+    return false;
+}
+
+void conflate_serve_mgmt_server(conflate_handle_t *handle)
+{
+    (void)handle;
+}
+
+void conflate_close_mgmt_server(conflate_handle_t *handle)
+{
+    (void)handle;
+}
+
+bool conflate_start_mgmt_server(conflate_handle_t *handle)
+{
+    return conflate_open_mgmt_server(handle);
+}
+
+/* Without the management socket nothing can take a deferred reply. */
+conflate_mgmt_pending_t *conflate_mgmt_defer(conflate_form_result *r)
+{
+    (void)r;
+    return NULL;
+}
+
+conflate_form_result *conflate_mgmt_pending_form(conflate_mgmt_pending_t *p)
+{
+    (void)p;
+    return NULL;
+}
+
+void conflate_mgmt_complete(conflate_mgmt_pending_t *p,
+                            enum conflate_mgmt_cb_result rv)
+{
+    (void)p;
+    (void)rv;
+}
+
+conflate_mgmt_client_t *conflate_mgmt_connect(const char *path)
+{
+    (void)path;
+    return NULL;
+}
+
+enum conflate_mgmt_cb_result conflate_mgmt_call(conflate_mgmt_client_t *client,
+                                                const char *cmd,
+                                                kvpair_t *form,
+                                                kvpair_t ***reply,
+                                                int *num_reply)
+{
+    (void)client;
+    (void)cmd;
+    (void)form;
+    if (reply) {
+        *reply = NULL;
+        *num_reply = 0;
+    }
+    return RV_ERROR;
+}
+
+enum conflate_mgmt_cb_result conflate_mgmt_call_json(conflate_mgmt_client_t *client,
+                                                     const char *cmd,
+                                                     kvpair_t *form,
+                                                     char **json)
+{
+    (void)client;
+    (void)cmd;
+    (void)form;
+    *json = NULL;
+    return RV_ERROR;
+}
+
+void conflate_mgmt_close(conflate_mgmt_client_t *client)
+{
+    (void)client;
+}
+
+#endif /* WIN32 */
+
+void conflate_mgmt_free_reply(kvpair_t **reply, int num_reply)
+{
+    int i;
+    for (i = 0; i < num_reply; i++) {
+        free_kvpair(reply[i]);
+    }
+    free(reply);
+}
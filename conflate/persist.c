@@ -2,50 +2,450 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef WIN32
+#include <io.h>
+#define open _open
+#define read _read
+#define write _write
+#define close _close
+#define fsync _commit
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#define O_BINARY 0
+#endif
 
 #include <libconflate/conflate.h>
 #include "conflate_internal.h"
 
+/*
+ * A saved config is a header followed by one record per pair:
+ *
+ *   uint32_t key_len, num_values
+ *   uint32_t value_len[num_values]
+ *   key '\0' value '\0' ...        (padded out to 8 bytes)
+ *
+ * Everything is in host byte order, since a saved config is only a
+ * cache for the machine that wrote it.  Strings are stored with their
+ * terminators so the loaded pairs can point straight into the file.
+ */
+#define PERSIST_MAGIC 0x4c464e43 /* "CNFL" */
+#define PERSIST_VERSION 1
+#define PERSIST_ALIGN 8
+
+struct persist_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t crc;       /* CRC-32 of everything after the header. */
+    uint64_t body_size;
+};
+
+static size_t persist_align(size_t size)
+{
+    return (size + PERSIST_ALIGN - 1) & ~(size_t)(PERSIST_ALIGN - 1);
+}
+
+static size_t record_size(kvpair_t *pair)
+{
+    size_t rv = sizeof(uint32_t) * (2 + pair->used_values);
+    int i;
+
+    rv += strlen(pair->key) + 1;
+    for (i = 0; i < pair->used_values; i++) {
+        rv += strlen(pair->values[i]) + 1;
+    }
+    return persist_align(rv);
+}
+
+static char *write_record(char *out, kvpair_t *pair)
+{
+    uint32_t *lens = (uint32_t *) out;
+    char *p = out + sizeof(uint32_t) * (2 + pair->used_values);
+    size_t len = strlen(pair->key) + 1;
+    int i;
+
+    lens[0] = (uint32_t)(len - 1);
+    lens[1] = (uint32_t) pair->used_values;
+    memcpy(p, pair->key, len);
+    p += len;
+
+    for (i = 0; i < pair->used_values; i++) {
+        len = strlen(pair->values[i]) + 1;
+        lens[2 + i] = (uint32_t)(len - 1);
+        memcpy(p, pair->values[i], len);
+        p += len;
+    }
+
+    /* Zero the padding so the checksum is deterministic */
+    len = out + record_size(pair) - p;
+    memset(p, 0, len);
+    return p + len;
+}
+
+/*
+ * Build pairs pointing at the records in a body that passed its
+ * checksum.  The lengths are still checked, so a bad file can't send
+ * us wandering off the end of it.
+ */
+static kvpair_t *read_records(kvpair_arena_t *arena, char *body, size_t size,
+                              uint32_t count)
+{
+    kvpair_t *head = NULL;
+    kvpair_t **tail = &head;
+    char *end = body + size;
+    char *p = body;
+    uint32_t n;
+
+    for (n = 0; n < count; n++) {
+        uint32_t *lens = (uint32_t *) p;
+        kvpair_t *pair;
+        char *s;
+        uint32_t i;
+
+        if ((size_t)(end - p) < sizeof(uint32_t) * 2 ||
+            lens[1] > (end - p) / sizeof(uint32_t) - 2) {
+            return NULL;
+        }
+        s = p + sizeof(uint32_t) * (2 + lens[1]);
+
+        pair = kvpair_arena_alloc(arena, sizeof(kvpair_t));
+        memset(pair, 0, sizeof(kvpair_t));
+        pair->arena = arena;
+        pair->used_values = (int) lens[1];
+        pair->allocated_values = lens[1] < 3 ? 4 : (int) lens[1] + 1;
+        pair->values = kvpair_arena_alloc(arena,
+                                          sizeof(char*) * pair->allocated_values);
+
+        for (i = 0; i <= lens[1]; i++) {
+            /* The key's length comes first, then each value's */
+            uint32_t len = i == 0 ? lens[0] : lens[1 + i];
+            if (len >= (size_t)(end - s) || s[len] != '\0') {
+                return NULL;
+            }
+            if (i == 0) {
+                pair->key = s;
+            } else {
+                pair->values[i - 1] = s;
+            }
+            s += len + 1;
+        }
+        pair->values[pair->used_values] = NULL;
+
+        p += persist_align(s - p);
+        if (p > end) {
+            return NULL;
+        }
+
+        *tail = pair;
+        tail = &pair->next;
+    }
+
+    return p == end ? head : NULL;
+}
+
+/* Get the whole file into memory, mapped if we can. */
+static char *map_file(const char *filename, size_t *size)
+{
+    struct stat st;
+    char *rv = NULL;
+    int fd = open(filename, O_RDONLY | O_BINARY);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct persist_header)) {
+        *size = (size_t) st.st_size;
+#ifdef WIN32
+        rv = malloc(*size);
+        assert(rv);
+        if (read(fd, rv, (unsigned int)*size) != (int)*size) {
+            free(rv);
+            rv = NULL;
+        }
+#else
+        /* Private and writable, so nobody can scribble on the file
+           through the config */
+        rv = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (rv == MAP_FAILED) {
+            rv = NULL;
+        }
+#endif
+    }
+
+    close(fd);
+    return rv;
+}
+
+static void unmap_file(char *data, size_t size)
+{
+#ifdef WIN32
+    (void)size;
+    free(data);
+#else
+    munmap(data, size);
+#endif
+}
+
 kvpair_t* load_kvpairs(conflate_handle_t *handle, const char *filename)
 {
-    (void)handle;
-    (void)filename;
+    struct persist_header *header;
+    kvpair_arena_t *arena;
+    kvpair_t *rv = NULL;
+    size_t size = 0;
+    char *data;
+
+    data = map_file(filename, &size);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    header = (struct persist_header *) data;
+    if (header->magic != PERSIST_MAGIC || header->version != PERSIST_VERSION ||
+        header->body_size != size - sizeof(struct persist_header) ||
+        header->crc != conflate_crc32(data + sizeof(struct persist_header),
+                                      (size_t) header->body_size)) {
+        handle->conf->log(handle->conf->userdata, LOG_LVL_WARN,
+                          "Ignoring unreadable config in %s", filename);
+        unmap_file(data, size);
+        return NULL;
+    }
+
+    if (header->count > 0) {
+        arena = mk_kvpair_arena(header->count *
+                                (sizeof(kvpair_t) + sizeof(char*) * 4));
+        rv = read_records(arena, data + sizeof(struct persist_header),
+                          (size_t) header->body_size, header->count);
+        if (rv != NULL) {
+            kvpair_arena_adopt_mapping(arena, data, size);
+            return rv;
+        }
+        free_kvpair_arena(arena);
+        handle->conf->log(handle->conf->userdata, LOG_LVL_WARN,
+                          "Ignoring malformed config in %s", filename);
+    }
+
+    unmap_file(data, size);
     return NULL;
 }
 
+static bool write_fully(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        int written = write(fd, data, (unsigned int) len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+#ifndef WIN32
+void conflate_sync_parent_dir(const char *filename)
+{
+    const char *slash = strrchr(filename, '/');
+    char *dir = safe_strdup(slash ? filename : ".");
+    int fd;
+
+    if (slash) {
+        dir[slash == filename ? 1 : slash - filename] = '\0';
+    }
+    fd = open(dir, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+#endif
+
 bool save_kvpairs(conflate_handle_t *handle, kvpair_t* kvpair,
                   const char *filename)
 {
-    (void)handle;
-    (void)kvpair;
-    (void)filename;
-    return true;
+    struct persist_header *header;
+    size_t size = sizeof(struct persist_header);
+    size_t tmp_len = strlen(filename) + sizeof(".tmp");
+    char *tmp = NULL;
+    char *data, *p;
+    kvpair_t *pair;
+    bool rv = false;
+    int fd;
+
+    for (pair = kvpair; pair; pair = pair->next) {
+        size += record_size(pair);
+    }
+
+    data = calloc(1, size);
+    assert(data);
+    header = (struct persist_header *) data;
+    header->magic = PERSIST_MAGIC;
+    header->version = PERSIST_VERSION;
+    header->body_size = size - sizeof(struct persist_header);
+
+    p = data + sizeof(struct persist_header);
+    for (pair = kvpair; pair; pair = pair->next) {
+        p = write_record(p, pair);
+        header->count++;
+    }
+    header->crc = conflate_crc32(data + sizeof(struct persist_header),
+                                 (size_t) header->body_size);
+
+    tmp = malloc(tmp_len);
+    assert(tmp);
+    snprintf(tmp, tmp_len, "%s.tmp", filename);
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        handle->conf->log(handle->conf->userdata, LOG_LVL_ERROR,
+                          "Can't create %s: %s", tmp, strerror(errno));
+    } else {
+        rv = write_fully(fd, data, size);
+        if (rv && handle->conf->save_fsync) {
+            rv = fsync(fd) == 0;
+        }
+        if (close(fd) != 0) {
+            rv = false;
+        }
+
+        if (!rv) {
+            handle->conf->log(handle->conf->userdata, LOG_LVL_ERROR,
+                              "Can't write %s: %s", tmp, strerror(errno));
+            remove(tmp);
+        } else {
+#ifdef WIN32
+            /* rename() won't replace an existing file here */
+            remove(filename);
+#endif
+            if (rename(tmp, filename) != 0) {
+                handle->conf->log(handle->conf->userdata, LOG_LVL_ERROR,
+                                  "Can't replace %s: %s", filename,
+                                  strerror(errno));
+                remove(tmp);
+                rv = false;
+            }
+#ifndef WIN32
+            if (rv && handle->conf->save_fsync) {
+                conflate_sync_parent_dir(filename);
+            }
+#endif
+        }
+    }
+
+    free(tmp);
+    free(data);
+    return rv;
 }
 
-bool conflate_delete_private(conflate_handle_t *handle,
-                             const char *k, const char *filename)
+/* A config waiting for the background writer. */
+struct pending_save {
+    conflate_handle_t *handle;
+    kvpair_t *config;
+    struct pending_save *next;
+};
+
+struct config_writer {
+    cb_thread_t thread;
+    cb_mutex_t mutex;
+    cb_cond_t cond;
+    struct pending_save *pending;
+};
+
+static struct config_writer *config_writer = NULL;
+
+static void run_config_writer(void *arg)
 {
-    (void)handle;
-    (void)k;
-    (void)filename;
-    return true;
+    struct config_writer *writer = (struct config_writer *) arg;
+
+    while (true) {
+        struct pending_save *batch;
+
+        cb_mutex_enter(&writer->mutex);
+        while (writer->pending == NULL) {
+            cb_cond_wait(&writer->cond, &writer->mutex);
+        }
+        batch = writer->pending;
+        writer->pending = NULL;
+        cb_mutex_exit(&writer->mutex);
+
+        while (batch) {
+            struct pending_save *next = batch->next;
+            conflate_config_t *conf = batch->handle->conf;
+
+            if (!save_kvpairs(batch->handle, batch->config, conf->save_path)) {
+                /* It's already said why */
+                ;
+            }
+            conflate_snapshot_release(batch->config);
+            free(batch);
+            batch = next;
+        }
+    }
 }
 
-bool conflate_save_private(conflate_handle_t *handle,
-                           const char *k, const char *v, const char *filename)
+static struct config_writer *get_config_writer(void)
 {
-    (void)handle;
-    (void)k;
-    (void)v;
-    (void)filename;
-    return true;
+    struct config_writer *writer = config_writer;
+
+    if (writer == NULL) {
+        writer = calloc(1, sizeof(struct config_writer));
+        assert(writer);
+        cb_mutex_initialize(&writer->mutex);
+        cb_cond_initialize(&writer->cond);
+
+        if (conflate_cas_ptr(&config_writer, NULL, writer)) {
+            if (cb_create_thread(&writer->thread, run_config_writer,
+                                 writer, 1) != 0) {
+                perror("Failed to create config writer thread");
+                assert(false);
+            }
+        } else {
+            /* Somebody else started one first */
+            cb_mutex_destroy(&writer->mutex);
+            cb_cond_destroy(&writer->cond);
+            free(writer);
+            writer = config_writer;
+        }
+    }
+
+    return writer;
 }
 
-char *conflate_get_private(conflate_handle_t *handle,
-                           const char *k, const char *filename)
+void conflate_save_async(conflate_handle_t *handle, kvpair_t *config)
 {
-    (void)handle;
-    (void)k;
-    (void)filename;
-    return NULL;
+    struct config_writer *writer = get_config_writer();
+    kvpair_t *snapshot = conflate_snapshot_retain(config);
+    kvpair_t *replaced = NULL;
+    struct pending_save *p;
+
+    cb_mutex_enter(&writer->mutex);
+    for (p = writer->pending; p && p->handle != handle; p = p->next) {
+        ;
+    }
+    if (p) {
+        /* Only the newest config matters */
+        replaced = p->config;
+        p->config = snapshot;
+    } else {
+        p = calloc(1, sizeof(struct pending_save));
+        assert(p);
+        p->handle = handle;
+        p->config = snapshot;
+        p->next = writer->pending;
+        writer->pending = p;
+        cb_cond_signal(&writer->cond);
+    }
+    cb_mutex_exit(&writer->mutex);
+
+    conflate_snapshot_release(replaced);
 }
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/types.h>
@@ -10,7 +11,10 @@
 #define sleep(a) Sleep(a * 1000)
 #else
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #endif
 
 #include <string.h>
@@ -22,193 +26,583 @@
 
 long curl_init_flags = CURL_GLOBAL_ALL;
 
-static int g_tot_process_new_configs = 0;
+static bool curl_initialized = false;
 
-struct response_buffer {
-    char *data;
-    size_t bytes_used;
-    size_t buffer_size;
-    struct response_buffer *next;
+/* How other threads wake an engine: curl_multi_wakeup() interrupting
+   curl_multi_poll(), or with older curl a pipe it waits on as well. */
+#if LIBCURL_VERSION_NUM >= 0x074400
+#define HAVE_CURL_MULTI_WAKEUP 1
+#elif !defined(WIN32)
+#define HAVE_WAKE_PIPE 1
+#endif
+
+/* Longest an engine sleeps before checking for new work.  If it can't
+   be woken that's also how long a new handle may wait. */
+#if defined(HAVE_CURL_MULTI_WAKEUP) || defined(HAVE_WAKE_PIPE)
+#define ENGINE_POLL_MS 1000
+#else
+#define ENGINE_POLL_MS 100
+#endif
+
+/* A config waiting to be delivered on a callback thread. */
+struct config_job {
+    conflate_handle_t *handle;
+    kvpair_t *kv;
+    bool final; /* The transfer is done and waits on the result. */
+    bool from_wire; /* Rather than loaded from the save_path. */
+    conflate_result result;
+    struct config_job *next;
 };
 
-struct response_buffer *response_buffer_head = NULL;
-struct response_buffer *cur_response_buffer = NULL;
-
-static struct response_buffer *mk_response_buffer(size_t size) {
-    struct response_buffer *r =
-      (struct response_buffer *) calloc(1, sizeof(struct response_buffer));
-    assert(r);
-    r->data = malloc(size);
-    assert(r->data);
-    r->bytes_used = 0;
-    r->buffer_size = size;
-    r->next = NULL;
-    return r;
+struct callback_worker {
+    struct rest_engine *engine;
+    cb_thread_t thread;
+    cb_mutex_t mutex;
+    cb_cond_t cond;
+    struct config_job *head;
+    struct config_job *tail;
+};
+
+/*
+ * An event loop driving the REST connections of one or more handles.
+ * Everything but the mutex protected lists is only touched by the
+ * thread running the loop.
+ */
+struct rest_engine {
+    CURLM *multi;
+
+    conflate_handle_t *handles;
+    int num_handles;
+
+    struct callback_worker *workers;
+    int num_workers;
+
+    cb_mutex_t mutex;
+    conflate_handle_t *incoming;    /* Handles waiting to be adopted. */
+    struct config_job *completed;   /* Final configs that were delivered. */
+
+#ifdef HAVE_WAKE_PIPE
+    int wake[2];
+#endif
+};
+
+static struct rest_engine *shared_engine = NULL;
+
+/* Guards starting curl and the shared engine.  See get_start_mutex(). */
+static cb_mutex_t *start_mutex = NULL;
+
+/*
+ * Each handle receives into a single contiguous buffer.  It grows
+ * geometrically while a config streams in, and the finished config is
+ * handed off as-is so it's never copied after it comes off the wire.
+ */
+static void init_response_buffer(struct response_buffer *buffer, size_t size) {
+    buffer->data = malloc(size);
+    assert(buffer->data);
+    buffer->bytes_used = 0;
+    buffer->buffer_size = size;
 }
 
-static void free_response(struct response_buffer *response) {
-    if (!response) {
-        return;
-    }
-    if (response->next) {
-        free_response(response->next);
+static void write_data_to_buffer(struct response_buffer *buffer,
+                                 const char *data, size_t len) {
+    /* Always leave room for the terminating '\0' */
+    size_t needed = buffer->bytes_used + len + 1;
+    if (needed > buffer->buffer_size) {
+        size_t new_size = buffer->buffer_size;
+        while (new_size < needed) {
+            new_size <<= 1;
+        }
+        buffer->data = realloc(buffer->data, new_size);
+        assert(buffer->data);
+        buffer->buffer_size = new_size;
     }
-    if (response->data) {
-        free(response->data);
+    memcpy(&buffer->data[buffer->bytes_used], data, len);
+    buffer->bytes_used += len;
+}
+
+/*
+ * Detach the complete response from the buffer and start a fresh one.
+ * The new buffer is sized like the last one, since the next config is
+ * most likely about as big as this one.
+ */
+static char *take_complete_response(struct response_buffer *buffer) {
+    char *response = buffer->data;
+    response[buffer->bytes_used] = '\0';
+    init_response_buffer(buffer, buffer->buffer_size);
+    return response;
+}
+
+/* Get ready to receive the next config. */
+static void reset_message(struct rest_attempt *attempt) {
+    json_reset(&attempt->tokenizer);
+    json_flattener_reset(&attempt->flattener);
+}
+
+/*
+ * A url that gives us a config is healthy again.  How long the first
+ * config took goes into its moving average latency.
+ */
+static void record_success(struct rest_attempt *attempt) {
+    struct rest_endpoint *endpoint = attempt->endpoint;
+    hrtime_t sample = gethrtime() - attempt->started;
+
+    if (endpoint->measured) {
+        endpoint->latency = (endpoint->latency * (8 - LATENCY_WEIGHT) +
+                             sample * LATENCY_WEIGHT) / 8;
+    } else {
+        endpoint->latency = sample;
+        endpoint->measured = true;
     }
-    free(response);
+    endpoint->failures = 0;
+    attempt->got_config = true;
+    conflate_histogram_record(&attempt->handle->stats.first_config_time, sample);
 }
 
-static struct response_buffer *write_data_to_buffer(struct response_buffer *buffer,
-                                                    const char *data, size_t len) {
-    size_t bytes_written = 0;
-    while (bytes_written < len) {
-        size_t bytes_to_write = (len - bytes_written);
-        size_t space = buffer->buffer_size - buffer->bytes_used;
-        if (space == 0) {
-            struct response_buffer *new_buffer = mk_response_buffer(buffer->buffer_size);
-            buffer->next = new_buffer;
-            buffer = new_buffer;
-        } else {
-            char *d;
-            if (bytes_to_write > space) {
-                bytes_to_write = space;
+static kvpair_t *mk_config(struct rest_attempt *attempt) {
+    conflate_handle_t *conf_handle = attempt->handle;
+    kvpair_t *kv = NULL;
+    struct json_tokenizer *tokenizer = &attempt->tokenizer;
+    struct json_flattener *flattener = &attempt->flattener;
+
+    conf_handle->tot_process_new_configs++;
+    conflate_atomic_add64(&conf_handle->stats.configs_received, 1);
+    conf_handle->stats.last_config_at = (int64_t)gethrtime();
+    if (!attempt->got_config) {
+        record_success(attempt);
+    }
+
+    if (conf_handle->conf->parse_configs) {
+        if (tokenizer->complete && !tokenizer->error) {
+            /* An empty object or array still goes out unparsed */
+            if (flattener->head != NULL && conf_handle->url != NULL) {
+                json_flattener_add(flattener, "url", conf_handle->url);
             }
-            d = buffer->data;
-            d = &d[buffer->bytes_used];
-            memcpy(d,&data[bytes_written], bytes_to_write);
-            bytes_written += bytes_to_write;
-            buffer->bytes_used += bytes_to_write;
+            kv = json_flattener_take(flattener);
+        } else {
+            conf_handle->conf->log(conf_handle->conf->userdata, LOG_LVL_WARN,
+                                   "Config from %s isn't valid JSON, "
+                                   "delivering it unparsed",
+                                   conf_handle->url ? conf_handle->url : "?");
         }
     }
-    return buffer;
-}
 
-static char *assemble_complete_response(struct response_buffer *response_head) {
-    struct response_buffer *cur_buffer = response_head;
-    size_t response_size = 0;
-    char *response = NULL;
-    char *ptr;
+    if (kv == NULL) {
+        /* construct the new config from its components in one arena,
+           handing the received bytes straight to the kvpair */
+        kvpair_arena_t *arena = mk_kvpair_arena(0);
+        kv = mk_kvpair_in(arena, CONFIG_KEY, NULL);
+        add_kvpair_value_nocopy(kv, take_complete_response(&attempt->response));
 
-    if (response_head == NULL) {
-        return NULL;
+        if (conf_handle->url != NULL) {
+            char *url[2];
+            url[0] = conf_handle->url;
+            url[1] = NULL;
+            kv->next = mk_kvpair_in(arena, "url", url);
+        }
+    } else {
+        /* The parsed config replaces the raw bytes */
+        attempt->response.bytes_used = 0;
     }
 
-    /* figure out how big the message is */
-    while (cur_buffer) {
-        response_size += cur_buffer->bytes_used;
-        cur_buffer = cur_buffer->next;
-    }
+    return kv;
+}
 
-    /* create buffer */
-    response = malloc(response_size + 1);
-    assert(response);
+/*
+ * Pass a config to the application, unless it's exactly what it was
+ * given last time.  The config is kept for comparison if it's
+ * accepted, and freed otherwise.  Only configs off the wire are saved,
+ * rather than ones that were loaded from the save_path.
+ */
+static conflate_result deliver_config(conflate_handle_t *conf_handle,
+                                      kvpair_t *kv, bool from_wire) {
+    conflate_config_t *conf = conf_handle->conf;
+    conflate_result r;
+    hrtime_t start;
 
-    /* populate buffer */
-    cur_buffer = response_head;
-    ptr = response;
-    while (cur_buffer) {
-        memcpy(ptr, cur_buffer->data, cur_buffer->bytes_used);
-        ptr += cur_buffer->bytes_used;
-        cur_buffer = cur_buffer->next;
+    if (conf_handle->last_config == NULL) {
+        start = gethrtime();
+        r = conf->new_config(conf->userdata, kv);
+    } else if (conf->config_diff) {
+        kvpair_t *added, *removed, *changed;
+
+        if (!diff_kvpair(conf_handle->last_config, kv,
+                         &added, &removed, &changed)) {
+            conflate_atomic_add64(&conf_handle->stats.configs_unchanged, 1);
+            free_kvpair(kv);
+            return CONFLATE_SUCCESS;
+        }
+
+        start = gethrtime();
+        r = conf->config_diff(conf->userdata, added, removed, changed);
+
+        free_kvpair(added);
+        free_kvpair(removed);
+        free_kvpair(changed);
+    } else {
+        /* Only the answer matters, so don't copy out the differences */
+        if (kvpair_chains_equal(conf_handle->last_config, kv)) {
+            conflate_atomic_add64(&conf_handle->stats.configs_unchanged, 1);
+            free_kvpair(kv);
+            return CONFLATE_SUCCESS;
+        }
+
+        start = gethrtime();
+        r = conf->new_config(conf->userdata, kv);
     }
+    conflate_histogram_record(&conf_handle->stats.callback_time,
+                              gethrtime() - start);
+    conflate_atomic_add64(&conf_handle->stats.configs_delivered, 1);
 
-    response[response_size] = '\0';
+    /* clean up */
+    if (r == CONFLATE_SUCCESS) {
+        /* Keep it for the next restart, unless that's where it came
+           from */
+        if (conf->save_path && from_wire) {
+            conflate_save_async(conf_handle, kv);
+        }
+        free_kvpair(conf_handle->last_config);
+        conf_handle->last_config = kv;
+    } else {
+        free_kvpair(kv);
+    }
 
-    return response;
+    return r;
 }
 
-static bool pattern_ends_with(const char *pattern, const char *target, size_t target_size) {
-    size_t pattern_size;
-    assert(target);
-    assert(pattern);
+/*
+ * Hand a config to the handle's callback worker.  Each handle always
+ * uses the same worker, so its configs are delivered in order.
+ */
+static void queue_config(conflate_handle_t *handle, kvpair_t *kv,
+                         bool final, bool from_wire) {
+    struct callback_worker *worker = &handle->engine->workers[handle->worker];
+    struct config_job *job = calloc(1, sizeof(struct config_job));
+    assert(job);
 
-    pattern_size = strlen(pattern);
-    if (target_size < pattern_size) {
-        return false;
+    job->handle = handle;
+    job->kv = kv;
+    job->final = final;
+    job->from_wire = from_wire;
+
+    cb_mutex_enter(&worker->mutex);
+    if (worker->tail) {
+        worker->tail->next = job;
+    } else {
+        worker->head = job;
     }
-    return memcmp(&target[target_size - pattern_size], pattern, pattern_size) == 0;
+    worker->tail = job;
+    cb_cond_signal(&worker->cond);
+    cb_mutex_exit(&worker->mutex);
 }
 
-static conflate_result process_new_config(conflate_handle_t *conf_handle) {
-    char *values[2];
-    kvpair_t *kv;
-    conflate_result (*call_back)(void *, kvpair_t *);
-    conflate_result r;
+static void wake_engine(struct rest_engine *engine) {
+#if defined(HAVE_CURL_MULTI_WAKEUP)
+    curl_multi_wakeup(engine->multi);
+#elif defined(HAVE_WAKE_PIPE)
+    if (write(engine->wake[1], "", 1) < 0) {
+        /* The pipe's full, so the engine has wakeups waiting anyway */
+    }
+#else
+    /* The loop never sleeps longer than ENGINE_POLL_MS without it */
+    (void)engine;
+#endif
+}
+
+static void run_callback_worker(void *arg) {
+    struct callback_worker *worker = (struct callback_worker *) arg;
+    struct rest_engine *engine = worker->engine;
 
-    g_tot_process_new_configs++;
+    while (true) {
+        struct config_job *job;
+
+        cb_mutex_enter(&worker->mutex);
+        while (worker->head == NULL) {
+            cb_cond_wait(&worker->cond, &worker->mutex);
+        }
+        job = worker->head;
+        worker->head = job->next;
+        if (worker->head == NULL) {
+            worker->tail = NULL;
+        }
+        cb_mutex_exit(&worker->mutex);
+
+        job->result = deliver_config(job->handle, job->kv, job->from_wire);
+        job->kv = NULL;
 
-    /* construct the new config from its components */
-    values[0] = assemble_complete_response(response_buffer_head);
-    values[1] = NULL;
+        if (job->final) {
+            /* The engine decides where to go next based on the result. */
+            cb_mutex_enter(&engine->mutex);
+            job->next = engine->completed;
+            engine->completed = job;
+            cb_mutex_exit(&engine->mutex);
+            wake_engine(engine);
+        } else {
+            free(job);
+        }
+    }
+}
 
-    free_response(response_buffer_head);
-    response_buffer_head = NULL;
-    cur_response_buffer = NULL;
+/*
+ * Racing attempts each want to be the one the handle listens to.  The
+ * first to produce a complete, valid config wins, and the others are
+ * cancelled from the engine loop, since they can't be removed from
+ * inside a curl callback.
+ */
+static bool claim_win(struct rest_attempt *attempt) {
+    conflate_handle_t *handle = attempt->handle;
 
-    if (values[0] == NULL) {
-        fprintf(stderr, "ERROR: invalid response from REST server\n");
-        return CONFLATE_ERROR;
+    if (handle->winner == NULL) {
+        if (!attempt->tokenizer.complete || attempt->tokenizer.error) {
+            return false;
+        }
+        handle->winner = attempt;
+        handle->url = attempt->url;
     }
+    return handle->winner == attempt;
+}
+
+static size_t handle_response(void *data, size_t s, size_t num, void *cb) {
+    struct rest_attempt *attempt = ((struct rest_endpoint *) cb)->attempt;
+    conflate_handle_t *c_handle = attempt->handle;
+    size_t size = s * num;
+    const char *next = (const char *) data;
+    size_t remaining = size;
 
-    kv = mk_kvpair(CONFIG_KEY, values);
+    attempt->last_activity = gethrtime();
+    conflate_atomic_add64(&c_handle->stats.bytes_received, (int64_t)size);
 
-    if (conf_handle->url != NULL) {
-        char *url[2];
-        url[0] = conf_handle->url;
-        url[1] = NULL;
-        kv->next = mk_kvpair("url", url);
+    /* A chunk may hold the end of one config and the start of the
+       next, and a delimiter may be split over several chunks. */
+    while (remaining > 0) {
+        hrtime_t start = gethrtime();
+        size_t used = json_feed(&attempt->tokenizer, next, remaining);
+        attempt->parse_time += gethrtime() - start;
+        write_data_to_buffer(&attempt->response, next, used);
+        next += used;
+        remaining -= used;
+
+        if (attempt->tokenizer.end_of_message) {
+            if (attempt->tokenizer.seen_value) {
+                kvpair_t *kv;
+                if (!claim_win(attempt)) {
+                    /* Returning short makes curl abort the transfer */
+                    return 0;
+                }
+                conflate_histogram_record(&c_handle->stats.parse_time,
+                                          attempt->parse_time);
+                /* Only a stream has more than one config to send */
+                attempt->endpoint->streams = true;
+                kv = mk_config(attempt);
+                if (c_handle->engine->num_workers > 0) {
+                    queue_config(c_handle, kv, false, true);
+                } else {
+                    deliver_config(c_handle, kv, true);
+                }
+            } else {
+                /* Nothing but newlines, i.e. a heartbeat */
+                attempt->response.bytes_used = 0;
+            }
+            attempt->parse_time = 0;
+            reset_message(attempt);
+        }
     }
+    return size;
+}
 
-    /* execute the provided call back */
-    call_back = conf_handle->conf->new_config;
-    r = call_back(conf_handle->conf->userdata, kv);
+/*
+ * The value of the header in data if it's the named one, trimmed and
+ * malloc()ed, else NULL.  Header names are case insensitive.
+ */
+static char *header_value(const char *data, size_t size, const char *name) {
+    size_t len = strlen(name);
+    char *value;
+    size_t i;
 
-    /* clean up */
-    free_kvpair(kv);
-    free(values[0]);
+    if (size <= len || data[len] != ':') {
+        return NULL;
+    }
+    for (i = 0; i < len; i++) {
+        if (tolower((unsigned char)data[i]) != tolower((unsigned char)name[i])) {
+            return NULL;
+        }
+    }
 
-    response_buffer_head = mk_response_buffer(RESPONSE_BUFFER_SIZE);
-    cur_response_buffer = response_buffer_head;
+    data += len + 1;
+    size -= len + 1;
+    while (size > 0 && isspace((unsigned char)data[0])) {
+        data++;
+        size--;
+    }
+    while (size > 0 && isspace((unsigned char)data[size - 1])) {
+        size--;
+    }
 
-    return r;
+    value = malloc(size + 1);
+    assert(value);
+    memcpy(value, data, size);
+    value[size] = '\0';
+    return value;
 }
 
-static size_t handle_response(void *data, size_t s, size_t num, void *cb) {
-    conflate_handle_t *c_handle = (conflate_handle_t *) cb;
+static void clear_validators(struct rest_attempt *attempt) {
+    free(attempt->etag);
+    free(attempt->last_modified);
+    attempt->etag = NULL;
+    attempt->last_modified = NULL;
+}
+
+/* Pick the validators out of the response headers as they come in. */
+static size_t handle_header(char *data, size_t s, size_t num, void *cb) {
+    struct rest_attempt *attempt = ((struct rest_endpoint *) cb)->attempt;
     size_t size = s * num;
-    bool end_of_message = pattern_ends_with(END_OF_CONFIG, data, size);
-    cur_response_buffer = write_data_to_buffer(cur_response_buffer, data, size);
-    if (end_of_message) {
-        process_new_config(c_handle);
+    char *value;
+
+    attempt->last_activity = gethrtime();
+
+    if (size >= 5 && memcmp(data, "HTTP/", 5) == 0) {
+        /* A new response, after a redirect or a 100 Continue */
+        clear_validators(attempt);
+    } else if ((value = header_value(data, size, "ETag")) != NULL) {
+        free(attempt->etag);
+        attempt->etag = value;
+    } else if ((value = header_value(data, size, "Last-Modified")) != NULL) {
+        free(attempt->last_modified);
+        attempt->last_modified = value;
     }
     return size;
 }
 
+static void forget_validators(struct rest_endpoint *endpoint) {
+    if (endpoint->headers != NULL) {
+        CURLcode c = curl_easy_setopt(endpoint->curl, CURLOPT_HTTPHEADER, NULL);
+        assert(c == CURLE_OK);
+        curl_slist_free_all(endpoint->headers);
+    }
+    free(endpoint->etag);
+    free(endpoint->last_modified);
+    endpoint->etag = NULL;
+    endpoint->last_modified = NULL;
+    endpoint->headers = NULL;
+}
+
+static struct curl_slist *add_header(struct curl_slist *headers,
+                                     const char *name, const char *value) {
+    size_t size = strlen(name) + strlen(value) + 3;
+    char *header = malloc(size);
+    assert(header);
+    snprintf(header, size, "%s: %s", name, value);
+    headers = curl_slist_append(headers, header);
+    assert(headers);
+    free(header);
+    return headers;
+}
+
+/*
+ * The config from this attempt was accepted, so from now on ask its
+ * endpoint for the config only if it has changed.  No other endpoint
+ * can tell us that, so they forget what they had.  A 304 without
+ * validators of its own leaves the old ones in place.  A streaming
+ * endpoint's validators only describe the first config it sent, so
+ * it's never asked conditionally.
+ */
+static void remember_validators(struct rest_attempt *attempt) {
+    conflate_handle_t *handle = attempt->handle;
+    struct rest_endpoint *endpoint = attempt->endpoint;
+    CURLcode c;
+    int i;
+
+    for (i = 0; i < handle->num_endpoints; i++) {
+        if (&handle->endpoints[i] != endpoint) {
+            forget_validators(&handle->endpoints[i]);
+        }
+    }
+
+    if (attempt->not_modified && attempt->etag == NULL &&
+        attempt->last_modified == NULL) {
+        return;
+    }
+
+    forget_validators(endpoint);
+    if (endpoint->streams) {
+        return;
+    }
+    endpoint->etag = attempt->etag;
+    endpoint->last_modified = attempt->last_modified;
+    attempt->etag = NULL;
+    attempt->last_modified = NULL;
+
+    if (endpoint->etag) {
+        endpoint->headers = add_header(endpoint->headers, "If-None-Match",
+                                       endpoint->etag);
+    }
+    if (endpoint->last_modified) {
+        endpoint->headers = add_header(endpoint->headers, "If-Modified-Since",
+                                       endpoint->last_modified);
+    }
+    c = curl_easy_setopt(endpoint->curl, CURLOPT_HTTPHEADER, endpoint->headers);
+    assert(c == CURLE_OK);
+}
+
+/*
+ * Keepalives catch a peer that went away without closing, but only
+ * after the probes start, which by default takes hours.
+ */
 static int setup_curl_sock(void *clientp,
                            curl_socket_t curlfd,
                            curlsocktype purpose) {
+#if defined(TCP_KEEPIDLE) || defined(TCP_KEEPINTVL)
+  conflate_config_t *conf = (conflate_config_t *) clientp;
+#endif
   int       optval = 1;
   socklen_t optlen = sizeof(optval);
   setsockopt(curlfd, SOL_SOCKET, SO_KEEPALIVE, (void *) &optval, optlen);
+#ifdef TCP_KEEPIDLE
+  if (conf->keepalive_idle > 0) {
+      optval = conf->keepalive_idle;
+      setsockopt(curlfd, IPPROTO_TCP, TCP_KEEPIDLE, (void *) &optval, optlen);
+  }
+#endif
+#ifdef TCP_KEEPINTVL
+  if (conf->keepalive_interval > 0) {
+      optval = conf->keepalive_interval;
+      setsockopt(curlfd, IPPROTO_TCP, TCP_KEEPINTVL, (void *) &optval, optlen);
+  }
+#endif
+#if !defined(TCP_KEEPIDLE) && !defined(TCP_KEEPINTVL)
   (void) clientp;
+#endif
   (void) purpose;
   return 0;
 }
 
 static void setup_handle(CURL *handle, char *url, char *userpass,
-                         conflate_handle_t *chandle,
+                         conflate_config_t *conf,
+                         struct rest_endpoint *chandle,
                          size_t (response_handler)(void *, size_t, size_t, void *)) {
     if (url != NULL) {
 
         CURLcode c;
 
+        c = curl_easy_setopt(handle, CURLOPT_ERRORBUFFER, chandle->curl_error);
+        assert(c == CURLE_OK);
+        c = curl_easy_setopt(handle, CURLOPT_PRIVATE, chandle);
+        assert(c == CURLE_OK);
         c = curl_easy_setopt(handle, CURLOPT_SOCKOPTFUNCTION, setup_curl_sock);
         assert(c == CURLE_OK);
+        c = curl_easy_setopt(handle, CURLOPT_SOCKOPTDATA, conf);
+        assert(c == CURLE_OK);
         c = curl_easy_setopt(handle, CURLOPT_WRITEDATA, chandle);
         assert(c == CURLE_OK);
         c = curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, response_handler);
         assert(c == CURLE_OK);
+        c = curl_easy_setopt(handle, CURLOPT_HEADERDATA, chandle);
+        assert(c == CURLE_OK);
+        c = curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, handle_header);
+        assert(c == CURLE_OK);
+        /* Configs compress very well; curl offers whatever it can
+           decode, and inflates the stream as it arrives */
+        c = curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING, "");
+        assert(c == CURLE_OK);
         c = curl_easy_setopt(handle, CURLOPT_URL, url);
         assert(c == CURLE_OK);
 
@@ -219,6 +613,20 @@ static void setup_handle(CURL *handle, char *url, char *userpass,
             assert(c == CURLE_OK);
         }
 
+        if (conf->connect_timeout_ms > 0) {
+            c = curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT_MS,
+                                 (long)conf->connect_timeout_ms);
+            assert(c == CURLE_OK);
+        }
+        if (conf->low_speed_limit > 0 && conf->low_speed_time > 0) {
+            c = curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT,
+                                 (long)conf->low_speed_limit);
+            assert(c == CURLE_OK);
+            c = curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME,
+                                 (long)conf->low_speed_time);
+            assert(c == CURLE_OK);
+        }
+
         c = curl_easy_setopt(handle, CURLOPT_HTTPGET, 1);
         assert(c == CURLE_OK);
     }
@@ -241,108 +649,637 @@ static char *strsep(char **stringp, char *pattern) {
 }
 #endif
 
-void run_rest_conflate(void *arg) {
-    conflate_handle_t *handle = (conflate_handle_t *) arg;
-    char curl_error_string[CURL_ERROR_SIZE];
-    kvpair_t *conf;
-    CURLcode c;
-    CURL *curl_handle;
-    bool always_retry = true;
+/* Whether url a looks like a better bet than url b. */
+static bool healthier(const struct rest_endpoint *a,
+                      const struct rest_endpoint *b) {
+    if (a->failures != b->failures) {
+        return a->failures < b->failures;
+    }
+    return a->measured && b->measured && a->latency < b->latency;
+}
 
+static bool more_urls(conflate_handle_t *handle) {
+    return handle->next_endpoint < handle->num_endpoints;
+}
 
+/*
+ * Each handle walks its list of urls, one connection at a time, or
+ * race_urls connections at a time when they race.  The urls that
+ * failed least are tried first, the fastest of those first, and the
+ * list order breaks any ties.  A pass ends either when a url gives us
+ * a config, or when all of them have failed.  Either way we back off
+ * before starting over.
+ */
+static void start_pass(conflate_handle_t *handle) {
+    int i, j;
 
-    /* prep the buffers used to hold the config */
-    response_buffer_head = mk_response_buffer(RESPONSE_BUFFER_SIZE);
-    cur_response_buffer = response_buffer_head;
+    /* An insertion sort keeps it stable, and the list is short */
+    for (i = 0; i < handle->num_endpoints; i++) {
+        for (j = i; j > 0 && healthier(&handle->endpoints[i],
+                                       &handle->endpoints[handle->order[j - 1]]);
+             j--) {
+            handle->order[j] = handle->order[j - 1];
+        }
+        handle->order[j] = i;
+    }
+    handle->next_endpoint = 0;
+    handle->in_pass = true;
+}
+
+static uint32_t next_random(conflate_handle_t *handle) {
+    uint32_t x = handle->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    handle->random = x;
+    return x;
+}
+
+/*
+ * Back off exponentially while every url keeps failing, less some
+ * jitter so the clients of a cluster don't all come back at once.
+ */
+static long retry_delay_ms(conflate_handle_t *handle) {
+    conflate_config_t *conf = handle->conf;
+    long min_ms = conf->retry_min_ms > 0 ? conf->retry_min_ms : 1;
+    long max_ms = conf->retry_max_ms > min_ms ? conf->retry_max_ms : min_ms;
+    long delay = min_ms;
+    int i;
+
+    for (i = 1; i < handle->failed_passes && delay <= max_ms / 2; i++) {
+        delay <<= 1;
+    }
+    if (delay > max_ms) {
+        delay = max_ms;
+    }
+
+    if (conf->retry_jitter > 0) {
+        int jitter = conf->retry_jitter < 100 ? conf->retry_jitter : 100;
+        long range = delay / 100 * jitter + delay % 100 * jitter / 100;
+        delay -= (long)(next_random(handle) % (uint32_t)(range + 1));
+    }
+    return delay;
+}
+
+static void end_pass(conflate_handle_t *handle, bool succeeded) {
+    if (!succeeded) {
+        if (handle->tot_at_last_failure == handle->tot_process_new_configs) {
+            handle->conf->log(handle->conf->userdata, LOG_LVL_ERROR,
+                              "could not contact REST server(s): %s",
+                              handle->conf->host);
+        }
+        handle->tot_at_last_failure = handle->tot_process_new_configs;
+        handle->failed_passes++;
+    } else {
+        handle->failed_passes = 0;
+    }
+
+    handle->in_pass = false;
+    handle->url = NULL;
+    handle->winner = NULL;
+
+    /* Don't overload the REST servers with tons of retries. */
+    handle->rest_state = REST_WAITING;
+    handle->retry_at = gethrtime() + (hrtime_t)retry_delay_ms(handle) * 1000000;
+}
+
+static void start_attempt(struct rest_attempt *attempt) {
+    conflate_handle_t *handle = attempt->handle;
+    struct rest_endpoint *endpoint;
+    CURLMcode mc;
+
+    /* The endpoint's curl handle is all set up, apart from who's
+       listening to it this time */
+    endpoint = &handle->endpoints[handle->order[handle->next_endpoint++]];
+    endpoint->attempt = attempt;
+    endpoint->curl_error[0] = '\0';
+    attempt->endpoint = endpoint;
+    attempt->url = endpoint->url;
+    attempt->started = gethrtime();
+    attempt->last_activity = attempt->started;
+    attempt->got_config = false;
+    attempt->not_modified = false;
+    attempt->parse_time = 0;
+    clear_validators(attempt);
+    conflate_atomic_add64(&handle->stats.connections, 1);
+    conflate_atomic_add64(&endpoint->connections, 1);
+
+    /* Don't let a failed transfer leave a partial config behind */
+    attempt->response.bytes_used = 0;
+    reset_message(attempt);
+
+    mc = curl_multi_add_handle(handle->engine->multi, endpoint->curl);
+    assert(mc == CURLM_OK);
+    attempt->active = true;
+    handle->running++;
+}
+
+static void stop_attempt(struct rest_attempt *attempt) {
+    CURLMcode mc = curl_multi_remove_handle(attempt->handle->engine->multi,
+                                            attempt->endpoint->curl);
+    assert(mc == CURLM_OK);
+    attempt->active = false;
+    attempt->handle->running--;
+}
+
+/* Drop every attempt that lost the race. */
+static void cancel_losers(conflate_handle_t *handle) {
+    int i;
+
+    if (handle->winner == NULL || handle->running <= 1) {
+        return;
+    }
+    for (i = 0; i < handle->num_attempts; i++) {
+        struct rest_attempt *attempt = &handle->attempts[i];
+        if (attempt->active && attempt != handle->winner) {
+            stop_attempt(attempt);
+        }
+    }
+}
+
+static void start_transfer(conflate_handle_t *handle) {
+    int i;
+
+    cancel_losers(handle);
+
+    if (!handle->in_pass) {
+        start_pass(handle);
+    }
+
+    handle->winner = NULL;
+    handle->url = NULL;
+    handle->tot_at_transfer_start = handle->tot_process_new_configs;
+
+    for (i = 0; i < handle->num_attempts && more_urls(handle); i++) {
+        start_attempt(&handle->attempts[i]);
+    }
+
+    if (handle->num_attempts == 1) {
+        /* Nothing to race against */
+        handle->winner = &handle->attempts[0];
+        handle->url = handle->winner->url;
+    }
+    handle->rest_state = REST_TRANSFERRING;
+}
+
+static void handle_config_result(conflate_handle_t *handle,
+                                 conflate_result r) {
+    if (handle->winner != NULL) {
+        if (r == CONFLATE_SUCCESS) {
+            remember_validators(handle->winner);
+        } else {
+            forget_validators(handle->winner->endpoint);
+        }
+    }
+
+    if (r == CONFLATE_SUCCESS ||
+        r == CONFLATE_ERROR) {
+        /* Restart at the beginning of the urls list */
+        /* on either a success or a 'local' error. */
+        /* In contrast, if the callback returned a */
+        /* value of CONFLATE_ERROR_BAD_SOURCE, then */
+        /* we should try the next url on the list. */
+        end_pass(handle, true);
+        return;
+    }
+
+    if (handle->winner != NULL) {
+        handle->winner->endpoint->failures++;
+    }
+    if (more_urls(handle)) {
+        start_transfer(handle);
+    } else {
+        end_pass(handle, false);
+    }
+}
+
+static void finish_transfer(struct rest_attempt *attempt, CURLcode result) {
+    conflate_handle_t *handle = attempt->handle;
+    long code = 0;
+
+    stop_attempt(attempt);
+
+    if (result == CURLE_OK) {
+        curl_easy_getinfo(attempt->endpoint->curl, CURLINFO_RESPONSE_CODE, &code);
+    } else {
+        conflate_count_curl_error(&handle->stats, result);
+    }
+    attempt->not_modified = code == 304;
+    if (attempt->not_modified) {
+        conflate_atomic_add64(&handle->stats.not_modified, 1);
+    }
+
+    if (handle->winner != attempt) {
+        if (handle->winner != NULL) {
+            /* It lost the race, and gave up before being cancelled */
+            return;
+        }
+
+        if (attempt->not_modified) {
+            /* Our config is still current, which is as good as a win */
+            handle->winner = attempt;
+            handle->url = attempt->url;
+        } else if (result == CURLE_OK && attempt->tokenizer.seen_value &&
+                   claim_win(attempt)) {
+            /* Won with a config that ended along with the transfer */
+        } else {
+            handle->conf->log(handle->conf->userdata, LOG_LVL_WARN,
+                              "%s from: %s",
+                              result == CURLE_OK ? "empty response" : attempt->endpoint->curl_error,
+                              attempt->url);
+            attempt->endpoint->failures++;
+            /* Put another url in the race, or give up when everything
+               in the list has failed */
+            if (more_urls(handle)) {
+                start_attempt(attempt);
+            } else if (handle->running == 0) {
+                end_pass(handle, false);
+            }
+            return;
+        }
+    }
+
+    cancel_losers(handle);
+
+    if (attempt->not_modified) {
+        /* Nothing changed since the config we have, so there's
+           nothing to tell the application */
+        handle_config_result(handle, CONFLATE_SUCCESS);
+    } else if (result == CURLE_OK && attempt->tokenizer.seen_value) {
+        /* We reach here if the REST server didn't provide a
+           streaming JSON response and so we need to process
+           the just-one-JSON response */
+        kvpair_t *kv;
+        conflate_histogram_record(&handle->stats.parse_time, attempt->parse_time);
+        kv = mk_config(attempt);
+        if (handle->engine->num_workers > 0) {
+            handle->rest_state = REST_DELIVERING;
+            queue_config(handle, kv, true, true);
+        } else {
+            handle_config_result(handle, deliver_config(handle, kv, true));
+        }
+    } else if (result == CURLE_OK) {
+        /* A stream that ended cleanly after its last config worked
+           just fine, but an empty response isn't a config at all. */
+        if (handle->tot_process_new_configs > handle->tot_at_transfer_start) {
+            handle_config_result(handle, CONFLATE_SUCCESS);
+        } else {
+            handle->conf->log(handle->conf->userdata, LOG_LVL_WARN,
+                              "empty response from: %s", attempt->url);
+            handle_config_result(handle, CONFLATE_ERROR_BAD_SOURCE);
+        }
+    } else {
+        handle->conf->log(handle->conf->userdata, LOG_LVL_WARN,
+                          "curl error: %s from: %s",
+                          attempt->endpoint->curl_error, attempt->url);
+        handle_config_result(handle, CONFLATE_ERROR_BAD_SOURCE);
+    }
+}
+
+/*
+ * Fail over from connections that have sent nothing at all, not even
+ * a heartbeat, for longer than the idle timeout.  The engine sleeps no
+ * longer than the next connection's deadline.
+ */
+static void check_idle(conflate_handle_t *handle, hrtime_t now,
+                       long *timeout_ms) {
+    int idle_ms = handle->conf->idle_timeout_ms;
+    int i;
+
+    if (idle_ms <= 0) {
+        return;
+    }
+
+    for (i = 0; i < handle->num_attempts; i++) {
+        struct rest_attempt *attempt = &handle->attempts[i];
+        hrtime_t deadline = attempt->last_activity + (hrtime_t)idle_ms * 1000000;
+
+        if (!attempt->active) {
+            continue;
+        }
+        if (deadline <= now) {
+            snprintf(attempt->endpoint->curl_error, CURL_ERROR_SIZE,
+                     "Nothing received for %d ms", idle_ms);
+            finish_transfer(attempt, CURLE_OPERATION_TIMEDOUT);
+        } else {
+            long ms = (long)((deadline - now) / 1000000) + 1;
+            if (ms < *timeout_ms) {
+                *timeout_ms = ms;
+            }
+        }
+    }
+}
+
+static void adopt_handle(struct rest_engine *engine,
+                         conflate_handle_t *handle) {
+    kvpair_t *conf = NULL;
+    char *next;
+    int i;
+
+    handle->engine = engine;
+    handle->worker = engine->num_workers > 0 ?
+        engine->num_handles % engine->num_workers : 0;
+    handle->next = engine->handles;
+    engine->handles = handle;
+    engine->num_handles++;
+
+    /* Split up the url list, which might be '|' delimited */
+    handle->url_list = strdup(handle->conf->host);
+    assert(handle->url_list);
+    handle->num_endpoints = 1;
+    for (next = handle->url_list; *next; next++) {
+        if (*next == '|') {
+            handle->num_endpoints++;
+        }
+    }
+    handle->endpoints = calloc(handle->num_endpoints, sizeof(struct rest_endpoint));
+    handle->order = calloc(handle->num_endpoints, sizeof(int));
+    assert(handle->endpoints && handle->order);
+
+    if (handle->conf->jid && strlen(handle->conf->jid)) {
+        size_t buff_size = strlen(handle->conf->jid) + strlen(handle->conf->pass) + 2;
+        handle->userpass = (char *) malloc(buff_size);
+        assert(handle->userpass);
+        snprintf(handle->userpass, buff_size, "%s:%s", handle->conf->jid, handle->conf->pass);
+        handle->userpass[buff_size - 1] = '\0';
+    }
+
+    /* Every reconnect reuses the endpoint's curl handle as it is */
+    next = handle->url_list;
+    for (i = 0; next != NULL; i++) {
+        struct rest_endpoint *endpoint = &handle->endpoints[i];
+        endpoint->url = strsep(&next, "|");
+        endpoint->curl = curl_easy_init();
+        assert(endpoint->curl);
+        setup_handle(endpoint->curl,
+                     endpoint->url,  /* The full URL. */
+                     handle->userpass, /* The auth user and password. */
+                     handle->conf, endpoint, handle_response);
+    }
+    conflate_cas_ptr(&handle->stats.endpoints, NULL, handle->endpoints);
+
+    /* Handles started together shouldn't jitter alike */
+    handle->random = conflate_hash(handle->conf->host) ^
+        (uint32_t)gethrtime() ^ (uint32_t)(uintptr_t)handle;
+    if (handle->random == 0) {
+        handle->random = 1;
+    }
+
+    handle->num_attempts = handle->conf->race_urls > 1 ?
+        handle->conf->race_urls : 1;
+    handle->attempts = calloc(handle->num_attempts, sizeof(struct rest_attempt));
+    assert(handle->attempts);
+
+    for (i = 0; i < handle->num_attempts; i++) {
+        struct rest_attempt *attempt = &handle->attempts[i];
+        attempt->handle = handle;
+
+        /* prep the buffer used to hold the config */
+        init_response_buffer(&attempt->response, RESPONSE_BUFFER_SIZE);
+        /* The delimiter is nothing but newlines.  Configs are only parsed
+           as they arrive if the application asked for parsed configs. */
+        json_flattener_init(&attempt->flattener);
+        json_init(&attempt->tokenizer, (int)strlen(END_OF_CONFIG),
+                  handle->conf->parse_configs ? json_flatten_event : NULL,
+                  &attempt->flattener);
+    }
 
     /* Before connecting and all that, load the stored config */
-    conf = load_kvpairs(handle, handle->conf->save_path);
+    if (handle->conf->save_path) {
+        conf = load_kvpairs(handle, handle->conf->save_path);
+    }
     if (conf) {
-        handle->conf->new_config(handle->conf->userdata, conf);
-        free_kvpair(conf);
+        if (engine->num_workers > 0) {
+            queue_config(handle, conf, false, false);
+        } else {
+            deliver_config(handle, conf, false);
+        }
     }
 
-    /* init curl */
-    c = curl_global_init(curl_init_flags);
-    assert(c == CURLE_OK);
+    handle->rest_state = REST_WAITING;
+    handle->retry_at = 0;
+}
 
-    curl_handle = curl_easy_init();
-    assert(curl_handle);
+static void mk_engine(struct rest_engine *engine, int num_workers) {
+    int i;
+
+    memset(engine, 0, sizeof(struct rest_engine));
+    engine->multi = curl_multi_init();
+    assert(engine->multi);
+    cb_mutex_initialize(&engine->mutex);
+#ifdef HAVE_WAKE_PIPE
+    if (pipe(engine->wake) != 0) {
+        perror("Failed to create engine wakeup pipe");
+        assert(false);
+    }
+    for (i = 0; i < 2; i++) {
+        int flags = fcntl(engine->wake[i], F_GETFL, 0);
+        fcntl(engine->wake[i], F_SETFL, flags | O_NONBLOCK);
+    }
+#endif
 
-    curl_easy_setopt(curl_handle, CURLOPT_ERRORBUFFER, &curl_error_string);
+    if (num_workers > 0) {
+        engine->workers = calloc(num_workers, sizeof(struct callback_worker));
+        assert(engine->workers);
+        engine->num_workers = num_workers;
+        for (i = 0; i < num_workers; i++) {
+            struct callback_worker *w = &engine->workers[i];
+            w->engine = engine;
+            cb_mutex_initialize(&w->mutex);
+            cb_cond_initialize(&w->cond);
+            if (cb_create_thread(&w->thread, run_callback_worker, w, 1) != 0) {
+                perror("Failed to create callback thread");
+                assert(false);
+            }
+        }
+    }
+}
 
+/*
+ * Drive every handle registered with the engine.  Connections are
+ * multiplexed through curl_multi, and the loop only wakes up for
+ * socket activity, curl's own timers, the next scheduled retry or
+ * another thread handing it work.
+ */
+static void run_engine(struct rest_engine *engine) {
     while (true) {
-        int start_tot_process_new_configs = g_tot_process_new_configs;
-        bool succeeding = true;
-
-        while (succeeding) {
-            char *urls = strdup(handle->conf->host);  /* Might be a '|' delimited list of url's. */
-            char *next = urls;
-            char *userpass = NULL;
-            succeeding = false;
-
-            if (handle->conf->jid && strlen(handle->conf->jid)) {
-                size_t buff_size = strlen(handle->conf->jid) + strlen(handle->conf->pass) + 2;
-                userpass = (char *) malloc(buff_size);
-                assert(userpass);
-                snprintf(userpass, buff_size, "%s:%s", handle->conf->jid, handle->conf->pass);
-                userpass[buff_size - 1] = '\0';
+        conflate_handle_t *handle, *incoming;
+        struct config_job *completed;
+        CURLMsg *msg;
+        int running, msgs_left, numfds;
+        long timeout_ms = ENGINE_POLL_MS;
+        long curl_timeout_ms;
+        hrtime_t now;
+#ifdef HAVE_WAKE_PIPE
+        struct curl_waitfd wake_fd;
+#endif
+
+        cb_mutex_enter(&engine->mutex);
+        incoming = engine->incoming;
+        engine->incoming = NULL;
+        completed = engine->completed;
+        engine->completed = NULL;
+        cb_mutex_exit(&engine->mutex);
+
+        while (incoming) {
+            handle = incoming;
+            incoming = incoming->next;
+            adopt_handle(engine, handle);
+        }
+
+        while (completed) {
+            struct config_job *job = completed;
+            completed = completed->next;
+            handle_config_result(job->handle, job->result);
+            free(job);
+        }
+
+        curl_multi_perform(engine->multi, &running);
+
+        while ((msg = curl_multi_info_read(engine->multi, &msgs_left))) {
+            if (msg->msg == CURLMSG_DONE) {
+                CURLcode result = msg->data.result;
+                struct rest_endpoint *endpoint = NULL;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
+                                  (char **)&endpoint);
+                assert(endpoint && endpoint->attempt);
+                finish_transfer(endpoint->attempt, result);
             }
+        }
 
-            while (next != NULL) {
-                char *url = strsep(&next, "|");
-
-                handle->url = url;
-
-                setup_handle(curl_handle,
-                             url,  /* The full URL. */
-                             userpass, /* The auth user and password. */
-                             handle, handle_response);
-
-                if (curl_easy_perform(curl_handle) == 0) {
-                    /* We reach here if the REST server didn't provide a
-                       streaming JSON response and so we need to process
-                       the just-one-JSON response */
-                    conflate_result r = process_new_config(handle);
-                    if (r == CONFLATE_SUCCESS ||
-                        r == CONFLATE_ERROR) {
-                      /* Restart at the beginning of the urls list */
-                      /* on either a success or a 'local' error. */
-                      /* In contrast, if the callback returned a */
-                      /* value of CONFLATE_ERROR_BAD_SOURCE, then */
-                      /* we should try the next url on the list. */
-                      succeeding = true;
-                      next = NULL;
-                    }
+        now = gethrtime();
+        for (handle = engine->handles; handle; handle = handle->next) {
+            cancel_losers(handle);
+            check_idle(handle, now, &timeout_ms);
+            if (handle->rest_state == REST_WAITING) {
+                if (handle->retry_at <= now) {
+                    start_transfer(handle);
                 } else {
-                    fprintf(stderr, "WARNING: curl error: %s from: %s\n",
-                            curl_error_string, url);
+                    long ms = (long)((handle->retry_at - now) / 1000000) + 1;
+                    if (ms < timeout_ms) {
+                        timeout_ms = ms;
+                    }
                 }
             }
+        }
 
-            sleep(1);  /* Don't overload the REST servers with tons of retries. */
+        if (curl_multi_timeout(engine->multi, &curl_timeout_ms) == CURLM_OK &&
+            curl_timeout_ms >= 0 && curl_timeout_ms < timeout_ms) {
+            timeout_ms = curl_timeout_ms;
+        }
 
-            free(urls);
-            free(userpass);
+#if defined(HAVE_CURL_MULTI_WAKEUP)
+        curl_multi_poll(engine->multi, NULL, 0, (int)timeout_ms, &numfds);
+#elif defined(HAVE_WAKE_PIPE)
+        wake_fd.fd = engine->wake[0];
+        wake_fd.events = CURL_WAIT_POLLIN;
+        wake_fd.revents = 0;
+        curl_multi_wait(engine->multi, &wake_fd, 1, (int)timeout_ms, &numfds);
+        if (wake_fd.revents) {
+            char drain[64];
+            while (read(engine->wake[0], drain, sizeof(drain)) > 0) {
+            }
         }
+#else
+        curl_multi_wait(engine->multi, NULL, 0, (int)timeout_ms, &numfds);
+#endif
+    }
+}
 
-        if (start_tot_process_new_configs == g_tot_process_new_configs) {
-            fprintf(stderr, "ERROR: could not contact REST server(s): %s\n", handle->conf->host);
+static void run_shared_engine(void *arg) {
+    run_engine((struct rest_engine *) arg);
+}
 
-            if (always_retry == false) {
-              /* If we went through all our URL's and didn't see any new */
-              /* configs, then stop trying. */
+/*
+ * The platform has no static mutex initializer, so the mutex is made
+ * by whichever thread needs it first.
+ */
+static cb_mutex_t *get_start_mutex(void) {
+    cb_mutex_t *mutex = start_mutex;
 
-              break;
-            }
+    if (mutex == NULL) {
+        mutex = malloc(sizeof(cb_mutex_t));
+        assert(mutex);
+        cb_mutex_initialize(mutex);
+        if (!conflate_cas_ptr(&start_mutex, NULL, mutex)) {
+            /* Somebody else made one first */
+            cb_mutex_destroy(mutex);
+            free(mutex);
+            mutex = start_mutex;
+        }
+    }
+
+    return mutex;
+}
+
+/* curl_global_init() isn't thread safe, so it's only ever called here. */
+static void init_curl(void) {
+    if (!curl_initialized) {
+        CURLcode c = curl_global_init(curl_init_flags);
+        assert(c == CURLE_OK);
+        curl_initialized = true;
+    }
+}
+
+bool start_conflate_engine(int callback_threads) {
+    cb_mutex_t *mutex = get_start_mutex();
+    bool rv = true;
+
+    cb_mutex_enter(mutex);
+    if (shared_engine == NULL) {
+        struct rest_engine *engine = calloc(1, sizeof(struct rest_engine));
+        cb_thread_t thread;
+        assert(engine);
+
+        init_curl();
+        mk_engine(engine, callback_threads);
+        if (cb_create_thread(&thread, run_shared_engine, engine, 1) == 0) {
+            shared_engine = engine;
+        } else {
+            /* Its callback threads are waiting on it, so it can't be
+               freed, but the next call can try again with another */
+            perror("Failed to create engine thread");
+            rv = false;
         }
     }
+    cb_mutex_exit(mutex);
+
+    return rv;
+}
+
+bool register_rest_conflate(conflate_handle_t *handle) {
+    if (!start_conflate_engine(0)) {
+        return false;
+    }
+
+    cb_mutex_enter(&shared_engine->mutex);
+    handle->next = shared_engine->incoming;
+    shared_engine->incoming = handle;
+    cb_mutex_exit(&shared_engine->mutex);
+    wake_engine(shared_engine);
+
+    return true;
+}
 
-    free_response(response_buffer_head);
-    response_buffer_head = NULL;
-    cur_response_buffer = NULL;
+void init_rest_conflate(void) {
+    /* Done from start_conflate() rather than from each handle's thread,
+       and under the lock since handles may be started concurrently. */
+    cb_mutex_t *mutex = get_start_mutex();
+
+    cb_mutex_enter(mutex);
+    init_curl();
+    cb_mutex_exit(mutex);
+}
+
+void run_rest_conflate(void *arg) {
+    conflate_handle_t *handle = (conflate_handle_t *) arg;
+    struct rest_engine engine;
 
-    curl_easy_cleanup(curl_handle);
+    /* A handle with a thread of its own is simply an engine with just
+       the one handle in it. */
+    mk_engine(&engine, 0);
+    adopt_handle(&engine, handle);
+    run_engine(&engine);
 
     exit(1);
 }
@@ -5,7 +5,23 @@
 #define END_OF_CONFIG "\n\n\n\n"
 #define CONFIG_KEY "contents"
 
+/* Default backoff between passes over the url list. */
+#define RETRY_MIN_MS 1000
+#define RETRY_MAX_MS 30000
+#define RETRY_JITTER 50
+
+/* Default connection liveness settings. */
+#define CONNECT_TIMEOUT_MS 10000
+#define IDLE_TIMEOUT_MS 30000
+#define KEEPALIVE_IDLE 30
+#define KEEPALIVE_INTERVAL 10
+
+/* Weight (out of 8) of the newest sample in a url's moving average. */
+#define LATENCY_WEIGHT 2
+
+void init_rest_conflate(void);
 void run_rest_conflate(void *arg);
+bool register_rest_conflate(conflate_handle_t *handle);
 
 #endif	/* REST_H */
 
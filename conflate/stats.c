@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include <libconflate/conflate.h>
+#include "conflate_internal.h"
+
+#define SUB_BUCKETS (1 << STATS_SUB_BITS)
+
+/* The position of the highest bit set in v, which isn't 0. */
+static int highest_bit(uint64_t v)
+{
+#ifdef __GNUC__
+    return 63 - __builtin_clzll(v);
+#else
+    int rv = 0;
+    while (v >>= 1) {
+        rv++;
+    }
+    return rv;
+#endif
+}
+
+/*
+ * Values below SUB_BUCKETS get a bucket each.  Above that, the highest
+ * bit picks the power of two, and the STATS_SUB_BITS bits below it
+ * pick the bucket within it.
+ */
+static int bucket_of(uint64_t v)
+{
+    int bit, rv;
+
+    if (v < SUB_BUCKETS) {
+        return (int)v;
+    }
+    bit = highest_bit(v);
+    rv = ((bit - STATS_SUB_BITS + 1) << STATS_SUB_BITS) +
+        (int)((v >> (bit - STATS_SUB_BITS)) - SUB_BUCKETS);
+    return rv < STATS_BUCKETS ? rv : STATS_BUCKETS - 1;
+}
+
+/* The highest value that lands in a bucket. */
+static uint64_t bucket_top(int bucket)
+{
+    int magnitude = bucket >> STATS_SUB_BITS;
+    uint64_t sub = (uint64_t)(bucket & (SUB_BUCKETS - 1));
+
+    if (magnitude == 0) {
+        return sub;
+    }
+    return ((SUB_BUCKETS + sub + 1) << (magnitude - 1)) - 1;
+}
+
+void conflate_histogram_record(struct conflate_histogram *h, hrtime_t ns)
+{
+    int64_t us = (int64_t)(ns / 1000);
+    int64_t max;
+
+    conflate_atomic_add64(&h->counts[bucket_of((uint64_t)us)], 1);
+    conflate_atomic_add64(&h->total, us);
+    do {
+        max = h->max;
+    } while (us > max && !conflate_cas_int64(&h->max, max, us));
+}
+
+void conflate_count_curl_error(struct conflate_stats *stats, CURLcode code)
+{
+    int slot = (int)code < STATS_CURL_CODES ? (int)code : STATS_CURL_CODES - 1;
+    conflate_atomic_add64(&stats->curl_errors[slot], 1);
+}
+
+/* Builds a chain of pairs in one arena, in order. */
+struct stats_builder {
+    kvpair_arena_t *arena;
+    kvpair_t *head;
+    kvpair_t **tail;
+};
+
+static void add_stat(struct stats_builder *b, const char *key, const char *value)
+{
+    char *values[2];
+    values[0] = (char *)value;
+    values[1] = NULL;
+
+    *b->tail = mk_kvpair_in(b->arena, key, values);
+    b->tail = &(*b->tail)->next;
+}
+
+static void add_number(struct stats_builder *b, const char *key, int64_t value)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lld", (long long)value);
+    add_stat(b, key, buf);
+}
+
+/*
+ * Summarize a histogram.  Counts recorded while we read it may leave
+ * the percentiles a little off, which is fine for monitoring.
+ */
+static void add_histogram(struct stats_builder *b, const char *name,
+                          struct conflate_histogram *h)
+{
+    static const int percentiles[] = { 50, 90, 99 };
+    int64_t counts[STATS_BUCKETS];
+    int64_t count = 0, seen = 0;
+    /* Room for the name and the longest suffix, ".count" */
+    size_t size = strlen(name) + sizeof(".count");
+    char *key = malloc(size);
+    int i, p = 0;
+
+    assert(key);
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        counts[i] = h->counts[i];
+        count += counts[i];
+    }
+
+    snprintf(key, size, "%s.count", name);
+    add_number(b, key, count);
+    if (count == 0) {
+        free(key);
+        return;
+    }
+    snprintf(key, size, "%s.mean", name);
+    add_number(b, key, h->total / count);
+
+    for (i = 0; i < STATS_BUCKETS && p < 3; i++) {
+        seen += counts[i];
+        while (p < 3 && seen * 100 >= count * percentiles[p]) {
+            snprintf(key, size, "%s.p%d", name, percentiles[p]);
+            add_number(b, key, (int64_t)bucket_top(i));
+            p++;
+        }
+    }
+
+    snprintf(key, size, "%s.max", name);
+    add_number(b, key, h->max);
+    free(key);
+}
+
+static void add_command(void *arg, struct command_def *c)
+{
+    struct stats_builder *b = arg;
+    /* Room for the name and the longest suffix, ".latency_us" */
+    size_t size = strlen(c->name) + sizeof("commands..latency_us");
+    char *key;
+
+    if (c->calls == 0) {
+        return;
+    }
+    key = malloc(size);
+    assert(key);
+    snprintf(key, size, "commands.%s.calls", c->name);
+    add_number(b, key, c->calls);
+    snprintf(key, size, "commands.%s.failures", c->name);
+    add_number(b, key, c->failures);
+    if (c->timeouts != 0) {
+        snprintf(key, size, "commands.%s.timeouts", c->name);
+        add_number(b, key, c->timeouts);
+    }
+    snprintf(key, size, "commands.%s.latency_us", c->name);
+    add_histogram(b, key, &c->latency);
+    free(key);
+}
+
+kvpair_t *conflate_get_stats(conflate_handle_t *handle)
+{
+    struct conflate_stats *stats = &handle->stats;
+    struct rest_endpoint *endpoints = stats->endpoints;
+    struct stats_builder b;
+    char key[64];
+    int64_t last_config_at = stats->last_config_at;
+    int64_t written, dropped;
+    int i;
+
+    b.arena = mk_kvpair_arena(0);
+    b.head = NULL;
+    b.tail = &b.head;
+
+    add_number(&b, "bytes_received", stats->bytes_received);
+    add_number(&b, "connections", stats->connections);
+    add_number(&b, "configs_received", stats->configs_received);
+    add_number(&b, "configs_delivered", stats->configs_delivered);
+    add_number(&b, "configs_unchanged", stats->configs_unchanged);
+    add_number(&b, "not_modified", stats->not_modified);
+    if (last_config_at != 0) {
+        add_number(&b, "last_config_age_ms",
+                   (int64_t)((gethrtime() - (hrtime_t)last_config_at) / 1000000));
+    }
+
+    for (i = 0; i < STATS_CURL_CODES; i++) {
+        if (stats->curl_errors[i] != 0) {
+            snprintf(key, sizeof(key), "curl_errors.%d", i);
+            add_number(&b, key, stats->curl_errors[i]);
+        }
+    }
+
+    for (i = 0; endpoints && i < handle->num_endpoints; i++) {
+        struct rest_endpoint *endpoint = &endpoints[i];
+        snprintf(key, sizeof(key), "url.%d", i);
+        add_stat(&b, key, endpoint->url);
+        snprintf(key, sizeof(key), "url.%d.connections", i);
+        add_number(&b, key, endpoint->connections);
+        snprintf(key, sizeof(key), "url.%d.failures", i);
+        add_number(&b, key, endpoint->failures);
+        if (endpoint->measured) {
+            snprintf(key, sizeof(key), "url.%d.latency_us", i);
+            add_number(&b, key, (int64_t)(endpoint->latency / 1000));
+        }
+    }
+
+    add_histogram(&b, "parse_us", &stats->parse_time);
+    add_histogram(&b, "callback_us", &stats->callback_time);
+    add_histogram(&b, "first_config_us", &stats->first_config_time);
+
+    if (conflate_async_log_stats(&written, &dropped)) {
+        add_number(&b, "log_messages", written);
+        add_number(&b, "log_dropped", dropped);
+    }
+
+    conflate_foreach_mgmt_cb(add_command, &b);
+
+    return b.head;
+}
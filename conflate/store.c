@@ -0,0 +1,671 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef WIN32
+#include <io.h>
+#define open _open
+#define read _read
+#define write _write
+#define close _close
+#define fsync _commit
+#define ftruncate _chsize
+#else
+#include <unistd.h>
+#define O_BINARY 0
+#endif
+
+#include <libconflate/conflate.h>
+#include "conflate_internal.h"
+
+/*
+ * Instance-private values are served from an in-memory hash table.
+ * Every change is also appended to a log next to the config at
+ * save_path, which is replayed when the store is first used.
+ *
+ * The log is a series of frames:
+ *
+ *   uint32_t crc, len      (CRC-32 of the len bytes that follow)
+ *   op...
+ *
+ * and each op is
+ *
+ *   uint32_t key_len, value_len  (value_len is STORE_DELETED to delete)
+ *   key, value                   (no terminators)
+ *
+ * A frame is applied all or nothing, so a frame torn by a crash is
+ * dropped when the log is replayed.
+ */
+#define STORE_SUFFIX ".private"
+#define STORE_DELETED 0xffffffffu
+#define STORE_FRAME_HEADER (sizeof(uint32_t) * 2)
+#define STORE_OP_HEADER (sizeof(uint32_t) * 2)
+#define STORE_MIN_BUCKETS 64
+
+/* Rewrite the log once it's this many times what's live in it. */
+#define STORE_COMPACT_RATIO 4
+#define STORE_COMPACT_MIN (64 * 1024)
+
+struct store_entry {
+    char *key;
+    char *value;
+    uint32_t hash;
+    struct store_entry *next;
+};
+
+struct private_store {
+    char *path;                  /* The log file. */
+    struct private_store *next;  /* Next store in the registry. */
+
+    cb_mutex_t mutex;
+    cb_cond_t synced;
+
+    struct store_entry **buckets;
+    size_t num_buckets;
+    size_t num_entries;
+    size_t live_bytes;  /* How big a freshly compacted log would be. */
+
+    int fd;
+    size_t log_bytes;
+    uint64_t appended;  /* Frames written to the log... */
+    uint64_t durable;   /* ...and how many of those were fsynced. */
+    bool syncing;
+    bool compacting;
+};
+
+/* Every store in use, one per save_path.  Stores are never freed. */
+static struct private_store * volatile stores = NULL;
+
+/* Guards loading stores.  See get_stores_mutex(). */
+static cb_mutex_t * volatile stores_mutex = NULL;
+
+static size_t op_size(size_t key_len, size_t value_len)
+{
+    return STORE_OP_HEADER + key_len + value_len;
+}
+
+static struct store_entry **find_entry(struct private_store *store,
+                                       const char *key, size_t key_len,
+                                       uint32_t hash)
+{
+    struct store_entry **e = &store->buckets[hash & (store->num_buckets - 1)];
+
+    while (*e && ((*e)->hash != hash || strncmp((*e)->key, key, key_len) != 0 ||
+                  (*e)->key[key_len] != '\0')) {
+        e = &(*e)->next;
+    }
+    return e;
+}
+
+static void grow_buckets(struct private_store *store)
+{
+    size_t num_buckets = store->num_buckets << 1;
+    struct store_entry **buckets = calloc(num_buckets, sizeof(struct store_entry*));
+    size_t i;
+
+    assert(buckets);
+    for (i = 0; i < store->num_buckets; i++) {
+        struct store_entry *e = store->buckets[i];
+        while (e) {
+            struct store_entry *next = e->next;
+            e->next = buckets[e->hash & (num_buckets - 1)];
+            buckets[e->hash & (num_buckets - 1)] = e;
+            e = next;
+        }
+    }
+
+    free(store->buckets);
+    store->buckets = buckets;
+    store->num_buckets = num_buckets;
+}
+
+static char *copy_string(const char *s, size_t len)
+{
+    char *rv = malloc(len + 1);
+    assert(rv);
+    memcpy(rv, s, len);
+    rv[len] = '\0';
+    return rv;
+}
+
+/* Set a key, or delete it if the value's NULL. */
+static void apply_op(struct private_store *store,
+                     const char *key, size_t key_len,
+                     const char *value, size_t value_len)
+{
+    char *k = copy_string(key, key_len);
+    uint32_t hash = conflate_hash(k);
+    struct store_entry **e = find_entry(store, key, key_len, hash);
+
+    if (*e) {
+        struct store_entry *old = *e;
+        store->live_bytes -= op_size(key_len, strlen(old->value));
+        if (value) {
+            free(old->value);
+            old->value = copy_string(value, value_len);
+            store->live_bytes += op_size(key_len, value_len);
+        } else {
+            *e = old->next;
+            free(old->key);
+            free(old->value);
+            free(old);
+            store->num_entries--;
+        }
+        free(k);
+    } else if (value) {
+        struct store_entry *entry = calloc(1, sizeof(struct store_entry));
+        assert(entry);
+        entry->key = k;
+        entry->value = copy_string(value, value_len);
+        entry->hash = hash;
+        entry->next = *e;
+        *e = entry;
+        store->live_bytes += op_size(key_len, value_len);
+
+        if (++store->num_entries > store->num_buckets * 3 / 4) {
+            grow_buckets(store);
+        }
+    } else {
+        free(k);
+    }
+}
+
+/*
+ * Apply every op in a frame that passed its checksum.  Returns false,
+ * having changed nothing, if the ops don't add up.
+ */
+static bool apply_frame(struct private_store *store,
+                        const char *ops, size_t len)
+{
+    const char *p = ops;
+    const char *end = ops + len;
+
+    /* Check the whole frame before touching anything */
+    while (p < end) {
+        uint32_t lens[2];
+        if ((size_t)(end - p) < STORE_OP_HEADER) {
+            return false;
+        }
+        memcpy(lens, p, sizeof(lens));
+        if (lens[0] > (size_t)(end - p) - STORE_OP_HEADER ||
+            (lens[1] != STORE_DELETED &&
+             lens[1] > (size_t)(end - p) - STORE_OP_HEADER - lens[0])) {
+            return false;
+        }
+        p += op_size(lens[0], lens[1] == STORE_DELETED ? 0 : lens[1]);
+    }
+
+    for (p = ops; p < end; ) {
+        uint32_t lens[2];
+        const char *key = p + STORE_OP_HEADER;
+        memcpy(lens, p, sizeof(lens));
+        if (lens[1] == STORE_DELETED) {
+            apply_op(store, key, lens[0], NULL, 0);
+            p += op_size(lens[0], 0);
+        } else {
+            apply_op(store, key, lens[0], key + lens[0], lens[1]);
+            p += op_size(lens[0], lens[1]);
+        }
+    }
+    return true;
+}
+
+/* Wrap up ops (ops_len bytes after the header) as a frame. */
+static void seal_frame(char *frame, size_t ops_len)
+{
+    uint32_t header[2];
+    header[1] = (uint32_t) ops_len;
+    header[0] = conflate_crc32(frame + STORE_FRAME_HEADER, ops_len);
+    memcpy(frame, header, sizeof(header));
+}
+
+static char *encode_op(char *p, const char *key, const char *value)
+{
+    uint32_t lens[2];
+    lens[0] = (uint32_t) strlen(key);
+    lens[1] = value ? (uint32_t) strlen(value) : STORE_DELETED;
+    memcpy(p, lens, sizeof(lens));
+    p += STORE_OP_HEADER;
+    memcpy(p, key, lens[0]);
+    p += lens[0];
+    if (value) {
+        memcpy(p, value, lens[1]);
+        p += lens[1];
+    }
+    return p;
+}
+
+static bool write_fully(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        int written = write(fd, data, (unsigned int) len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+static char *read_file(int fd, size_t *size)
+{
+    struct stat st;
+    char *rv;
+    size_t used = 0;
+
+    if (fstat(fd, &st) != 0) {
+        return NULL;
+    }
+    *size = (size_t) st.st_size;
+    rv = malloc(*size + 1);
+    assert(rv);
+
+    while (used < *size) {
+        int n = read(fd, rv + used, (unsigned int)(*size - used));
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        used += n;
+    }
+    *size = used;
+    return rv;
+}
+
+/* Replay the log, dropping anything after the first bad frame. */
+static void load_store(struct private_store *store, conflate_handle_t *handle)
+{
+    size_t size = 0;
+    size_t good = 0;
+    char *data = read_file(store->fd, &size);
+
+    if (data == NULL) {
+        return;
+    }
+
+    while (size - good >= STORE_FRAME_HEADER) {
+        uint32_t header[2];
+        memcpy(header, data + good, sizeof(header));
+        if (header[1] > size - good - STORE_FRAME_HEADER ||
+            header[0] != conflate_crc32(data + good + STORE_FRAME_HEADER,
+                                        header[1]) ||
+            !apply_frame(store, data + good + STORE_FRAME_HEADER, header[1])) {
+            break;
+        }
+        good += STORE_FRAME_HEADER + header[1];
+    }
+
+    if (good < size) {
+        handle->conf->log(handle->conf->userdata, LOG_LVL_WARN,
+                          "Dropping %u damaged bytes from the end of %s",
+                          (unsigned int)(size - good), store->path);
+        if (ftruncate(store->fd, good) != 0) {
+            handle->conf->log(handle->conf->userdata, LOG_LVL_ERROR,
+                              "Can't truncate %s: %s", store->path,
+                              strerror(errno));
+        }
+    }
+
+    store->log_bytes = good;
+    free(data);
+}
+
+static struct private_store *mk_store(conflate_handle_t *handle,
+                                      const char *filename)
+{
+    struct private_store *store = calloc(1, sizeof(struct private_store));
+    size_t len = strlen(filename) + sizeof(STORE_SUFFIX);
+
+    assert(store);
+    store->path = malloc(len);
+    assert(store->path);
+    snprintf(store->path, len, "%s%s", filename, STORE_SUFFIX);
+
+    cb_mutex_initialize(&store->mutex);
+    cb_cond_initialize(&store->synced);
+    store->num_buckets = STORE_MIN_BUCKETS;
+    store->buckets = calloc(store->num_buckets, sizeof(struct store_entry*));
+    assert(store->buckets);
+
+    store->fd = open(store->path, O_RDWR | O_CREAT | O_APPEND | O_BINARY, 0644);
+    if (store->fd < 0) {
+        handle->conf->log(handle->conf->userdata, LOG_LVL_ERROR,
+                          "Can't open %s: %s", store->path, strerror(errno));
+    } else {
+        load_store(store, handle);
+    }
+
+    return store;
+}
+
+/*
+ * The platform has no static mutex initializer, so the mutex is made
+ * by whichever thread needs it first.
+ */
+static cb_mutex_t *get_stores_mutex(void)
+{
+    cb_mutex_t *mutex = stores_mutex;
+
+    if (mutex == NULL) {
+        mutex = malloc(sizeof(cb_mutex_t));
+        assert(mutex);
+        cb_mutex_initialize(mutex);
+        if (!conflate_cas_ptr(&stores_mutex, NULL, mutex)) {
+            /* Somebody else made one first */
+            cb_mutex_destroy(mutex);
+            free(mutex);
+            mutex = stores_mutex;
+        }
+    }
+
+    return mutex;
+}
+
+static struct private_store *find_store(const char *filename)
+{
+    size_t len = strlen(filename);
+    struct private_store *s;
+
+    for (s = stores; s; s = s->next) {
+        if (strncmp(s->path, filename, len) == 0 &&
+            strcmp(s->path + len, STORE_SUFFIX) == 0) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Find the store for a save_path, loading it the first time.  Only
+ * one thread ever loads a store, since loading may truncate a torn
+ * frame off the end of the log.
+ */
+static struct private_store *get_store(conflate_handle_t *handle,
+                                       const char *filename)
+{
+    struct private_store *store = find_store(filename);
+    cb_mutex_t *mutex;
+
+    if (store) {
+        return store;
+    }
+
+    mutex = get_stores_mutex();
+    cb_mutex_enter(mutex);
+    store = find_store(filename);
+    if (store == NULL) {
+        store = mk_store(handle, filename);
+        store->next = stores;
+        /* Readers don't take the mutex, so the store has to be
+           complete before they can see it */
+        conflate_barrier();
+        stores = store;
+    }
+    cb_mutex_exit(mutex);
+
+    return store;
+}
+
+#ifndef WIN32
+static void run_compaction(void *arg);
+#endif
+
+static void maybe_compact(struct private_store *store)
+{
+#ifndef WIN32
+    if (!store->compacting && store->log_bytes > STORE_COMPACT_MIN &&
+        store->log_bytes > store->live_bytes * STORE_COMPACT_RATIO) {
+        cb_thread_t tid;
+        store->compacting = true;
+        if (cb_create_thread(&tid, run_compaction, store, 1) != 0) {
+            store->compacting = false;
+        }
+    }
+#else
+    /* Open files can't be renamed over here, so the log just grows */
+    (void)store;
+#endif
+}
+
+/*
+ * Wait until everything up to the given frame is on disk.  Whoever
+ * gets here first syncs for everybody waiting, so concurrent writers
+ * share fsyncs.  Called and returns with the store locked.
+ */
+static bool wait_until_durable(struct private_store *store, uint64_t seq)
+{
+    while (store->durable < seq) {
+        if (store->syncing) {
+            cb_cond_wait(&store->synced, &store->mutex);
+        } else {
+            uint64_t target = store->appended;
+            int fd = store->fd;
+            bool ok;
+
+            store->syncing = true;
+            cb_mutex_exit(&store->mutex);
+            ok = fsync(fd) == 0;
+            cb_mutex_enter(&store->mutex);
+            store->syncing = false;
+
+            if (ok && target > store->durable) {
+                store->durable = target;
+            }
+            cb_cond_broadcast(&store->synced);
+            if (!ok) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Apply a list of changes as one frame: pairs with a value set the
+ * key to its first value, and pairs without any delete the key.
+ */
+static bool store_commit(conflate_handle_t *handle, const char *filename,
+                         kvpair_t *changes)
+{
+    struct private_store *store;
+    size_t len = STORE_FRAME_HEADER;
+    char *frame, *p;
+    kvpair_t *c;
+    uint64_t seq;
+    bool rv;
+
+    if (filename == NULL) {
+        /* No save_path, so nowhere to keep it */
+        return false;
+    }
+    store = get_store(handle, filename);
+
+    for (c = changes; c; c = c->next) {
+        len += op_size(strlen(c->key),
+                       c->used_values > 0 ? strlen(c->values[0]) : 0);
+    }
+
+    frame = malloc(len);
+    assert(frame);
+    p = frame + STORE_FRAME_HEADER;
+    for (c = changes; c; c = c->next) {
+        p = encode_op(p, c->key, c->used_values > 0 ? c->values[0] : NULL);
+    }
+    seal_frame(frame, len - STORE_FRAME_HEADER);
+
+    cb_mutex_enter(&store->mutex);
+    rv = store->fd >= 0 && write_fully(store->fd, frame, len);
+    if (rv) {
+        apply_frame(store, frame + STORE_FRAME_HEADER, len - STORE_FRAME_HEADER);
+        store->log_bytes += len;
+        seq = ++store->appended;
+        maybe_compact(store);
+
+        if (handle->conf->save_fsync) {
+            rv = wait_until_durable(store, seq);
+        }
+    }
+    cb_mutex_exit(&store->mutex);
+
+    if (!rv) {
+        handle->conf->log(handle->conf->userdata, LOG_LVL_ERROR,
+                          "Can't write to %s: %s", store->path,
+                          strerror(errno));
+    }
+
+    free(frame);
+    return rv;
+}
+
+#ifndef WIN32
+/*
+ * Rewrite the log with one frame holding what's live.  The snapshot
+ * is written without holding the lock; only the frames appended
+ * while that was going on are copied over with it held.
+ */
+static void run_compaction(void *arg)
+{
+    struct private_store *store = (struct private_store *) arg;
+    size_t tmp_len = strlen(store->path) + sizeof(".tmp");
+    char *tmp = malloc(tmp_len);
+    char *frame, *p;
+    size_t len, start, i;
+    bool ok;
+    int fd;
+
+    assert(tmp);
+    snprintf(tmp, tmp_len, "%s.tmp", store->path);
+
+    cb_mutex_enter(&store->mutex);
+    len = STORE_FRAME_HEADER + store->live_bytes;
+    frame = malloc(len);
+    assert(frame);
+    p = frame + STORE_FRAME_HEADER;
+    for (i = 0; i < store->num_buckets; i++) {
+        struct store_entry *e;
+        for (e = store->buckets[i]; e; e = e->next) {
+            p = encode_op(p, e->key, e->value);
+        }
+    }
+    start = store->log_bytes;
+    cb_mutex_exit(&store->mutex);
+
+    seal_frame(frame, len - STORE_FRAME_HEADER);
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    ok = fd >= 0 && write_fully(fd, frame, len);
+    free(frame);
+
+    cb_mutex_enter(&store->mutex);
+    /* Don't pull the log out from under an fsync */
+    while (store->syncing) {
+        cb_cond_wait(&store->synced, &store->mutex);
+    }
+
+    if (ok && store->log_bytes > start) {
+        size_t tail = store->log_bytes - start;
+        char *buf = malloc(tail);
+        assert(buf);
+        ok = pread(store->fd, buf, tail, (off_t) start) == (ssize_t) tail &&
+            write_fully(fd, buf, tail);
+        len += tail;
+        free(buf);
+    }
+
+    if (ok && fsync(fd) == 0 && rename(tmp, store->path) == 0) {
+        conflate_sync_parent_dir(store->path);
+        close(store->fd);
+        store->fd = fd;
+        store->log_bytes = len;
+        store->durable = store->appended;
+    } else {
+        if (fd >= 0) {
+            close(fd);
+        }
+        remove(tmp);
+    }
+    store->compacting = false;
+    cb_mutex_exit(&store->mutex);
+
+    free(tmp);
+}
+#endif
+
+bool conflate_update_private(conflate_handle_t *handle,
+                             kvpair_t *changes, const char *filename)
+{
+    return store_commit(handle, filename, changes);
+}
+
+bool conflate_save_private(conflate_handle_t *handle,
+                           const char *k, const char *v, const char *filename)
+{
+    kvpair_t change;
+    char *values[2];
+
+    memset(&change, 0, sizeof(change));
+    values[0] = (char *) v;
+    values[1] = NULL;
+    change.key = (char *) k;
+    change.values = values;
+    change.used_values = 1;
+
+    return store_commit(handle, filename, &change);
+}
+
+bool conflate_delete_private(conflate_handle_t *handle,
+                             const char *k, const char *filename)
+{
+    struct private_store *store;
+    kvpair_t change;
+    bool found;
+
+    if (filename == NULL) {
+        return false;
+    }
+    store = get_store(handle, filename);
+
+    /* Nothing to log if it's not there */
+    cb_mutex_enter(&store->mutex);
+    found = *find_entry(store, k, strlen(k), conflate_hash(k)) != NULL;
+    cb_mutex_exit(&store->mutex);
+    if (!found) {
+        return true;
+    }
+
+    memset(&change, 0, sizeof(change));
+    change.key = (char *) k;
+    return store_commit(handle, filename, &change);
+}
+
+char *conflate_get_private(conflate_handle_t *handle,
+                           const char *k, const char *filename)
+{
+    struct private_store *store;
+    struct store_entry *e;
+    char *rv = NULL;
+
+    if (filename == NULL) {
+        return NULL;
+    }
+    store = get_store(handle, filename);
+
+    cb_mutex_enter(&store->mutex);
+    e = *find_entry(store, k, strlen(k), conflate_hash(k));
+    if (e) {
+        rv = safe_strdup(e->value);
+    }
+    cb_mutex_exit(&store->mutex);
+
+    return rv;
+}
@@ -2,8 +2,11 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+#include <zlib.h>
 
 #include <libconflate/conflate.h>
+#include "conflate_internal.h"
 
 char* safe_strdup(const char* in) {
     int len = strlen(in);
@@ -21,3 +24,30 @@ void free_string_list(char **vals)
     }
     free(vals);
 }
+
+uint32_t conflate_hash(const char *str)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261u;
+    const unsigned char *p = (const unsigned char *)str;
+    while (*p) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+uint32_t conflate_crc32(const void *data, size_t len)
+{
+    const Bytef *p = (const Bytef *)data;
+    uLong crc = crc32(0L, Z_NULL, 0);
+
+    /* zlib takes the length as an unsigned int */
+    while (len > 0) {
+        uInt chunk = len > UINT_MAX ? UINT_MAX : (uInt)len;
+        crc = crc32(crc, p, chunk);
+        p += chunk;
+        len -= chunk;
+    }
+    return (uint32_t)crc;
+}
@@ -6,61 +6,200 @@
 #include <libconflate/conflate.h>
 #include "conflate_internal.h"
 
-/** \private */
-struct command_def {
-    char *name;
-    char *description;
-    conflate_mgmt_cb_t cb;
-    struct command_def *next;
+/*
+ * The registered commands, in an open addressed hash table that is
+ * never changed once published.  Registering a new command publishes
+ * a new copy of the table, so lookups never take a lock or wait on one;
+ * registering one again just updates it where it is.
+ * Tables that were replaced are kept, since a lookup may still be
+ * reading them; commands are only registered a handful of times.
+ */
+struct command_table {
+    size_t size; /* A power of two, at least twice count. */
+    size_t count;
+    struct command_def **slots;
+    struct command_table *retired;
 };
 
-struct command_def *commands = NULL;
+static struct command_table * volatile commands = NULL;
 
-void* run_conflate(void *arg);
+/* Descriptions of commands registered again, kept for the same reason. */
+struct retired_string {
+    char *str;
+    struct retired_string *next;
+};
 
-void conflate_init_form(conflate_form_result *r)
-{
-    (void)r;
-}
+static struct retired_string * volatile retired_descriptions = NULL;
+
+void* run_conflate(void *arg);
 
-void conflate_next_fieldset(conflate_form_result *r) {
-    (void)r;
+void* run_conflate(void *arg) {
+    (void)arg;
     assert(0);
+    return NULL;
 }
 
-void conflate_add_field(conflate_form_result *r, const char *k, const char *v) {
-    (void)r;
-    (void)k;
-    (void)v;
-    assert(0);
+/* ------------------------------------------------------------------------ */
+
+/* Where a command is in the table, or the empty slot it would go. */
+static size_t find_slot(struct command_table *table, const char *name)
+{
+    size_t i = conflate_hash(name) & (table->size - 1);
+
+    while (table->slots[i] && strcmp(table->slots[i]->name, name) != 0) {
+        i = (i + 1) & (table->size - 1);
+    }
+    return i;
 }
 
-void conflate_add_field_multi(conflate_form_result *r, const char *k,
-                              const char **v) {
-    (void)r;
-    (void)k;
-    (void)v;
-    assert(0);
+static struct command_def *find_command(const char *name)
+{
+    struct command_table *table = commands;
+    return table ? table->slots[find_slot(table, name)] : NULL;
 }
 
-void* run_conflate(void *arg) {
-    (void)arg;
-    assert(0);
-    return NULL;
+static void retire_description(char *desc)
+{
+    struct retired_string *r = calloc(1, sizeof(struct retired_string));
+    assert(r);
+
+    r->str = desc;
+    do {
+        r->next = retired_descriptions;
+    } while (!conflate_cas_ptr(&retired_descriptions, r->next, r));
 }
 
-/* ------------------------------------------------------------------------ */
+/* A copy of a table, with room for one more command. */
+static struct command_table *copy_table(struct command_table *old)
+{
+    struct command_table *rv = calloc(1, sizeof(struct command_table));
+    size_t i;
+    assert(rv);
+
+    rv->size = 16;
+    while (old && rv->size < (old->count + 1) * 2) {
+        rv->size <<= 1;
+    }
+    rv->slots = calloc(rv->size, sizeof(struct command_def *));
+    assert(rv->slots);
+
+    for (i = 0; old && i < old->size; i++) {
+        if (old->slots[i]) {
+            rv->slots[find_slot(rv, old->slots[i]->name)] = old->slots[i];
+            rv->count++;
+        }
+    }
+    rv->retired = old;
+    return rv;
+}
 
 void conflate_register_mgmt_cb(const char *cmd, const char *desc,
                                conflate_mgmt_cb_t cb)
 {
-    struct command_def *c = calloc(1, sizeof(struct command_def));
-    assert(c);
+    conflate_register_mgmt_cb_timeout(cmd, desc, cb, MGMT_TIMEOUT_MS);
+}
+
+void conflate_register_mgmt_cb_timeout(const char *cmd, const char *desc,
+                                       conflate_mgmt_cb_t cb, int timeout_ms)
+{
+    struct command_def *c = NULL;
+    struct command_def *existing;
+    struct command_table *old, *table;
+
+    /* If another registration gets in first, start over from its
+       table. */
+    do {
+        old = commands;
+        existing = old ? old->slots[find_slot(old, cmd)] : NULL;
+        if (existing) {
+            break;
+        }
+        if (c == NULL) {
+            c = calloc(1, sizeof(struct command_def));
+            assert(c);
+            c->name = safe_strdup(cmd);
+            c->description = safe_strdup(desc);
+            c->cb = cb;
+            c->timeout_ms = timeout_ms;
+        }
+        table = copy_table(old);
+        table->slots[find_slot(table, cmd)] = c;
+        table->count++;
+        if (!conflate_cas_ptr(&commands, old, table)) {
+            free(table->slots);
+            free(table);
+            table = NULL;
+        }
+    } while (table == NULL);
+
+    if (existing) {
+        /* A command registered again keeps its place, and its stats */
+        char *old_desc = existing->description;
+        if (strcmp(old_desc, desc) != 0) {
+            existing->description = safe_strdup(desc);
+            retire_description(old_desc);
+        }
+        existing->timeout_ms = timeout_ms;
+        conflate_barrier();
+        existing->cb = cb;
+        if (c) {
+            free(c->name);
+            free(c->description);
+            free(c);
+        }
+    }
+}
+
+enum conflate_mgmt_cb_result conflate_dispatch_mgmt_cb(conflate_handle_t *handle,
+                                                       const char *cmd,
+                                                       bool direct,
+                                                       kvpair_t *form,
+                                                       conflate_form_result *r)
+{
+    struct command_def *c = find_command(cmd);
+    enum conflate_mgmt_cb_result rv;
+    conflate_form_result scratch;
+    hrtime_t start;
+
+    if (c == NULL) {
+        return RV_UNKNOWN;
+    }
 
-    c->name = safe_strdup(cmd);
-    c->description = safe_strdup(desc);
-    c->cb = cb;
-    c->next = commands;
+    /* Commands always get somewhere to reply, even if nobody wants it */
+    if (r == NULL) {
+        conflate_init_form_result(&scratch);
+        r = &scratch;
+    }
+
+    start = gethrtime();
+    r->command = c;
+    r->started = start;
+    rv = c->cb(handle ? handle->conf->userdata : NULL,
+               handle, cmd, direct, form, r);
+    conflate_atomic_add64(&c->calls, 1);
+    /* A deferred reply is timed and counted when it's completed */
+    if (r->deferred == NULL) {
+        conflate_histogram_record(&c->latency, gethrtime() - start);
+        if (rv != RV_OK && rv != RV_PENDING) {
+            conflate_atomic_add64(&c->failures, 1);
+        }
+    }
+
+    if (r == &scratch) {
+        conflate_free_form_result(&scratch);
+    }
+    return rv;
+}
+
+void conflate_foreach_mgmt_cb(void (*visit)(void *arg, struct command_def *c),
+                              void *arg)
+{
+    struct command_table *table = commands;
+    size_t i;
 
-    commands = c;
+    for (i = 0; table && i < table->size; i++) {
+        if (table->slots[i]) {
+            visit(arg, table->slots[i]);
+        }
+    }
 }
@@ -23,6 +23,12 @@ extern "C" {
  * \section docs_sec API Documentation
  *
  * Jump right into <a href="modules.html">the modules docs</a> to get started.
+ *
+ * \section abi_sec Compatibility
+ *
+ * Version 2 of the shared library is not binary compatible with
+ * version 1: kvpair_t and conflate_config_t have new fields, so
+ * anything built against the old header has to be rebuilt.
  */
 
 /* Deal with an ICC annoyance.  It tries hard to pretend to be GCC<
@@ -74,6 +80,15 @@ typedef struct _conflate_handle conflate_handle_t;
  * @{
  */
 
+/**
+ * A region of memory holding whole chains of kvpairs.
+ *
+ * Pairs made with ::mk_kvpair_in, ::dup_kvpair_in or ::dup_kvpair_packed
+ * are carved out of a few large blocks instead of being allocated one
+ * piece at a time, and are all released together.
+ */
+typedef struct kvpair_arena kvpair_arena_t;
+
 /**
  * A linked list of keys each which may have zero or more values.
  */
@@ -96,6 +111,11 @@ typedef struct kvpair {
      * The next kv pair in this list.  NULL if this is the last.
      */
     struct kvpair* next;
+
+    /** \private */
+    struct kvpair_index* index;
+    /** \private */
+    kvpair_arena_t* arena;
 } kvpair_t;
 
 /**
@@ -125,6 +145,45 @@ LIBCONFLATE_PUBLIC_API
 kvpair_t* mk_kvpair(const char* k, char** v)
     __libconflate_gcc_attribute__ ((warn_unused_result, nonnull (1)));
 
+/**
+ * Create an arena for kvpairs.
+ *
+ * @param size_hint roughly how many bytes the pairs will need, or 0
+ * @return a newly allocated, empty arena
+ */
+LIBCONFLATE_PUBLIC_API
+kvpair_arena_t *mk_kvpair_arena(size_t size_hint)
+    __libconflate_gcc_attribute__ ((warn_unused_result));
+
+/**
+ * Create a kvpair_t inside an arena.
+ *
+ * Values added to it later with ::add_kvpair_value or
+ * ::add_kvpair_value_nocopy live in the arena as well.  Chains should
+ * only link pairs from the same arena, and the pair at the head of the
+ * chain owns the arena: calling ::free_kvpair on it releases every
+ * pair in the arena at once.
+ *
+ * @param arena the arena to allocate from
+ * @param k the key for this kvpair
+ * @param v (optional) the list of values for this key.
+ * @return a kvpair_t that lives as long as the arena
+ */
+LIBCONFLATE_PUBLIC_API
+kvpair_t* mk_kvpair_in(kvpair_arena_t* arena, const char* k, char** v)
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull (1, 2)));
+
+/**
+ * Release an arena and every kvpair in it.
+ *
+ * Only needed for arenas that never had a chain freed with
+ * ::free_kvpair.
+ *
+ * @param arena the arena to free
+ */
+LIBCONFLATE_PUBLIC_API
+void free_kvpair_arena(kvpair_arena_t *arena);
+
 /**
  * Add a value to a kvpair_t.
  *
@@ -135,9 +194,26 @@ LIBCONFLATE_PUBLIC_API
 void add_kvpair_value(kvpair_t* kvpair, const char* value)
     __libconflate_gcc_attribute__ ((nonnull (1, 2)));
 
+/**
+ * Add a value to a kvpair_t without copying it.
+ *
+ * The kvpair_t takes ownership of the value, which must have been
+ * allocated with malloc() and will be released by ::free_kvpair.
+ * This avoids a second copy of large values such as complete
+ * configurations.
+ *
+ * @param kvpair the current kvpair that needs a new value
+ * @param value the new value (ownership is transferred)
+ */
+LIBCONFLATE_PUBLIC_API
+void add_kvpair_value_nocopy(kvpair_t* kvpair, char* value)
+    __libconflate_gcc_attribute__ ((nonnull (1, 2)));
+
 /**
  * Find a kvpair with the given key.
  *
+ * This walks the chain, unless it was indexed with ::index_kvpair.
+ *
  * @param pair start of a pair chain
  * @param key the desired key
  *
@@ -147,6 +223,30 @@ LIBCONFLATE_PUBLIC_API
 kvpair_t* find_kvpair(kvpair_t* pair, const char* key)
     __libconflate_gcc_attribute__ ((warn_unused_result, nonnull (2)));
 
+/**
+ * Index a chain so lookups from its first pair take constant time.
+ *
+ * Worth it for a long chain that's searched many times, such as a
+ * config snapshot.  Until the index is dropped, the chain must not
+ * change: no pairs added, removed or freed, and no keys changed.
+ * Any number of threads may then search it at once.  The index is
+ * freed with the chain.
+ *
+ * @param pair the first pair of the chain, which lookups start from
+ */
+LIBCONFLATE_PUBLIC_API
+void index_kvpair(kvpair_t *pair)
+    __libconflate_gcc_attribute__ ((nonnull (1)));
+
+/**
+ * Discard the lookup index built for a chain, if any, so the chain
+ * can be changed again.
+ *
+ * @param pair the pair passed to ::index_kvpair
+ */
+LIBCONFLATE_PUBLIC_API
+void drop_kvpair_index(kvpair_t *pair);
+
 /**
  * Find a simple value from a kvpair list.
  *
@@ -166,7 +266,7 @@ char *get_simple_kvpair_val(kvpair_t *pair, const char *key)
 /**
  * Copy a chain of kvpairs.
  *
- * @param pair the pair to duplicate (recursively)
+ * @param pair the pair to duplicate (with the rest of its chain)
  *
  * @return a complete deep copy of the kvpair structure
  */
@@ -174,6 +274,53 @@ LIBCONFLATE_PUBLIC_API
 kvpair_t *dup_kvpair(kvpair_t *pair)
     __libconflate_gcc_attribute__ ((warn_unused_result, nonnull (1)));
 
+/**
+ * Copy a chain of kvpairs into a new arena.
+ *
+ * The arena is sized up front so the copy takes a single allocation,
+ * and like any arena chain it can only be freed as a whole, by
+ * calling ::free_kvpair on its head.
+ *
+ * @param pair the pair to duplicate (with the rest of its chain)
+ *
+ * @return a deep copy of the chain in an arena of its own
+ */
+LIBCONFLATE_PUBLIC_API
+kvpair_t *dup_kvpair_packed(kvpair_t *pair)
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull (1)));
+
+/**
+ * Copy a chain of kvpairs into an arena.
+ *
+ * @param arena the arena to hold the copy
+ * @param pair the pair to duplicate (with the rest of its chain)
+ *
+ * @return a deep copy of the chain, freed along with the arena
+ */
+LIBCONFLATE_PUBLIC_API
+kvpair_t *dup_kvpair_in(kvpair_arena_t *arena, kvpair_t *pair)
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull (1, 2)));
+
+/**
+ * Compare two chains of kvpairs by key.
+ *
+ * Keys are matched regardless of their order in either chain.  Each
+ * of the result chains is a newly allocated copy that the caller
+ * frees with ::free_kvpair, and is NULL if there's nothing in it.
+ *
+ * @param before the chain to compare against
+ * @param after the chain to compare
+ * @param added receives the pairs whose keys are only in \a after
+ * @param removed receives the pairs whose keys are only in \a before
+ * @param changed receives the pairs from \a after whose values differ
+ *
+ * @return false if the chains hold exactly the same keys and values
+ */
+LIBCONFLATE_PUBLIC_API
+bool diff_kvpair(kvpair_t *before, kvpair_t *after,
+                 kvpair_t **added, kvpair_t **removed, kvpair_t **changed)
+    __libconflate_gcc_attribute__ ((nonnull (3, 4, 5)));
+
 /**
  * Walk a kvpair.
  *
@@ -188,11 +335,88 @@ void walk_kvpair(kvpair_t *pair, void *opaque, kvpair_visitor_t visitor)
 /**
  * Free a chain of kvpairs.
  *
- * @param pair the pair to free (recursively)
+ * If the chain lives in an arena, the whole arena is released at once,
+ * when the last snapshot of it (see ::conflate_snapshot_retain) is
+ * released.
+ *
+ * @param pair the pair to free, along with the rest of its chain
  */
 LIBCONFLATE_PUBLIC_API
 void free_kvpair(kvpair_t* pair);
 
+/**
+ * A place to publish the current config for other threads to read.
+ */
+typedef struct conflate_snapshot_slot conflate_snapshot_slot_t;
+
+/**
+ * Keep a config beyond the callback that received it.
+ *
+ * Configs built in an arena are shared rather than copied: this just
+ * takes another reference to it.  Any other chain is copied into an
+ * arena first.  Either way, the snapshot must not be modified.
+ *
+ * @param config the config to keep
+ * @return the snapshot, to be given back with ::conflate_snapshot_release
+ */
+LIBCONFLATE_PUBLIC_API
+kvpair_t *conflate_snapshot_retain(kvpair_t *config)
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull (1)));
+
+/**
+ * Drop a reference to a snapshot.
+ *
+ * The memory goes when the last reference does.
+ *
+ * @param snapshot a snapshot from ::conflate_snapshot_retain or
+ *        ::conflate_snapshot_acquire
+ */
+LIBCONFLATE_PUBLIC_API
+void conflate_snapshot_release(kvpair_t *snapshot);
+
+/**
+ * Create an empty snapshot slot.
+ */
+LIBCONFLATE_PUBLIC_API
+conflate_snapshot_slot_t *mk_conflate_snapshot_slot(void)
+    __libconflate_gcc_attribute__ ((warn_unused_result));
+
+/**
+ * Free a snapshot slot, releasing the snapshot in it.
+ *
+ * Nobody may be using the slot any more.
+ */
+LIBCONFLATE_PUBLIC_API
+void free_conflate_snapshot_slot(conflate_snapshot_slot_t *slot);
+
+/**
+ * Make a config the slot's current snapshot.
+ *
+ * Typically called from the new_config callback.  The slot retains
+ * its own snapshot of the config (see ::conflate_snapshot_retain), so
+ * the caller keeps whatever reference it had.  The previous snapshot
+ * is released once no reader can still be acquiring it, which may
+ * make this wait briefly; readers are never held up by a publish.
+ * Concurrent publishes to the same slot take turns.
+ *
+ * @param slot the slot to publish to
+ * @param config the new config, or NULL to empty the slot
+ */
+LIBCONFLATE_PUBLIC_API
+void conflate_snapshot_publish(conflate_snapshot_slot_t *slot, kvpair_t *config)
+    __libconflate_gcc_attribute__ ((nonnull (1)));
+
+/**
+ * Get a reference to the slot's current snapshot without locking.
+ *
+ * @param slot the slot to read from
+ * @return the snapshot, to be given back with
+ *         ::conflate_snapshot_release, or NULL if nothing was published
+ */
+LIBCONFLATE_PUBLIC_API
+kvpair_t *conflate_snapshot_acquire(conflate_snapshot_slot_t *slot)
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull (1)));
+
 /**
  * @}
  */
@@ -211,12 +435,23 @@ void free_kvpair(kvpair_t* pair);
 /**
  * Callback response form builder.
  *
+ * Keys and values are copied into one growing buffer as they're
+ * added, so even a reply with thousands of fields takes only a few
+ * allocations.
+ *
  * \sa ::conflate_add_field
  * \sa ::conflate_add_field_multi
  * \sa ::conflate_next_fieldset
  */
 typedef struct _conflate_form_result conflate_form_result;
 
+/**
+ * A management command's deferred reply.
+ *
+ * \sa ::conflate_mgmt_defer
+ */
+typedef struct conflate_mgmt_pending conflate_mgmt_pending_t;
+
 /**
  * Add a single k/v pair in a response form.
  *
@@ -273,7 +508,10 @@ void conflate_init_form(conflate_form_result *r);
 enum conflate_mgmt_cb_result {
     RV_OK,     /**< Invocation worked as expected */
     RV_ERROR,  /**< Invocation failed. */
-    RV_BADARG  /**< Bad/incomplete arguments */
+    RV_BADARG, /**< Bad/incomplete arguments */
+    RV_UNKNOWN, /**< No such command is registered */
+    RV_PENDING, /**< The reply was deferred (see ::conflate_mgmt_defer) */
+    RV_TIMEOUT  /**< A deferred reply wasn't completed in time */
 };
 
 /**
@@ -309,6 +547,10 @@ typedef enum conflate_mgmt_cb_result (*conflate_mgmt_cb_t)(void *opaque,
  * See the definition of ::conflate_mgmt_cb_t for more information on
  * result types.
  *
+ * Commands may be registered at any time from any thread, without
+ * holding up commands being dispatched.  Registering a name again
+ * replaces its callback, description and timeout, keeping its stats.
+ *
  * @param cmd the node name of the command
  * @param desc short description of the command
  * @param cb the callback to issue when this command is invoked
@@ -318,6 +560,161 @@ void conflate_register_mgmt_cb(const char *cmd, const char *desc,
                                conflate_mgmt_cb_t cb)
     __libconflate_gcc_attribute__ ((nonnull (1, 2, 3)));
 
+/**
+ * Register a management command handler whose deferred replies have
+ * their own time limit.
+ *
+ * ::conflate_register_mgmt_cb gives them 30 seconds.
+ *
+ * @param cmd the node name of the command
+ * @param desc short description of the command
+ * @param cb the callback to issue when this command is invoked
+ * @param timeout_ms how long a deferred reply may take before the
+ *        caller gets RV_TIMEOUT instead, or 0 to wait as long as it takes
+ */
+LIBCONFLATE_PUBLIC_API
+void conflate_register_mgmt_cb_timeout(const char *cmd, const char *desc,
+                                       conflate_mgmt_cb_t cb, int timeout_ms)
+    __libconflate_gcc_attribute__ ((nonnull (1, 2, 3)));
+
+/**
+ * Defer the reply to a management command.
+ *
+ * A callback with slow work to do calls this, hands the token to
+ * whatever does the work and returns RV_PENDING.  Other commands are
+ * served in the meantime.  The work fills in the form from
+ * ::conflate_mgmt_pending_form and finishes with
+ * ::conflate_mgmt_complete, from any thread.
+ *
+ * Only the management socket can take a deferred reply.  Elsewhere
+ * this returns NULL and the callback has to reply before it returns.
+ *
+ * @param r the result form as handed to the callback
+ *
+ * @return the token for the reply, or NULL if it can't be deferred
+ */
+LIBCONFLATE_PUBLIC_API
+conflate_mgmt_pending_t *conflate_mgmt_defer(conflate_form_result *r)
+    __libconflate_gcc_attribute__ ((nonnull (1)));
+
+/**
+ * The form to fill in for a deferred reply.
+ */
+LIBCONFLATE_PUBLIC_API
+conflate_form_result *conflate_mgmt_pending_form(conflate_mgmt_pending_t *p)
+    __libconflate_gcc_attribute__ ((nonnull (1)));
+
+/**
+ * Send a deferred reply.
+ *
+ * Every token must be completed exactly once, even if its time ran
+ * out or the client went away, and isn't valid afterwards.
+ *
+ * @param p the token from ::conflate_mgmt_defer
+ * @param rv the command's result
+ */
+LIBCONFLATE_PUBLIC_API
+void conflate_mgmt_complete(conflate_mgmt_pending_t *p,
+                            enum conflate_mgmt_cb_result rv)
+    __libconflate_gcc_attribute__ ((nonnull (1)));
+
+/**
+ * Run a registered management command.
+ *
+ * The command is found with a single hash lookup, and its calls,
+ * failures and latency are counted (see ::conflate_get_stats).
+ *
+ * @param handle the conflate handle, whose userdata is passed to the
+ *        callback as its opaque value (may be NULL)
+ * @param cmd the name of the command
+ * @param direct if true, this is a directed command (else issued via pubsub)
+ * @param form the form sent with this command (may be NULL)
+ * @param r the result form being built, or NULL to throw away
+ *        whatever the command replies with
+ *
+ * @return what the callback returned, or RV_UNKNOWN if there's no
+ *         such command
+ */
+LIBCONFLATE_PUBLIC_API
+enum conflate_mgmt_cb_result conflate_dispatch_mgmt_cb(conflate_handle_t *handle,
+                                                       const char *cmd,
+                                                       bool direct,
+                                                       kvpair_t *form,
+                                                       conflate_form_result *r)
+    __libconflate_gcc_attribute__ ((nonnull (2)));
+
+/**
+ * A connection to the management socket of a conflate agent.
+ */
+typedef struct conflate_mgmt_client conflate_mgmt_client_t;
+
+/**
+ * Connect to an agent's management socket.
+ *
+ * @param path the agent's \c mgmt_socket_path
+ *
+ * @return the connection, or NULL if it couldn't be made
+ */
+LIBCONFLATE_PUBLIC_API
+conflate_mgmt_client_t *conflate_mgmt_connect(const char *path)
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull (1)));
+
+/**
+ * Run a management command on the agent at the other end.
+ *
+ * @param client the connection
+ * @param cmd the name of the command
+ * @param form the form to send with it (may be NULL)
+ * @param reply if not NULL, set to the list of forms in the reply,
+ *        to be freed with ::conflate_mgmt_free_reply.  An empty
+ *        form is a NULL chain.
+ * @param num_reply set to the number of forms in the reply, if reply
+ *        isn't NULL
+ *
+ * @return the command's result, or RV_ERROR if the connection failed
+ */
+LIBCONFLATE_PUBLIC_API
+enum conflate_mgmt_cb_result conflate_mgmt_call(conflate_mgmt_client_t *client,
+                                                const char *cmd,
+                                                kvpair_t *form,
+                                                kvpair_t ***reply,
+                                                int *num_reply)
+    __libconflate_gcc_attribute__ ((nonnull (1, 2)));
+
+/**
+ * Run a management command, and get the reply as JSON.
+ *
+ * The reply is an array with an object for each form, in which every
+ * key maps to an array of its values:
+ * [{"key":["value",...],...},...]
+ *
+ * @param client the connection
+ * @param cmd the name of the command
+ * @param form the form to send with it (may be NULL)
+ * @param json set to the reply, which the caller frees, or NULL if
+ *        the connection failed
+ *
+ * @return the command's result, or RV_ERROR if the connection failed
+ */
+LIBCONFLATE_PUBLIC_API
+enum conflate_mgmt_cb_result conflate_mgmt_call_json(conflate_mgmt_client_t *client,
+                                                     const char *cmd,
+                                                     kvpair_t *form,
+                                                     char **json)
+    __libconflate_gcc_attribute__ ((nonnull (1, 2, 4)));
+
+/**
+ * Free the reply from ::conflate_mgmt_call.
+ */
+LIBCONFLATE_PUBLIC_API
+void conflate_mgmt_free_reply(kvpair_t **reply, int num_reply);
+
+/**
+ * Close a management connection.
+ */
+LIBCONFLATE_PUBLIC_API
+void conflate_mgmt_close(conflate_mgmt_client_t *client);
+
 /**
  * @}
  */
@@ -366,6 +763,30 @@ LIBCONFLATE_PUBLIC_API
 void conflate_stderr_logger(void *, enum conflate_log_level,
                             const char *, ...);
 
+/**
+ * Logging implementation that logs to stderr from a thread of its own.
+ *
+ * Logging never waits on stderr or on other threads.  Each thread
+ * copies its messages, unformatted, into a buffer of its own, and a
+ * background thread formats them and writes them out with the time
+ * they were logged.  A thread that logs faster than that fills its
+ * buffer, and the messages that don't fit are dropped; the background
+ * thread says how many, and ::conflate_get_stats counts them.
+ *
+ * The format string is kept rather than copied, so it has to last
+ * (as string literals do), and %n isn't supported.
+ */
+LIBCONFLATE_PUBLIC_API
+void conflate_async_logger(void *, enum conflate_log_level,
+                           const char *, ...);
+
+/**
+ * Wait until everything given to ::conflate_async_logger so far has
+ * been written out.
+ */
+LIBCONFLATE_PUBLIC_API
+void conflate_async_logger_flush(void);
+
 /**
  * @}
  */
@@ -424,6 +845,10 @@ typedef struct {
 
     /**
      * Path to persist configuration for faster/more reliable restarts.
+     *
+     * REST configs are saved here as they're accepted, and the saved
+     * config is delivered at startup before the server is contacted.
+     * NULL keeps nothing, private data included.
      */
     char *save_path;
 
@@ -451,13 +876,154 @@ typedef struct {
      * This callback will receive the caller's userdata and a kvpair_t
      * of all of the keys and values received when things changed.
      *
-     * The new config *may* be the same as the previous config.  It's
-     * up to the client to detect and decide what to do in this case.
+     * A REST config that's identical to the last one this callback
+     * accepted is not delivered again.  Configs from other sources
+     * *may* be the same as the previous config.  It's up to the
+     * client to detect and decide what to do in that case.
+     *
+     * The config belongs to libconflate once the callback returns.
+     * Use ::conflate_snapshot_retain to keep it, which is cheap for
+     * REST configs, or ::conflate_snapshot_publish to share it.
      *
      * The callback should return CONFLATE_SUCCESS on success.
      */
     conflate_result (*new_config)(void*, kvpair_t*);
 
+    /**
+     * Callback issued with only what changed in a REST config (optional).
+     *
+     * When this is set, new_config still receives the first config.
+     * After that, each config that differs from the last accepted one
+     * is delivered here as three chains (see ::diff_kvpair): pairs
+     * that were added, pairs that were removed, and the new version
+     * of pairs whose values changed.  Any of them may be NULL.  They
+     * are freed when the callback returns.
+     *
+     * The callback should return CONFLATE_SUCCESS if it applied the
+     * changes.  Otherwise the next config is compared against the
+     * last one that was accepted.
+     */
+    conflate_result (*config_diff)(void *userdata, kvpair_t *added,
+                                   kvpair_t *removed, kvpair_t *changed);
+
+    /**
+     * Drive this handle's REST connection from the shared engine.
+     *
+     * By default each handle gets a thread of its own.  When this is
+     * true, the handle is instead multiplexed with every other such
+     * handle onto the single event loop thread started by
+     * ::start_conflate_engine.
+     */
+    bool shared_rest_engine;
+
+    /**
+     * Deliver REST configs parsed rather than as one JSON string.
+     *
+     * By default a REST config arrives as the whole JSON document in
+     * a "contents" pair (plus the source "url").  When this is true,
+     * libconflate parses the JSON as it streams in and delivers one
+     * pair per scalar instead, keyed by its dotted path.  For example
+     * the hostname of the fourth node in the "nodes" array is under
+     * "nodes.3.hostname".  A config that isn't valid JSON is still
+     * delivered in the "contents" form.
+     */
+    bool parse_configs;
+
+    /**
+     * How many urls from a '|' delimited REST host list to try at once.
+     *
+     * By default the urls are tried one after another, so a server
+     * that accepts connections but never answers holds everything up.
+     * With a value greater than one, that many connections are opened
+     * together and the first one to stream a complete, valid config is
+     * kept.  The others are closed, and as attempts fail, the next
+     * urls in the list take their places.
+     */
+    int race_urls;
+
+    /**
+     * Flush saved configs to disk before replacing the old file.
+     *
+     * On by default (see ::init_conflate), so a crash can never leave
+     * the file at save_path empty or half written.  Turning it off
+     * makes saves much cheaper, at the risk of losing the most recent
+     * config to a power failure.
+     */
+    bool save_fsync;
+
+    /**
+     * Milliseconds to wait before reconnecting to the REST server(s).
+     *
+     * After a config stream ends, or the first time every url in the
+     * list fails, the next attempt waits retry_min_ms.  Each pass over
+     * the list that fails again doubles the wait, up to retry_max_ms.
+     * The defaults (see ::init_conflate) are one and thirty seconds.
+     */
+    int retry_min_ms;
+
+    /** The longest wait between reconnects, see \c retry_min_ms. */
+    int retry_max_ms;
+
+    /**
+     * Percentage of each wait to take off at random (0 to 100).
+     *
+     * Without it, every client of a cluster that went away retries in
+     * lockstep when it comes back.  The default is 50, so each wait is
+     * somewhere between half and all of the backoff.
+     */
+    int retry_jitter;
+
+    /**
+     * Milliseconds to wait for a REST connection to be made before
+     * trying the next url.  Ten seconds by default, 0 for curl's own.
+     */
+    int connect_timeout_ms;
+
+    /**
+     * Give up on a REST transfer that averages less than
+     * low_speed_limit bytes a second for low_speed_time seconds.  Off
+     * unless both are set.
+     */
+    int low_speed_limit;
+
+    /** See \c low_speed_limit. */
+    int low_speed_time;
+
+    /**
+     * Milliseconds a REST connection may go without sending anything,
+     * not even a heartbeat, before we fail over to the next url.
+     *
+     * A half-open streaming connection otherwise leaves the
+     * application on a stale config until TCP notices, which can take
+     * hours.  30 seconds by default.  A quiet server that doesn't send
+     * heartbeats just gets reconnected to that often, and sends the
+     * same config again, which isn't delivered.  Set it to a few
+     * heartbeat intervals for a server that sends them, or 0 to wait
+     * for TCP.
+     */
+    int idle_timeout_ms;
+
+    /**
+     * Seconds a REST connection sits idle before TCP starts probing
+     * it, and between probes, where the platform lets us set them.
+     * The defaults are 30 and 10; 0 leaves the system's own (usually
+     * two hours and 75 seconds).
+     */
+    int keepalive_idle;
+
+    /** See \c keepalive_idle. */
+    int keepalive_interval;
+
+    /**
+     * Serve management commands on a Unix domain socket at this path.
+     *
+     * Local tools such as the conflate_mgmt CLI connect to it to run
+     * any registered command (see ::conflate_mgmt_call).  Only the
+     * owner may connect.  NULL, the default, serves nothing.  Not
+     * available on Windows.
+     */
+    char *mgmt_socket_path;
+
     /** \private */
     void *initialization_marker;
 
@@ -492,6 +1058,77 @@ void init_conflate(conflate_config_t *conf) __libconflate_gcc_attribute__ ((nonn
 LIBCONFLATE_PUBLIC_API
 bool start_conflate(conflate_config_t conf) __libconflate_gcc_attribute__ ((warn_unused_result));
 
+/**
+ * Start a conflate agent, keeping hold of its handle.
+ *
+ * Just like ::start_conflate, but the handle can be used to look at
+ * the agent afterwards, for example with ::conflate_get_stats.
+ *
+ * @param conf configuration for libconflate
+ *
+ * @return the running agent's handle, or NULL if it couldn't start
+ */
+LIBCONFLATE_PUBLIC_API
+conflate_handle_t *start_conflate_handle(conflate_config_t conf)
+    __libconflate_gcc_attribute__ ((warn_unused_result));
+
+/**
+ * Start the shared REST engine.
+ *
+ * The engine is one thread that streams configs for every handle
+ * started with \c shared_rest_engine set, so the number of threads
+ * stays flat no matter how many configs are being watched.
+ *
+ * Calling this is optional.  The first such handle starts the engine
+ * with no callback threads if it isn't running yet.  Calls after the
+ * engine has started have no effect.
+ *
+ * @param callback_threads number of threads delivering new_config
+ *        callbacks.  With 0 they're delivered on the engine thread,
+ *        so a slow callback holds up every other handle.
+ *
+ * @return true if the engine is running
+ */
+LIBCONFLATE_PUBLIC_API
+bool start_conflate_engine(int callback_threads);
+
+/**
+ * Take a snapshot of what a handle has been up to.
+ *
+ * The counters are kept with atomic operations as the work happens,
+ * so this can be called from any thread at any time.  The snapshot
+ * has these keys:
+ *
+ * - \c bytes_received, \c connections: across all urls
+ * - \c configs_received, \c configs_delivered, \c configs_unchanged
+ *   (identical to the last one and so never delivered),
+ *   \c not_modified (304 answers to conditional fetches)
+ * - \c last_config_age_ms: since the last config arrived, if one has
+ * - \c curl_errors.N: transfers that failed with curl error N
+ * - \c url.N, with \c url.N.connections, \c url.N.failures (in a row)
+ *   and \c url.N.latency_us (average time to a first config)
+ * - \c parse_us, \c callback_us, \c first_config_us: histograms of
+ *   how long configs took to parse, how long the application took
+ *   with them, and how long a connection took to produce its first
+ *   one.  Each has \c .count, \c .mean, \c .p50, \c .p90,
+ *   \c .p99 and \c .max.
+ * - \c log_messages and \c log_dropped, the messages
+ *   ::conflate_async_logger has written and dropped, once it has been
+ *   used.  These are shared by every handle.
+ * - \c commands.NAME.calls, \c commands.NAME.failures and the
+ *   \c commands.NAME.latency_us histogram for each management command
+ *   that has been dispatched, and \c commands.NAME.timeouts once a
+ *   deferred reply has run out of time.  These are shared by every
+ *   handle.
+ *
+ * @param handle the handle to look at
+ *
+ * @return a new chain of kvpairs the caller frees with ::free_kvpair
+ */
+LIBCONFLATE_PUBLIC_API
+kvpair_t *conflate_get_stats(conflate_handle_t *handle)
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull(1)));
+
 /**
  * @}
  */
@@ -520,6 +1157,10 @@ conflate_config_t* dup_conf(conflate_config_t c);
 /**
  * Load the key/value pairs from the file at the given path.
  *
+ * The file is mapped into memory and the pairs point straight into
+ * it, so loading is about as fast as mapping the file.  The config
+ * lives in an arena; ::free_kvpair releases it and unmaps the file.
+ *
  * @param handle the conflate handle (for logging contexts and stuff)
  * @param filename the path from which the config should be read
  *
@@ -532,6 +1173,10 @@ kvpair_t* load_kvpairs(conflate_handle_t *handle, const char *filename)
 /**
  * Save a config at the given path.
  *
+ * The config is written to a temporary file that then replaces the
+ * old one, so readers only ever see a complete config.  The file is
+ * checksummed, and flushed first unless \c save_fsync is off.
+ *
  * @param handle the conflate handle (for logging contexts and stuff)
  * @param pairs the kvpairs to store
  * @param filename the path to which the config should be written
@@ -548,28 +1193,50 @@ bool save_kvpairs(conflate_handle_t *handle, kvpair_t* pairs, const char *filena
  * @param handle the conflate handle (for logging contexts and stuff)
  * @param k the key to store
  * @param v the value to store
- * @param filename the path to which the data should be written
+ * @param filename the path to which the data should be written (NULL
+ *        when there is no save_path, which always fails)
  *
  * @return false if the data could not be saved for any reason
  */
 LIBCONFLATE_PUBLIC_API
 bool conflate_save_private(conflate_handle_t *handle,
                            const char *k, const char *v, const char *filename)
-    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull(1, 2, 3, 4)));
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull(1, 2, 3)));
 
 /**
  * Delete some saved instance-private data.
  *
  * @param handle the conflate handle (for logging contexts and stuff)
  * @param k the key to delete
- * @param filename the path from which the data should be removed
+ * @param filename the path from which the data should be removed (NULL
+ *        when there is no save_path, which always fails)
  *
  * @return false if the data could not be deleted for any reason
  */
 LIBCONFLATE_PUBLIC_API
 bool conflate_delete_private(conflate_handle_t *handle,
                              const char *k, const char *filename)
-    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull(1, 2, 3)));
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull(1, 2)));
+
+/**
+ * Save and delete several pieces of instance-private data at once.
+ *
+ * Each pair with a value sets its key to the first value, and each
+ * pair with no values deletes its key.  The changes are written (and
+ * flushed) together, and either all of them survive a crash or none
+ * do.
+ *
+ * @param handle the conflate handle (for logging contexts and stuff)
+ * @param changes the keys to set and delete
+ * @param filename the path to which the data should be written (NULL
+ *        when there is no save_path, which always fails)
+ *
+ * @return false if the changes could not be saved for any reason
+ */
+LIBCONFLATE_PUBLIC_API
+bool conflate_update_private(conflate_handle_t *handle,
+                             kvpair_t *changes, const char *filename)
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull(1, 2)));
 
 /**
  * Get some saved instance-private data.
@@ -577,13 +1244,14 @@ bool conflate_delete_private(conflate_handle_t *handle,
  * @param handle the conflate handle (for logging contexts and stuff)
  * @param k the key to look up
  * @param filename the path from which the data should be retrieved
+ *        (NULL when there is no save_path, which finds nothing)
  *
  * @return an allocated value or NULL if one could not be retrieved
  */
 LIBCONFLATE_PUBLIC_API
 char *conflate_get_private(conflate_handle_t *handle,
                            const char *k, const char *filename)
-    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull(1, 2, 3)));
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull(1, 2)));
 
 /**
  * @}
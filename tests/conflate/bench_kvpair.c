@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libconflate/conflate.h>
+
+#define DEFAULT_ENTRIES 1000000
+
+static void report(const char *what, hrtime_t start, int entries)
+{
+    hrtime_t elapsed = gethrtime() - start;
+    printf("%-12s %8.1f ns/entry\n", what, (double)elapsed / entries);
+}
+
+/*
+ * Time copying and freeing a long chain of kvpairs.
+ *
+ * usage: bench_kvpair [entries]
+ */
+int main(int argc, char **argv)
+{
+    int entries = argc > 1 ? atoi(argv[1]) : DEFAULT_ENTRIES;
+    kvpair_t *head = NULL;
+    kvpair_t **tail = &head;
+    kvpair_t *copy;
+    hrtime_t start;
+    int i;
+
+    if (entries <= 0) {
+        fprintf(stderr, "usage: %s [entries]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    start = gethrtime();
+    for (i = 0; i < entries; i++) {
+        char key[32];
+        char val[32];
+        char *values[2];
+        snprintf(key, sizeof(key), "nodes.%d.hostname", i);
+        snprintf(val, sizeof(val), "host%d.example.com", i);
+        values[0] = val;
+        values[1] = NULL;
+        *tail = mk_kvpair(key, values);
+        tail = &(*tail)->next;
+    }
+    report("build", start, entries);
+
+    start = gethrtime();
+    copy = dup_kvpair(head);
+    report("dup", start, entries);
+
+    start = gethrtime();
+    free_kvpair(copy);
+    report("free copy", start, entries);
+
+    start = gethrtime();
+    copy = dup_kvpair_packed(head);
+    report("dup packed", start, entries);
+
+    start = gethrtime();
+    free_kvpair(copy);
+    report("free packed", start, entries);
+
+    start = gethrtime();
+    free_kvpair(head);
+    report("free", start, entries);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libconflate/conflate.h>
+
+#define DEFAULT_MESSAGES 200000
+#define MAX_THREADS 64
+
+typedef void (*log_proc)(void *udata, enum conflate_log_level level,
+                         const char *msg, ...);
+
+struct producer {
+    cb_thread_t thread;
+    log_proc log;
+    int messages;
+};
+
+static void produce(void *arg)
+{
+    struct producer *p = arg;
+    int i;
+
+    for (i = 0; i < p->messages; i++) {
+        p->log(NULL, LOG_LVL_WARN, "curl error: %s from: %s (attempt %d)",
+               "Connection refused", "http://127.0.0.1:8091/pools", i);
+    }
+}
+
+static void run(const char *name, log_proc log, int num_threads,
+                int messages)
+{
+    struct producer producers[MAX_THREADS];
+    hrtime_t start = gethrtime();
+    hrtime_t elapsed;
+    int i;
+
+    for (i = 0; i < num_threads; i++) {
+        producers[i].log = log;
+        producers[i].messages = messages / num_threads;
+        if (cb_create_thread(&producers[i].thread, produce,
+                             &producers[i], 0) != 0) {
+            perror("Failed to create thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < num_threads; i++) {
+        cb_join_thread(producers[i].thread);
+    }
+    elapsed = gethrtime() - start;
+
+    printf("%-6s %2d threads %8.1f ns/message\n", name, num_threads,
+           (double)elapsed / messages);
+}
+
+/*
+ * Time how long logging holds up the threads doing it, with stderr
+ * sent wherever the command line sends it (/dev/null, say).
+ *
+ * usage: bench_logging [messages] [max threads] 2>/dev/null
+ */
+int main(int argc, char **argv)
+{
+    int messages = argc > 1 ? atoi(argv[1]) : DEFAULT_MESSAGES;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 8;
+    int i;
+
+    if (messages <= 0 || max_threads <= 0 || max_threads > MAX_THREADS) {
+        fprintf(stderr, "usage: %s [messages] [max threads]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 1; i <= max_threads; i *= 2) {
+        run("stderr", conflate_stderr_logger, i, messages);
+        run("async", conflate_async_logger, i, messages);
+    }
+    conflate_async_logger_flush();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libconflate/conflate.h>
+
+#define DEFAULT_CALLS 4000000
+#define NUM_COMMANDS 64
+#define MAX_THREADS 64
+
+static char names[NUM_COMMANDS][32];
+
+struct dispatcher {
+    cb_thread_t thread;
+    int calls;
+};
+
+static volatile bool registering;
+
+static enum conflate_mgmt_cb_result noop(void *opaque,
+                                         conflate_handle_t *handle,
+                                         const char *cmd,
+                                         bool direct,
+                                         kvpair_t *form,
+                                         conflate_form_result *r)
+{
+    (void)opaque;
+    (void)handle;
+    (void)cmd;
+    (void)direct;
+    (void)form;
+    (void)r;
+    return RV_OK;
+}
+
+static void dispatch(void *arg)
+{
+    struct dispatcher *d = arg;
+    int i;
+
+    for (i = 0; i < d->calls; i++) {
+        if (conflate_dispatch_mgmt_cb(NULL, names[i % NUM_COMMANDS], true,
+                                      NULL, NULL) != RV_OK) {
+            fprintf(stderr, "Dispatch failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* Keep replacing commands while the dispatchers run. */
+static void reregister(void *arg)
+{
+    int i = 0;
+    (void)arg;
+
+    while (registering) {
+        conflate_register_mgmt_cb(names[i++ % NUM_COMMANDS], "Again.", noop);
+    }
+}
+
+static void run(int num_threads, int calls, bool with_writer)
+{
+    struct dispatcher dispatchers[MAX_THREADS];
+    cb_thread_t writer;
+    hrtime_t start = gethrtime();
+    hrtime_t elapsed;
+    int i;
+
+    registering = with_writer;
+    if (with_writer && cb_create_thread(&writer, reregister, NULL, 0) != 0) {
+        perror("Failed to create thread");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_threads; i++) {
+        dispatchers[i].calls = calls / num_threads;
+        if (cb_create_thread(&dispatchers[i].thread, dispatch,
+                             &dispatchers[i], 0) != 0) {
+            perror("Failed to create thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < num_threads; i++) {
+        cb_join_thread(dispatchers[i].thread);
+    }
+    elapsed = gethrtime() - start;
+
+    registering = false;
+    if (with_writer) {
+        cb_join_thread(writer);
+    }
+
+    printf("%2d threads%s %8.1f ns/call %10.0f calls/s\n",
+           num_threads, with_writer ? " + writer" : "         ",
+           (double)elapsed / calls, calls / ((double)elapsed / 1e9));
+}
+
+/*
+ * Time dispatching management commands from several threads at once,
+ * with and without commands being registered at the same time.
+ *
+ * usage: bench_mgmt [calls] [max threads]
+ */
+int main(int argc, char **argv)
+{
+    int calls = argc > 1 ? atoi(argv[1]) : DEFAULT_CALLS;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 8;
+    int i;
+
+    if (calls <= 0 || max_threads <= 0 || max_threads > MAX_THREADS) {
+        fprintf(stderr, "usage: %s [calls] [max threads]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < NUM_COMMANDS; i++) {
+        snprintf(names[i], sizeof(names[i]), "command_%d", i);
+        conflate_register_mgmt_cb(names[i], "Does nothing.", noop);
+    }
+
+    for (i = 1; i <= max_threads; i *= 2) {
+        run(i, calls, false);
+        run(i, calls, true);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include <libconflate/conflate.h>
+#include "conflate/conflate_internal.h"
 
 #include "test_common.h"
 
@@ -88,6 +89,22 @@ static void test_add_value_to_existing_values(void)
     fail_unless(strcmp(pair->values[3], "newvalue2") == 0, "Unexpected value at 3");
 }
 
+static void test_add_value_nocopy(void)
+{
+    char *value = safe_strdup("owned value");
+    pair = mk_kvpair("some_key", NULL);
+
+    add_kvpair_value_nocopy(pair, value);
+    fail_unless(pair->used_values == 1, "Value at 1");
+    fail_unless(pair->values[0] == value, "Value was copied.");
+    fail_unless(pair->values[1] == NULL, "Values aren't terminated.");
+
+    add_kvpair_value(pair, "copied value");
+    fail_unless(pair->used_values == 2, "Value at 2");
+    fail_unless(strcmp(pair->values[1], "copied value") == 0,
+                "Unexpected value at 1");
+}
+
 static void test_find_from_null(void)
 {
     fail_unless(find_kvpair(NULL, "some_key") == NULL, "Couldn't find from NULL.");
@@ -117,6 +134,51 @@ static void test_find_missing_item(void)
     fail_unless(find_kvpair(pair, "missing_key") == NULL, "Negative search failed.");
 }
 
+static void test_find_in_long_list(void)
+{
+    char key[32];
+    char val[32];
+    char *v[2] = { val, NULL };
+    kvpair_t *last = NULL;
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        snprintf(val, sizeof(val), "val%d", i);
+        last = mk_kvpair(key, v);
+        last->next = pair;
+        pair = last;
+    }
+
+    index_kvpair(pair);
+    fail_if(pair->index == NULL, "Chain wasn't indexed.");
+    for (i = 0; i < 1000; i += 7) {
+        snprintf(key, sizeof(key), "key%d", i);
+        snprintf(val, sizeof(val), "val%d", i);
+        fail_unless(strcmp(get_simple_kvpair_val(pair, key), val) == 0,
+                    "Failed to find a key.");
+    }
+    fail_unless(find_kvpair(pair, "missing") == NULL,
+                "Negative search failed.");
+
+    /* Once it's dropped the chain can change again */
+    drop_kvpair_index(pair);
+    free_kvpair(pair->next->next);
+    pair->next->next = NULL;
+    fail_unless(find_kvpair(pair, "key500") == NULL,
+                "Found a removed pair.");
+    fail_unless(find_kvpair(pair, "key998") == pair->next,
+                "Failed to find a remaining pair.");
+
+    /* Searching doesn't index anything by itself */
+    for (last = pair; last->next; last = last->next) {
+    }
+    last->next = mk_kvpair("appended", v);
+    fail_unless(find_kvpair(pair, "appended") == last->next,
+                "Didn't find an appended pair.");
+    fail_unless(pair->index == NULL, "Searching built an index.");
+}
+
 static void test_simple_find_from_null(void)
 {
     fail_unless(get_simple_kvpair_val(NULL, "some_key") == NULL,
@@ -157,7 +219,7 @@ static void test_copy_pair(void)
     char *args1[] = {"arg1", "arg2", NULL};
     char *args2[] = {"other", NULL};
     kvpair_t *pair1 = mk_kvpair("some_key", args1);
-    kvpair_t *copy;
+    kvpair_t *copy, *rest;
     pair = mk_kvpair("some_other_key", args2);
     pair->next = pair1;
 
@@ -169,7 +231,256 @@ static void test_copy_pair(void)
     fail_if(copy->key == pair->key, "Keys were identical.");
     check_pair_equality(pair, copy);
 
+    /* Each pair of the copy is its own, to unlink and free */
+    rest = copy->next;
+    copy->next = NULL;
     free_kvpair(copy);
+    check_pair_equality(pair1, rest);
+    free_kvpair(rest);
+}
+
+static void test_arena_pairs(void)
+{
+    char *args[] = {"arg1", "arg2", NULL};
+    kvpair_arena_t *arena = mk_kvpair_arena(0);
+    kvpair_t *tail;
+    char key[32];
+    int i;
+
+    pair = mk_kvpair_in(arena, "some_key", args);
+    fail_unless(pair->used_values == 2, "Wrong number of used values.");
+    fail_unless(strcmp(pair->values[1], "arg2") == 0, "Second value is broken.");
+    fail_unless(pair->values[2] == NULL, "Values aren't terminated.");
+
+    /* Grow the values and the chain well past the first block */
+    for (i = 0; i < 100; i++) {
+        add_kvpair_value(pair, "more");
+    }
+    add_kvpair_value_nocopy(pair, safe_strdup("owned"));
+    fail_unless(pair->used_values == 103, "Lost values while growing.");
+    fail_unless(strcmp(pair->values[1], "arg2") == 0, "Values moved badly.");
+    fail_unless(strcmp(pair->values[102], "owned") == 0, "Lost owned value.");
+
+    tail = pair;
+    for (i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        tail->next = mk_kvpair_in(arena, key, args);
+        tail = tail->next;
+    }
+    fail_unless(find_kvpair(pair, "key999") == tail, "Couldn't find the end.");
+    /* teardown frees the whole arena through the head */
+}
+
+static void test_arena_copy(void)
+{
+    char *args1[] = {"arg1", "arg2", NULL};
+    char *args2[] = {"other", NULL};
+    kvpair_t *pair1 = mk_kvpair("some_key", args1);
+    kvpair_arena_t *arena = mk_kvpair_arena(256);
+    kvpair_t *copy;
+    pair = mk_kvpair("some_other_key", args2);
+    pair->next = pair1;
+
+    copy = dup_kvpair_in(arena, pair);
+    fail_if(copy == NULL, "Copy failed.");
+    fail_unless(copy->arena == arena && copy->next->arena == arena,
+                "Copy isn't in the arena.");
+    check_pair_equality(pair, copy);
+
+    free_kvpair(copy);
+}
+
+static void test_long_chain(void)
+{
+    char *args[] = {"val", NULL};
+    kvpair_t *copy;
+    int i;
+
+    /* Deep enough that recursing per pair would overflow the stack */
+    for (i = 0; i < 200000; i++) {
+        kvpair_t *p = mk_kvpair("key", args);
+        p->next = pair;
+        pair = p;
+    }
+
+    copy = dup_kvpair(pair);
+    fail_unless(copy->arena == NULL, "Copy was made in an arena.");
+    free_kvpair(copy);
+
+    copy = dup_kvpair_packed(pair);
+    fail_unless(copy->arena != NULL, "Copy wasn't made in an arena.");
+    free_kvpair(copy);
+}
+
+static void test_snapshot_retain(void)
+{
+    char *args[] = {"val", NULL};
+    kvpair_t *heap = mk_kvpair("heap_key", args);
+    kvpair_t *snapshot, *copy;
+
+    pair = dup_kvpair_packed(heap);
+    snapshot = conflate_snapshot_retain(pair);
+    fail_unless(snapshot == pair, "Arena config was copied.");
+
+    copy = conflate_snapshot_retain(heap);
+    fail_if(copy == heap, "Heap config wasn't copied.");
+    free_kvpair(heap);
+
+    /* The original reference goes, and the snapshot is still good */
+    free_kvpair(pair);
+    pair = NULL;
+    fail_unless(strcmp(get_simple_kvpair_val(snapshot, "heap_key"), "val") == 0,
+                "Snapshot didn't survive.");
+
+    conflate_snapshot_release(snapshot);
+    conflate_snapshot_release(copy);
+}
+
+#define SNAPSHOT_READERS 4
+#define SNAPSHOT_VERSIONS 2000
+
+static volatile bool snapshot_readers_done;
+
+static void snapshot_reader(void *arg)
+{
+    conflate_snapshot_slot_t *slot = arg;
+    int last = 0;
+
+    while (!snapshot_readers_done) {
+        kvpair_t *snapshot = conflate_snapshot_acquire(slot);
+        if (snapshot) {
+            int version = atoi(get_simple_kvpair_val(snapshot, "version"));
+            fail_if(version < last, "Snapshot went back in time.");
+            last = version;
+            conflate_snapshot_release(snapshot);
+        }
+    }
+}
+
+static void test_snapshot_slot(void)
+{
+    conflate_snapshot_slot_t *slot = mk_conflate_snapshot_slot();
+    cb_thread_t readers[SNAPSHOT_READERS];
+    kvpair_t *snapshot;
+    char version[16];
+    char *args[2] = {version, NULL};
+    int i;
+
+    fail_unless(conflate_snapshot_acquire(slot) == NULL, "Empty slot had a snapshot.");
+
+    snapshot_readers_done = false;
+    for (i = 0; i < SNAPSHOT_READERS; i++) {
+        fail_if(cb_create_thread(&readers[i], snapshot_reader, slot, 0) != 0,
+                "Failed to start a reader.");
+    }
+
+    for (i = 1; i <= SNAPSHOT_VERSIONS; i++) {
+        kvpair_t *config;
+        snprintf(version, sizeof(version), "%d", i);
+        config = mk_kvpair_in(mk_kvpair_arena(0), "version", args);
+        conflate_snapshot_publish(slot, config);
+        free_kvpair(config);
+    }
+
+    snapshot_readers_done = true;
+    for (i = 0; i < SNAPSHOT_READERS; i++) {
+        cb_join_thread(readers[i]);
+    }
+
+    snapshot = conflate_snapshot_acquire(slot);
+    fail_unless(strcmp(get_simple_kvpair_val(snapshot, "version"), version) == 0,
+                "Slot lost the last snapshot.");
+    conflate_snapshot_release(snapshot);
+    free_conflate_snapshot_slot(slot);
+}
+
+static kvpair_t *mk_pair_list(char **keys, char **vals)
+{
+    kvpair_t *head = NULL;
+    kvpair_t **tail = &head;
+    int i;
+
+    for (i = 0; keys[i]; i++) {
+        char *v[2] = { vals[i], NULL };
+        *tail = mk_kvpair(keys[i], v);
+        tail = &(*tail)->next;
+    }
+    return head;
+}
+
+static void test_diff_identical(void)
+{
+    char *keys[] = { "a", "b", "c", NULL };
+    char *vals[] = { "1", "2", "3", NULL };
+    kvpair_t *other = mk_pair_list(keys, vals);
+    kvpair_t *added, *removed, *changed;
+    pair = mk_pair_list(keys, vals);
+
+    fail_if(diff_kvpair(pair, other, &added, &removed, &changed),
+            "Identical lists differ.");
+    fail_unless(added == NULL && removed == NULL && changed == NULL,
+                "Identical lists have changes.");
+
+    free_kvpair(other);
+}
+
+static void test_diff_changes(void)
+{
+    char *keys1[] = { "a", "b", "c", "d", NULL };
+    char *vals1[] = { "1", "2", "3", "4", NULL };
+    char *keys2[] = { "a", "d", "e", "b", NULL };
+    char *vals2[] = { "1", "4", "5", "two", NULL };
+    kvpair_t *other = mk_pair_list(keys2, vals2);
+    kvpair_t *added, *removed, *changed;
+    pair = mk_pair_list(keys1, vals1);
+
+    fail_unless(diff_kvpair(pair, other, &added, &removed, &changed),
+                "Different lists are the same.");
+
+    fail_unless(added && strcmp(added->key, "e") == 0 &&
+                strcmp(added->values[0], "5") == 0 && added->next == NULL,
+                "Wrong additions.");
+    fail_unless(removed && strcmp(removed->key, "c") == 0 &&
+                removed->next == NULL, "Wrong removals.");
+    fail_unless(changed && strcmp(changed->key, "b") == 0 &&
+                strcmp(changed->values[0], "two") == 0 &&
+                changed->next == NULL, "Wrong changes.");
+    fail_unless(pair->index == NULL && other->index == NULL,
+                "Comparing left an index behind.");
+
+    free_kvpair(added);
+    free_kvpair(removed);
+    free_kvpair(changed);
+    free_kvpair(other);
+}
+
+static void test_chains_equal(void)
+{
+    char *keys1[] = { "a", "b", "c", NULL };
+    char *vals1[] = { "1", "2", "3", NULL };
+    char *keys2[] = { "a", "c", "b", NULL };
+    char *vals2[] = { "1", "3", "2", NULL };
+    char *keys3[] = { "a", "c", "c", NULL };
+    char *vals3[] = { "1", "3", "3", NULL };
+    kvpair_t *reordered = mk_pair_list(keys2, vals2);
+    kvpair_t *repeated = mk_pair_list(keys3, vals3);
+    kvpair_t *same = mk_pair_list(keys1, vals1);
+    pair = mk_pair_list(keys1, vals1);
+
+    fail_unless(kvpair_chains_equal(pair, same), "Identical lists differ.");
+    fail_unless(kvpair_chains_equal(pair, reordered),
+                "Reordered lists differ.");
+    fail_if(kvpair_chains_equal(pair, repeated), "Lost a key.");
+    fail_if(kvpair_chains_equal(pair, same->next), "Lost the first key.");
+    fail_if(kvpair_chains_equal(pair->next, same), "Gained a key.");
+
+    free(same->next->values[0]);
+    same->next->values[0] = strdup("two");
+    fail_if(kvpair_chains_equal(pair, same), "Missed a changed value.");
+
+    free_kvpair(reordered);
+    free_kvpair(repeated);
+    free_kvpair(same);
 }
 
 static bool walk_incr_count_true(void *opaque,
@@ -230,15 +541,25 @@ int main(void)
         test_mk_pair_without_arg,
         test_add_value_to_existing_values,
         test_add_value_to_empty_values,
+        test_add_value_nocopy,
         test_find_from_null,
         test_find_first_item,
         test_find_second_item,
         test_find_missing_item,
+        test_find_in_long_list,
         test_simple_find_from_null,
         test_simple_find_first_item,
         test_simple_find_second_item,
         test_simple_find_missing_item,
         test_copy_pair,
+        test_arena_pairs,
+        test_arena_copy,
+        test_long_chain,
+        test_snapshot_retain,
+        test_snapshot_slot,
+        test_diff_identical,
+        test_diff_changes,
+        test_chains_equal,
         test_walk_true,
         test_walk_false,
         NULL
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libconflate/conflate.h>
+#include "conflate/conflate_internal.h"
+
+#include "test_common.h"
+
+#define LOG_PATH "check_logging.log"
+#define NUM_THREADS 4
+#define THREAD_MESSAGES 1000
+#define FLOOD_MESSAGES 100000
+
+static int saved_stderr;
+static char *logged = NULL;
+
+/* Send stderr to a file while the logger writes to it. */
+static void capture(void)
+{
+    fflush(stderr);
+    fail_if(freopen(LOG_PATH, "w", stderr) == NULL, "Failed to redirect stderr.");
+}
+
+/* Put stderr back, and read what was written. */
+static void release(void)
+{
+    FILE *f;
+    long size;
+
+    conflate_async_logger_flush();
+    fflush(stderr);
+    dup2(saved_stderr, fileno(stderr));
+
+    free(logged);
+    f = fopen(LOG_PATH, "r");
+    fail_if(f == NULL, "Failed to open the log.");
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    logged = calloc(1, (size_t)size + 1);
+    fail_unless(fread(logged, 1, (size_t)size, f) == (size_t)size,
+                "Failed to read the log.");
+    fclose(f);
+    remove(LOG_PATH);
+}
+
+/* The line after this one, or NULL. */
+static char *next_line(char *line)
+{
+    char *end = strchr(line, '\n');
+    return end && end[1] ? end + 1 : NULL;
+}
+
+/* Check a line is timestamped, and says what it should. */
+static void check_line(const char *line, const char *expected)
+{
+    size_t len = strlen(expected);
+    /* 2024-01-02 03:04:05.678 */
+    fail_unless(line[4] == '-' && line[10] == ' ' && line[19] == '.' &&
+                line[23] == ' ', "Expected a timestamp.");
+    fail_unless(strncmp(line + 24, expected, len) == 0 && line[24 + len] == '\n',
+                "Wrong message.");
+}
+
+static void test_formats(void)
+{
+    char long_string[8192];
+    char unterminated[4] = {'w', 'x', 'y', 'z'};
+    char *line;
+
+    memset(long_string, 'x', sizeof(long_string) - 1);
+    long_string[sizeof(long_string) - 1] = '\0';
+
+    capture();
+    conflate_async_logger(NULL, LOG_LVL_INFO, "Plain");
+    conflate_async_logger(NULL, LOG_LVL_WARN, "%d %u %x %c %ld %lld %zu %%",
+                          -1, 2u, 255, 'c', 3L, -4LL, (size_t)5);
+    conflate_async_logger(NULL, LOG_LVL_ERROR, "[%5s|%-5s|%.2s|%s]",
+                          "ab", "cd", "efgh", (char *)NULL);
+    conflate_async_logger(NULL, LOG_LVL_DEBUG, "[%.3f|%8.2e|%g|%Lf]",
+                          3.14159, 1234.5, 0.5, (long double)1.5);
+    conflate_async_logger(NULL, LOG_LVL_FATAL, "[%*d|%-*d|%.*f|%.*s]",
+                          4, 1, 3, 2, 1, 2.25, -1, "all");
+    conflate_async_logger(NULL, LOG_LVL_INFO, "[%.3s|%.*s|%-6.4s|%.0s]",
+                          unterminated, 2, unterminated, unterminated,
+                          unterminated);
+    conflate_async_logger(NULL, LOG_LVL_INFO, "Unknown %y then %d", 1);
+    conflate_async_logger(NULL, LOG_LVL_INFO, "%s", long_string);
+    release();
+
+    line = logged;
+    check_line(line, "INFO: Plain");
+    check_line(line = next_line(line), "WARN: -1 2 ff c 3 -4 5 %");
+    check_line(line = next_line(line), "ERROR: [   ab|cd   |ef|(null)]");
+    check_line(line = next_line(line), "DEBUG: [3.142|1.23e+03|0.5|1.500000]");
+    check_line(line = next_line(line), "FATAL: [   1|2  |2.2|all]");
+    check_line(line = next_line(line), "INFO: [wxy|wx|wxyz  |]");
+    check_line(line = next_line(line), "INFO: Unknown %y then %d");
+
+    /* Too long for a record, so it's cut short */
+    line = next_line(line);
+    fail_unless(strncmp(line + 24, "INFO: xxx", 9) == 0, "Lost a long string.");
+    fail_unless(strlen(line) < 4096 && strlen(line) > 3000,
+                "Long string wasn't cut short.");
+    fail_unless(next_line(line) == NULL, "Too many lines.");
+}
+
+static void log_from_thread(void *arg)
+{
+    int thread = (int)(intptr_t)arg;
+    int i;
+
+    for (i = 0; i < THREAD_MESSAGES; i++) {
+        conflate_async_logger(NULL, LOG_LVL_INFO, "thread %d message %d",
+                              thread, i);
+        if (i % 100 == 0) {
+            /* Let the logger keep up */
+            sleep_ms(1);
+        }
+    }
+}
+
+static void test_threads(void)
+{
+    cb_thread_t threads[NUM_THREADS];
+    int next[NUM_THREADS];
+    char *line;
+    int i;
+
+    capture();
+    for (i = 0; i < NUM_THREADS; i++) {
+        fail_unless(cb_create_thread(&threads[i], log_from_thread,
+                                     (void *)(intptr_t)i, 0) == 0,
+                    "Failed to start a thread.");
+    }
+    for (i = 0; i < NUM_THREADS; i++) {
+        cb_join_thread(threads[i]);
+        next[i] = 0;
+    }
+    release();
+
+    /* Each thread's messages are in order, and none went missing */
+    for (line = logged; line; line = next_line(line)) {
+        int thread, message;
+        fail_unless(sscanf(line + 24, "INFO: thread %d message %d",
+                           &thread, &message) == 2,
+                    "Unexpected message.");
+        fail_unless(thread >= 0 && thread < NUM_THREADS &&
+                    message == next[thread]++,
+                    "Messages out of order.");
+    }
+    for (i = 0; i < NUM_THREADS; i++) {
+        fail_unless(next[i] == THREAD_MESSAGES, "Lost messages.");
+    }
+}
+
+static void get_counts(int64_t *written, int64_t *dropped)
+{
+    conflate_handle_t *handle = calloc(1, sizeof(conflate_handle_t));
+    kvpair_t *stats = conflate_get_stats(handle);
+    char *val;
+
+    val = get_simple_kvpair_val(stats, "log_messages");
+    fail_if(val == NULL, "Written messages weren't counted.");
+    *written = atoll(val);
+    val = get_simple_kvpair_val(stats, "log_dropped");
+    fail_if(val == NULL, "Dropped messages weren't counted.");
+    *dropped = atoll(val);
+
+    free_kvpair(stats);
+    free(handle);
+}
+
+static void test_flood(void)
+{
+    int64_t written_before, dropped_before, written, dropped;
+    int64_t reported = 0;
+    char padding[1024];
+    char *line;
+    int i, lines = 0;
+
+    memset(padding, '.', sizeof(padding) - 1);
+    padding[sizeof(padding) - 1] = '\0';
+    get_counts(&written_before, &dropped_before);
+
+    /* Far more than fits, with nothing slowing us down */
+    capture();
+    for (i = 0; i < FLOOD_MESSAGES; i++) {
+        conflate_async_logger(NULL, LOG_LVL_INFO, "%d %s", i, padding);
+    }
+    release();
+
+    get_counts(&written, &dropped);
+    written -= written_before;
+    dropped -= dropped_before;
+    fail_unless(written + dropped == FLOOD_MESSAGES,
+                "Messages unaccounted for.");
+
+    for (line = logged; line; line = next_line(line)) {
+        long long n;
+        if (sscanf(line + 24, "WARN: Dropped %lld", &n) == 1) {
+            reported += n;
+        } else {
+            lines++;
+        }
+    }
+    fail_unless(lines == written, "Written messages went missing.");
+    fail_unless(reported == dropped, "Drops weren't reported.");
+}
+
+int main(void)
+{
+    typedef void (*testcase)(void);
+    testcase tc[] = {
+        test_formats,
+        test_threads,
+        test_flood,
+        NULL
+    };
+    int ii = 0;
+
+    saved_stderr = dup(fileno(stderr));
+    while (tc[ii] != 0) {
+        tc[ii++]();
+    }
+    free(logged);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,824 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <libconflate/conflate.h>
+#include "conflate/conflate_internal.h"
+
+#include "test_common.h"
+
+#define NUM_COMMANDS 100
+#define SOCKET_PATH "check_mgmt.sock"
+#define SAVE_PATH "check_mgmt.cfg"
+#define NUM_CLIENTS 8
+#define CLIENT_CALLS 200
+#define BIG_FIELDS 10000
+#define PIPELINED 50
+
+static int first_calls, second_calls;
+
+static enum conflate_mgmt_cb_result first(void *opaque,
+                                          conflate_handle_t *handle,
+                                          const char *cmd,
+                                          bool direct,
+                                          kvpair_t *form,
+                                          conflate_form_result *r)
+{
+    (void)opaque;
+    (void)handle;
+    (void)cmd;
+    (void)direct;
+    (void)form;
+    (void)r;
+    first_calls++;
+    return RV_OK;
+}
+
+static enum conflate_mgmt_cb_result second(void *opaque,
+                                           conflate_handle_t *handle,
+                                           const char *cmd,
+                                           bool direct,
+                                           kvpair_t *form,
+                                           conflate_form_result *r)
+{
+    (void)opaque;
+    (void)handle;
+    (void)direct;
+    (void)form;
+    (void)r;
+    second_calls++;
+    return strcmp(cmd, "fails") == 0 ? RV_ERROR : RV_OK;
+}
+
+static void test_dispatch(void)
+{
+    conflate_register_mgmt_cb("first", "The first command.", first);
+    conflate_register_mgmt_cb("second", "The second command.", second);
+
+    fail_unless(conflate_dispatch_mgmt_cb(NULL, "first", true, NULL, NULL) == RV_OK,
+                "Dispatch failed.");
+    fail_unless(first_calls == 1 && second_calls == 0,
+                "Wrong command was called.");
+    fail_unless(conflate_dispatch_mgmt_cb(NULL, "second", true, NULL, NULL) == RV_OK,
+                "Dispatch failed.");
+    fail_unless(second_calls == 1, "Second command wasn't called.");
+    fail_unless(conflate_dispatch_mgmt_cb(NULL, "third", true, NULL, NULL) == RV_UNKNOWN,
+                "Unknown command was dispatched.");
+}
+
+static void test_replace(void)
+{
+    int calls = second_calls;
+
+    conflate_register_mgmt_cb("replaced", "Will be replaced.", first);
+    conflate_register_mgmt_cb("replaced", "Replaced it.", second);
+
+    fail_unless(conflate_dispatch_mgmt_cb(NULL, "replaced", true, NULL, NULL) == RV_OK,
+                "Dispatch failed.");
+    fail_unless(second_calls == calls + 1, "Command wasn't replaced.");
+}
+
+static void test_many_commands(void)
+{
+    char name[32];
+    int i, calls = first_calls;
+
+    /* Enough to make the table grow a few times */
+    for (i = 0; i < NUM_COMMANDS; i++) {
+        snprintf(name, sizeof(name), "command_%d", i);
+        conflate_register_mgmt_cb(name, "One of many.", first);
+    }
+    for (i = 0; i < NUM_COMMANDS; i++) {
+        snprintf(name, sizeof(name), "command_%d", i);
+        fail_unless(conflate_dispatch_mgmt_cb(NULL, name, true, NULL, NULL) == RV_OK,
+                    "Lost a command.");
+    }
+    fail_unless(first_calls == calls + NUM_COMMANDS, "Wrong commands called.");
+}
+
+static volatile bool registering;
+
+static void reregister(void *arg)
+{
+    char name[32];
+    int i = 0;
+    (void)arg;
+
+    while (registering) {
+        snprintf(name, sizeof(name), "extra_%d", i++ % 1000);
+        conflate_register_mgmt_cb(name, "Another.", second);
+    }
+}
+
+static void test_register_while_dispatching(void)
+{
+    cb_thread_t writer;
+    int i;
+
+    /* Lookups always find the command, whatever table they land in */
+    conflate_register_mgmt_cb("steady", "Always there.", first);
+    registering = true;
+    fail_unless(cb_create_thread(&writer, reregister, NULL, 0) == 0,
+                "Failed to start a thread.");
+    for (i = 0; i < 100000; i++) {
+        fail_unless(conflate_dispatch_mgmt_cb(NULL, "steady", true,
+                                              NULL, NULL) == RV_OK,
+                    "Command went missing.");
+    }
+    registering = false;
+    cb_join_thread(writer);
+}
+
+static void test_failures_counted(void)
+{
+    conflate_handle_t *handle = calloc(1, sizeof(conflate_handle_t));
+    kvpair_t *stats;
+    char *val;
+
+    fail_unless(conflate_dispatch_mgmt_cb(NULL, "fails", true, NULL, NULL) == RV_UNKNOWN,
+                "Unregistered command ran.");
+    conflate_register_mgmt_cb("fails", "Always fails.", second);
+    fail_unless(conflate_dispatch_mgmt_cb(NULL, "fails", true, NULL, NULL) == RV_ERROR,
+                "Command didn't fail.");
+
+    /* Commands are counted whichever handle runs them */
+    stats = conflate_get_stats(handle);
+    val = get_simple_kvpair_val(stats, "commands.fails.calls");
+    fail_unless(val && strcmp(val, "1") == 0, "Call wasn't counted.");
+    val = get_simple_kvpair_val(stats, "commands.fails.failures");
+    fail_unless(val && strcmp(val, "1") == 0, "Failure wasn't counted.");
+    val = get_simple_kvpair_val(stats, "commands.fails.latency_us.count");
+    fail_unless(val && strcmp(val, "1") == 0, "Latency wasn't recorded.");
+    val = get_simple_kvpair_val(stats, "commands.steady.calls");
+    fail_unless(val && strcmp(val, "100000") == 0, "Calls weren't counted.");
+    free_kvpair(stats);
+
+    /* Registering it again keeps what it's done so far */
+    conflate_register_mgmt_cb("fails", "Fixed now.", first);
+    fail_unless(conflate_dispatch_mgmt_cb(NULL, "fails", true, NULL, NULL) == RV_OK,
+                "Command wasn't replaced.");
+    stats = conflate_get_stats(handle);
+    val = get_simple_kvpair_val(stats, "commands.fails.calls");
+    fail_unless(val && strcmp(val, "2") == 0, "Calls were forgotten.");
+    val = get_simple_kvpair_val(stats, "commands.fails.failures");
+    fail_unless(val && strcmp(val, "1") == 0, "Failures were forgotten.");
+    free_kvpair(stats);
+    free(handle);
+}
+
+static void test_long_name_stats(void)
+{
+    conflate_handle_t *handle = calloc(1, sizeof(conflate_handle_t));
+    char name[300], key[400];
+    kvpair_t *stats;
+    char *val;
+
+    /* Far longer than any fixed size key buffer would hold */
+    memset(name, 'n', sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    conflate_register_mgmt_cb(name, "Has a long name.", first);
+    fail_unless(conflate_dispatch_mgmt_cb(NULL, name, true, NULL, NULL) == RV_OK,
+                "Dispatch failed.");
+
+    stats = conflate_get_stats(handle);
+    snprintf(key, sizeof(key), "commands.%s.calls", name);
+    val = get_simple_kvpair_val(stats, key);
+    fail_unless(val && strcmp(val, "1") == 0, "Call wasn't counted.");
+    snprintf(key, sizeof(key), "commands.%s.latency_us.count", name);
+    val = get_simple_kvpair_val(stats, key);
+    fail_unless(val && strcmp(val, "1") == 0, "Latency wasn't recorded.");
+    free_kvpair(stats);
+    free(handle);
+}
+
+/* Hand the form back, then an empty fieldset and one naming the command. */
+static enum conflate_mgmt_cb_result echo(void *opaque,
+                                         conflate_handle_t *handle,
+                                         const char *cmd,
+                                         bool direct,
+                                         kvpair_t *form,
+                                         conflate_form_result *r)
+{
+    kvpair_t *pair;
+    (void)opaque;
+    (void)handle;
+    (void)direct;
+
+    conflate_init_form(r);
+    for (pair = form; pair; pair = pair->next) {
+        conflate_add_field_multi(r, pair->key, (const char **)pair->values);
+    }
+    conflate_next_fieldset(r);
+    conflate_next_fieldset(r);
+    conflate_add_field(r, "cmd", cmd);
+    return RV_OK;
+}
+
+/* A reply as big as a busy agent's stats. */
+static enum conflate_mgmt_cb_result big(void *opaque,
+                                        conflate_handle_t *handle,
+                                        const char *cmd,
+                                        bool direct,
+                                        kvpair_t *form,
+                                        conflate_form_result *r)
+{
+    char key[32], value[32];
+    int i;
+    (void)opaque;
+    (void)handle;
+    (void)cmd;
+    (void)direct;
+    (void)form;
+
+    for (i = 0; i < BIG_FIELDS; i++) {
+        snprintf(key, sizeof(key), "stat_%d", i);
+        snprintf(value, sizeof(value), "%d", i * 7);
+        conflate_add_field(r, key, value);
+    }
+    return RV_OK;
+}
+
+static void test_form_result_json(void)
+{
+    const char *values[] = {"one", "two", NULL};
+    const char *none[] = {NULL};
+    conflate_form_result r;
+    char *json;
+    size_t len;
+
+    conflate_init_form_result(&r);
+    json = conflate_form_result_json(&r, &len);
+    fail_unless(strcmp(json, "[]") == 0 && len == 2, "Expected no forms.");
+    free(json);
+
+    conflate_add_field(&r, "key", "quote \" slash \\ tab \t bell \a");
+    conflate_add_field_multi(&r, "many", values);
+    conflate_add_field_multi(&r, "none", none);
+    conflate_next_fieldset(&r);
+    conflate_next_fieldset(&r);
+    conflate_add_field(&r, "last", "");
+    json = conflate_form_result_json(&r, &len);
+    fail_unless(strcmp(json,
+                       "[{\"key\":[\"quote \\\" slash \\\\ tab \\t bell \\u0007\"],"
+                       "\"many\":[\"one\",\"two\"],\"none\":[]},"
+                       "{},{\"last\":[\"\"]}]") == 0,
+                "Wrong JSON.");
+    fail_unless(len == strlen(json), "Wrong JSON length.");
+    free(json);
+    conflate_free_form_result(&r);
+}
+
+/* Reply from another thread after a while, if the reply can wait. */
+static void finish_slowly(void *arg)
+{
+    conflate_mgmt_pending_t *p = arg;
+    usleep(200000);
+    conflate_add_field(conflate_mgmt_pending_form(p), "slow", "done");
+    conflate_mgmt_complete(p, RV_OK);
+}
+
+static enum conflate_mgmt_cb_result slow(void *opaque,
+                                         conflate_handle_t *handle,
+                                         const char *cmd,
+                                         bool direct,
+                                         kvpair_t *form,
+                                         conflate_form_result *r)
+{
+    conflate_mgmt_pending_t *p = conflate_mgmt_defer(r);
+    cb_thread_t thread;
+    (void)opaque;
+    (void)handle;
+    (void)cmd;
+    (void)direct;
+    (void)form;
+
+    if (p == NULL) {
+        conflate_add_field(r, "slow", "now");
+        return RV_OK;
+    }
+    if (cb_create_thread(&thread, finish_slowly, p, 1) != 0) {
+        conflate_mgmt_complete(p, RV_ERROR);
+    }
+    return RV_PENDING;
+}
+
+static conflate_mgmt_pending_t * volatile stuck_reply;
+
+/* Defer, and leave the test to complete it. */
+static enum conflate_mgmt_cb_result stuck(void *opaque,
+                                          conflate_handle_t *handle,
+                                          const char *cmd,
+                                          bool direct,
+                                          kvpair_t *form,
+                                          conflate_form_result *r)
+{
+    (void)opaque;
+    (void)handle;
+    (void)cmd;
+    (void)direct;
+    (void)form;
+
+    stuck_reply = conflate_mgmt_defer(r);
+    return stuck_reply ? RV_PENDING : RV_ERROR;
+}
+
+static void test_defer_without_socket(void)
+{
+    conflate_form_result r;
+
+    conflate_register_mgmt_cb("slow", "Takes its time.", slow);
+    conflate_init_form_result(&r);
+    fail_unless(conflate_dispatch_mgmt_cb(NULL, "slow", true, NULL, &r) == RV_OK,
+                "Direct dispatch couldn't reply at once.");
+    fail_unless(r.num_forms == 1, "Expected a form.");
+    conflate_free_form_result(&r);
+}
+
+static conflate_config_t server_conf;
+static conflate_handle_t server_handle;
+
+/* A handle that fails to start takes its socket away with it. */
+static void test_open_then_close(void)
+{
+    conflate_config_t conf;
+    conflate_handle_t handle;
+
+    init_conflate(&conf);
+    conf.mgmt_socket_path = SOCKET_PATH;
+    memset(&handle, 0, sizeof(handle));
+    handle.conf = &conf;
+
+    fail_unless(conflate_open_mgmt_server(&handle),
+                "Failed to open the management server.");
+    fail_unless(access(SOCKET_PATH, F_OK) == 0, "No socket was created.");
+    conflate_close_mgmt_server(&handle);
+    fail_unless(handle.mgmt_server == NULL, "Server wasn't forgotten.");
+    fail_unless(access(SOCKET_PATH, F_OK) != 0, "Socket was left behind.");
+    fail_unless(conflate_mgmt_connect(SOCKET_PATH) == NULL,
+                "Connected to a closed server.");
+}
+
+static void test_start_server(void)
+{
+    struct stat st;
+
+    init_conflate(&server_conf);
+    server_conf.save_path = SAVE_PATH;
+    server_conf.mgmt_socket_path = SOCKET_PATH;
+    server_handle.conf = &server_conf;
+    remove(SAVE_PATH ".private");
+
+    conflate_register_mgmt_cb("echo", "Says it back.", echo);
+    conflate_register_mgmt_cb("big", "Lots of fields.", big);
+    conflate_register_mgmt_cb_timeout("stuck", "Never finishes in time.",
+                                      stuck, 100);
+    fail_unless(conflate_start_mgmt_server(&server_handle),
+                "Failed to start the management server.");
+    fail_unless(stat(SOCKET_PATH, &st) == 0, "No socket was created.");
+    fail_unless((st.st_mode & 0777) == 0600, "The socket isn't private.");
+}
+
+static kvpair_t *mk_form(void)
+{
+    char *values[] = {"one", "", "three", NULL};
+    kvpair_t *form = mk_kvpair("many", values);
+    form->next = mk_kvpair("none", NULL);
+    return form;
+}
+
+/* Check a reply from echo to mk_form() */
+static void check_echo(kvpair_t **reply, int num_reply)
+{
+    kvpair_t *form = mk_form();
+
+    fail_unless(num_reply == 3, "Expected three fieldsets.");
+    check_pair_equality(form, reply[0]);
+    fail_unless(reply[1] == NULL, "Expected an empty fieldset.");
+    fail_unless(strcmp(get_simple_kvpair_val(reply[2], "cmd"), "echo") == 0,
+                "Wrong command name.");
+    free_kvpair(form);
+}
+
+static void test_socket_round_trip(void)
+{
+    conflate_mgmt_client_t *client = conflate_mgmt_connect(SOCKET_PATH);
+    kvpair_t *form = mk_form();
+    kvpair_t **reply;
+    int num_reply;
+
+    fail_if(client == NULL, "Failed to connect.");
+    fail_unless(conflate_mgmt_call(client, "echo", form, &reply,
+                                   &num_reply) == RV_OK,
+                "Echo failed.");
+    check_echo(reply, num_reply);
+    conflate_mgmt_free_reply(reply, num_reply);
+
+    /* The same connection carries as many requests as we like */
+    fail_unless(conflate_mgmt_call(client, "echo", NULL, &reply,
+                                   &num_reply) == RV_OK,
+                "Echo without a form failed.");
+    fail_unless(num_reply == 3 && reply[0] == NULL,
+                "Expected the echoed form to be empty.");
+    conflate_mgmt_free_reply(reply, num_reply);
+
+    fail_unless(conflate_mgmt_call(client, "no_such_command", form, &reply,
+                                   &num_reply) == RV_UNKNOWN,
+                "Unknown command wasn't reported.");
+    fail_unless(num_reply == 0, "Unknown command had a reply.");
+    conflate_mgmt_free_reply(reply, num_reply);
+
+    free_kvpair(form);
+    conflate_mgmt_close(client);
+}
+
+static void test_socket_big_reply(void)
+{
+    conflate_mgmt_client_t *client = conflate_mgmt_connect(SOCKET_PATH);
+    kvpair_t **reply;
+    kvpair_t *pair;
+    int num_reply, count = 0;
+
+    fail_if(client == NULL, "Failed to connect.");
+    fail_unless(conflate_mgmt_call(client, "big", NULL, &reply,
+                                   &num_reply) == RV_OK,
+                "Big reply failed.");
+    fail_unless(num_reply == 1, "Expected one fieldset.");
+    for (pair = reply[0]; pair; pair = pair->next) {
+        count++;
+    }
+    fail_unless(count == BIG_FIELDS, "Fields went missing.");
+    fail_unless(strcmp(get_simple_kvpair_val(reply[0], "stat_9999"),
+                       "69993") == 0,
+                "Wrong value.");
+    conflate_mgmt_free_reply(reply, num_reply);
+    conflate_mgmt_close(client);
+}
+
+static void test_socket_json(void)
+{
+    conflate_mgmt_client_t *client = conflate_mgmt_connect(SOCKET_PATH);
+    kvpair_t *form = mk_form();
+    char *json;
+
+    fail_if(client == NULL, "Failed to connect.");
+    fail_unless(conflate_mgmt_call_json(client, "echo", form,
+                                        &json) == RV_OK,
+                "Echo failed.");
+    fail_unless(strcmp(json, "[{\"many\":[\"one\",\"\",\"three\"],"
+                       "\"none\":[]},{},{\"cmd\":[\"echo\"]}]") == 0,
+                "Wrong JSON.");
+    free(json);
+
+    fail_unless(conflate_mgmt_call_json(client, "no_such_command", NULL,
+                                        &json) == RV_UNKNOWN,
+                "Unknown command wasn't reported.");
+    fail_unless(strcmp(json, "[]") == 0, "Unknown command had a reply.");
+    free(json);
+
+    free_kvpair(form);
+    conflate_mgmt_close(client);
+}
+
+static void call_slow(void *arg)
+{
+    conflate_mgmt_client_t *client = conflate_mgmt_connect(SOCKET_PATH);
+    kvpair_t **reply;
+    int num_reply;
+    (void)arg;
+
+    fail_if(client == NULL, "Failed to connect.");
+    fail_unless(conflate_mgmt_call(client, "slow", NULL, &reply,
+                                   &num_reply) == RV_OK,
+                "Deferred reply failed.");
+    fail_unless(num_reply == 1 &&
+                strcmp(get_simple_kvpair_val(reply[0], "slow"), "done") == 0,
+                "Wrong deferred reply.");
+    conflate_mgmt_free_reply(reply, num_reply);
+    conflate_mgmt_close(client);
+}
+
+static void test_socket_deferred(void)
+{
+    conflate_mgmt_client_t *client = conflate_mgmt_connect(SOCKET_PATH);
+    conflate_handle_t *handle = calloc(1, sizeof(conflate_handle_t));
+    kvpair_t *stats;
+    cb_thread_t caller;
+    hrtime_t start;
+    char *val;
+    int i;
+
+    fail_if(client == NULL, "Failed to connect.");
+    fail_unless(cb_create_thread(&caller, call_slow, NULL, 0) == 0,
+                "Failed to start a thread.");
+    usleep(50000);
+
+    /* Other commands don't wait for the slow one */
+    start = gethrtime();
+    for (i = 0; i < 10; i++) {
+        fail_unless(conflate_mgmt_call(client, "echo", NULL, NULL,
+                                       NULL) == RV_OK,
+                    "Echo failed.");
+    }
+    fail_unless(gethrtime() - start < 100000000,
+                "Commands waited for a deferred reply.");
+
+    cb_join_thread(caller);
+    conflate_mgmt_close(client);
+
+    /* It took as long as the reply did, not just the call */
+    stats = conflate_get_stats(handle);
+    val = get_simple_kvpair_val(stats, "commands.slow.latency_us.max");
+    fail_unless(val && atoll(val) >= 150000,
+                "Deferred reply wasn't timed.");
+    free_kvpair(stats);
+    free(handle);
+}
+
+static void test_socket_timeout(void)
+{
+    conflate_mgmt_client_t *client = conflate_mgmt_connect(SOCKET_PATH);
+    kvpair_t *stats;
+    char *val;
+
+    fail_if(client == NULL, "Failed to connect.");
+    fail_unless(conflate_mgmt_call(client, "stuck", NULL, NULL,
+                                   NULL) == RV_TIMEOUT,
+                "Deferred reply didn't time out.");
+    fail_if(stuck_reply == NULL, "Reply wasn't deferred.");
+
+    /* Completing it late is harmless */
+    conflate_add_field(conflate_mgmt_pending_form(stuck_reply), "too", "late");
+    conflate_mgmt_complete(stuck_reply, RV_OK);
+    fail_unless(conflate_mgmt_call(client, "echo", NULL, NULL,
+                                   NULL) == RV_OK,
+                "Echo failed after a timeout.");
+
+    stats = conflate_get_stats(&server_handle);
+    val = get_simple_kvpair_val(stats, "commands.stuck.timeouts");
+    fail_unless(val && strcmp(val, "1") == 0, "Timeout wasn't counted.");
+    free_kvpair(stats);
+
+    conflate_mgmt_close(client);
+}
+
+static void test_socket_client_leaves(void)
+{
+    /* A frame asking for "stuck" with an empty form */
+    static const char request[] = {
+        0, 0, 0, 13, 0, 0, 0, 5, 's', 't', 'u', 'c', 'k', 0, 0, 0, 0
+    };
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, SOCKET_PATH);
+    fail_unless(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0,
+                "Failed to connect.");
+
+    stuck_reply = NULL;
+    fail_unless(write(fd, request, sizeof(request)) == sizeof(request),
+                "Failed to send a request.");
+    while (stuck_reply == NULL) {
+        usleep(1000);
+    }
+    close(fd);
+    usleep(20000);
+
+    /* The reply has nowhere to go, and is just freed */
+    conflate_mgmt_complete(stuck_reply, RV_OK);
+    test_socket_round_trip();
+}
+
+static int connect_raw(void)
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, SOCKET_PATH);
+    fail_unless(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0,
+                "Failed to connect.");
+    return fd;
+}
+
+static void read_fully(int fd, unsigned char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        fail_unless(n > 0, "Connection closed early.");
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+static void test_socket_pipelined(void)
+{
+    /* A frame asking for "big" with an empty form */
+    static const char request[] = {
+        0, 0, 0, 11, 0, 0, 0, 3, 'b', 'i', 'g', 0, 0, 0, 0
+    };
+    unsigned char header[8];
+    unsigned char *body;
+    uint32_t len;
+    int fd = connect_raw();
+    int i;
+
+    /* Far more reply than the server holds for one connection */
+    for (i = 0; i < PIPELINED; i++) {
+        fail_unless(write(fd, request, sizeof(request)) == sizeof(request),
+                    "Failed to send a request.");
+    }
+    usleep(20000);
+
+    for (i = 0; i < PIPELINED; i++) {
+        read_fully(fd, header, sizeof(header));
+        len = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) |
+            ((uint32_t)header[2] << 8) | header[3];
+        fail_unless(len > 4 && header[4] == 0 && header[5] == 0 &&
+                    header[6] == 0 && header[7] == RV_OK,
+                    "Big reply failed.");
+        body = malloc(len - 4);
+        fail_if(body == NULL, "Out of memory.");
+        read_fully(fd, body, len - 4);
+        free(body);
+    }
+    close(fd);
+    test_socket_round_trip();
+}
+
+static void test_socket_private(void)
+{
+    conflate_mgmt_client_t *client = conflate_mgmt_connect(SOCKET_PATH);
+    char *values[] = {NULL, NULL};
+    kvpair_t *form;
+    kvpair_t **reply;
+    int num_reply;
+
+    fail_if(client == NULL, "Failed to connect.");
+
+    values[0] = "secret";
+    form = mk_kvpair("value", values);
+    values[0] = "password";
+    form->next = mk_kvpair("key", values);
+    fail_unless(conflate_mgmt_call(client, "set_private", form, NULL,
+                                   NULL) == RV_OK,
+                "Failed to set a private value.");
+    free_kvpair(form);
+
+    form = mk_kvpair("key", values);
+    fail_unless(conflate_mgmt_call(client, "get_private", form, &reply,
+                                   &num_reply) == RV_OK,
+                "Failed to get a private value.");
+    fail_unless(num_reply == 1, "Expected one fieldset.");
+    fail_unless(strcmp(get_simple_kvpair_val(reply[0], "password"),
+                       "secret") == 0,
+                "Got the wrong private value.");
+    conflate_mgmt_free_reply(reply, num_reply);
+    free_kvpair(form);
+
+    fail_unless(conflate_mgmt_call(client, "set_private", NULL, NULL,
+                                   NULL) == RV_BADARG,
+                "Missing arguments weren't reported.");
+
+    conflate_mgmt_close(client);
+    remove(SAVE_PATH ".private");
+}
+
+static int configs_received;
+
+static conflate_result count_config(void *userdata, kvpair_t *config)
+{
+    (void)userdata;
+    (void)config;
+    configs_received++;
+    return CONFLATE_SUCCESS;
+}
+
+/* Without a save_path there's nowhere to keep private data. */
+static void test_socket_private_unsaved(void)
+{
+    conflate_mgmt_client_t *client = conflate_mgmt_connect(SOCKET_PATH);
+    char *values[] = {"secret", NULL};
+    kvpair_t *form;
+    kvpair_t **reply;
+    int num_reply;
+
+    fail_if(client == NULL, "Failed to connect.");
+    server_conf.save_path = NULL;
+
+    form = mk_kvpair("password", values);
+    fail_unless(conflate_mgmt_call(client, "update_private", form, NULL,
+                                   NULL) == RV_ERROR,
+                "Saved private values without a save_path.");
+    free_kvpair(form);
+
+    values[0] = "password";
+    form = mk_kvpair("key", values);
+    fail_unless(conflate_mgmt_call(client, "rm_private", form, NULL,
+                                   NULL) == RV_ERROR,
+                "Deleted a private value without a save_path.");
+    fail_unless(conflate_mgmt_call(client, "get_private", form, &reply,
+                                   &num_reply) == RV_OK,
+                "Failed to look up a private value.");
+    fail_unless(num_reply == 1 && reply[0] == NULL,
+                "Found a private value without a save_path.");
+    conflate_mgmt_free_reply(reply, num_reply);
+
+    values[0] = "secret";
+    form->next = mk_kvpair("value", values);
+    fail_unless(conflate_mgmt_call(client, "set_private", form, NULL,
+                                   NULL) == RV_ERROR,
+                "Set a private value without a save_path.");
+    free_kvpair(form);
+
+    fail_unless(conflate_get_private(&server_handle, "password",
+                                     NULL) == NULL,
+                "Found a private value without a file.");
+
+    /* Nor anywhere to save a server list */
+    server_conf.new_config = count_config;
+    form = mk_kvpair("servers", values);
+    fail_unless(conflate_mgmt_call(client, "serverlist", form, NULL,
+                                   NULL) == RV_OK,
+                "Failed to take a server list without a save_path.");
+    fail_unless(configs_received == 1, "The server list wasn't delivered.");
+    free_kvpair(form);
+
+    server_conf.save_path = SAVE_PATH;
+    conflate_mgmt_close(client);
+}
+
+static void run_client(void *arg)
+{
+    conflate_mgmt_client_t *client = conflate_mgmt_connect(SOCKET_PATH);
+    kvpair_t *form = mk_form();
+    kvpair_t **reply;
+    int num_reply, i;
+    (void)arg;
+
+    fail_if(client == NULL, "Failed to connect.");
+    for (i = 0; i < CLIENT_CALLS; i++) {
+        fail_unless(conflate_mgmt_call(client, "echo", form, &reply,
+                                       &num_reply) == RV_OK,
+                    "Echo failed.");
+        check_echo(reply, num_reply);
+        conflate_mgmt_free_reply(reply, num_reply);
+    }
+    free_kvpair(form);
+    conflate_mgmt_close(client);
+}
+
+static void test_socket_clients(void)
+{
+    cb_thread_t clients[NUM_CLIENTS];
+    int i;
+
+    for (i = 0; i < NUM_CLIENTS; i++) {
+        fail_unless(cb_create_thread(&clients[i], run_client, NULL, 0) == 0,
+                    "Failed to start a thread.");
+    }
+    for (i = 0; i < NUM_CLIENTS; i++) {
+        cb_join_thread(clients[i]);
+    }
+}
+
+int main(void)
+{
+    typedef void (*testcase)(void);
+    testcase tc[] = {
+        test_dispatch,
+        test_replace,
+        test_many_commands,
+        test_register_while_dispatching,
+        test_failures_counted,
+        test_long_name_stats,
+        test_form_result_json,
+        test_defer_without_socket,
+        test_open_then_close,
+        test_start_server,
+        test_socket_round_trip,
+        test_socket_big_reply,
+        test_socket_json,
+        test_socket_deferred,
+        test_socket_timeout,
+        test_socket_client_leaves,
+        test_socket_pipelined,
+        test_socket_private,
+        test_socket_private_unsaved,
+        test_socket_clients,
+        NULL
+    };
+    int ii = 0;
+
+    while (tc[ii] != 0) {
+        tc[ii++]();
+    }
+
+    return EXIT_SUCCESS;
+}
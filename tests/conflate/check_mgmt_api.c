@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libconflate/conflate.h>
+
+#include "test_common.h"
+
+/*
+ * Management commands as an application sees them, through nothing
+ * but the public header.
+ */
+
+#define SOCKET_PATH "check_mgmt_api.sock"
+#define SAVE_PATH "check_mgmt_api.cfg"
+
+static conflate_handle_t *handle = NULL;
+
+static void quiet_logger(void *udata, enum conflate_log_level level,
+                         const char *msg, ...)
+{
+    (void)udata;
+    (void)level;
+    (void)msg;
+}
+
+static conflate_result ignore_config(void *userdata, kvpair_t *config)
+{
+    (void)userdata;
+    (void)config;
+    return CONFLATE_SUCCESS;
+}
+
+static enum conflate_mgmt_cb_result fields(void *opaque,
+                                           conflate_handle_t *h,
+                                           const char *cmd,
+                                           bool direct,
+                                           kvpair_t *form,
+                                           conflate_form_result *r)
+{
+    (void)opaque;
+    (void)h;
+    (void)cmd;
+    (void)direct;
+    (void)form;
+
+    conflate_add_field(r, "answer", "42");
+    return RV_OK;
+}
+
+static kvpair_t *mk_form(const char *key, const char *value)
+{
+    char *key_values[] = {NULL, NULL};
+    char *value_values[] = {NULL, NULL};
+    kvpair_t *form;
+
+    key_values[0] = (char *)key;
+    form = mk_kvpair("key", key_values);
+    if (value) {
+        value_values[0] = (char *)value;
+        form->next = mk_kvpair("value", value_values);
+    }
+    return form;
+}
+
+static void test_start(void)
+{
+    conflate_config_t conf;
+
+    init_conflate(&conf);
+    conf.jid = "";
+    conf.pass = "";
+    /* Nobody's there, so it just keeps retrying in the background */
+    conf.host = "http://127.0.0.1:1/dead";
+    conf.software = "check_mgmt_api";
+    conf.version = "1.0";
+    conf.save_path = SAVE_PATH;
+    conf.mgmt_socket_path = SOCKET_PATH;
+    conf.log = quiet_logger;
+    conf.new_config = ignore_config;
+    remove(SAVE_PATH);
+    remove(SAVE_PATH ".private");
+
+    handle = start_conflate_handle(conf);
+    fail_if(handle == NULL, "Failed to start conflate.");
+}
+
+static void test_builtin_without_result(void)
+{
+    kvpair_t *form = mk_form("colour", "blue");
+
+    fail_unless(conflate_dispatch_mgmt_cb(handle, "stats", true, NULL,
+                                          NULL) == RV_OK,
+                "Stats failed without a result.");
+    fail_unless(conflate_dispatch_mgmt_cb(handle, "set_private", true, form,
+                                          NULL) == RV_OK,
+                "Setting a private value failed.");
+    free_kvpair(form);
+
+    form = mk_form("colour", NULL);
+    fail_unless(conflate_dispatch_mgmt_cb(handle, "get_private", true, form,
+                                          NULL) == RV_OK,
+                "Getting a private value failed without a result.");
+    free_kvpair(form);
+}
+
+static void test_own_command(void)
+{
+    conflate_mgmt_client_t *client;
+    kvpair_t **reply;
+    int num_reply;
+
+    conflate_register_mgmt_cb("fields", "Adds a field.", fields);
+    fail_unless(conflate_dispatch_mgmt_cb(handle, "fields", true, NULL,
+                                          NULL) == RV_OK,
+                "Command failed without a result.");
+
+    /* Over the socket the same command has somewhere to reply */
+    client = conflate_mgmt_connect(SOCKET_PATH);
+    fail_if(client == NULL, "Failed to connect.");
+    fail_unless(conflate_mgmt_call(client, "fields", NULL, &reply,
+                                   &num_reply) == RV_OK,
+                "Command failed over the socket.");
+    fail_unless(num_reply == 1 &&
+                strcmp(get_simple_kvpair_val(reply[0], "answer"), "42") == 0,
+                "Wrong reply.");
+    conflate_mgmt_free_reply(reply, num_reply);
+    conflate_mgmt_close(client);
+}
+
+int main(void)
+{
+    typedef void (*testcase)(void);
+    testcase tc[] = {
+        test_start,
+        test_builtin_without_result,
+        test_own_command,
+        NULL
+    };
+    int ii = 0;
+
+    while (tc[ii] != 0) {
+        tc[ii++]();
+    }
+
+    return EXIT_SUCCESS;
+}
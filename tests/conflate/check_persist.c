@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include <libconflate/conflate.h>
+#include "conflate/conflate_internal.h"
+
+#include "test_common.h"
+
+#define SAVE_PATH "check_persist.cfg"
+
+static conflate_config_t conf;
+static conflate_handle_t handle;
+static kvpair_t *pair = NULL;
+static volatile int warnings = 0;
+
+static void count_warnings(void *udata, enum conflate_log_level level,
+                           const char *msg, ...)
+{
+    (void)udata;
+    (void)msg;
+    if (level >= LOG_LVL_WARN) {
+        conflate_atomic_incr(&warnings);
+    }
+}
+
+#define PRIVATE_PATH "check_private.cfg"
+#define PRIVATE_LOG PRIVATE_PATH ".private"
+#define COMPACT_PATH "check_compact.cfg"
+#define COMPACT_LOG COMPACT_PATH ".private"
+#define RACE_PATH "check_race.cfg"
+#define RACE_LOG RACE_PATH ".private"
+#define RACE_THREADS 8
+
+static void setup(void) {
+    init_conflate(&conf);
+    conf.log = count_warnings;
+    memset(&handle, 0, sizeof(handle));
+    handle.conf = &conf;
+    warnings = 0;
+    pair = NULL;
+    remove(SAVE_PATH);
+}
+
+static void teardown(void) {
+    free_kvpair(pair);
+    remove(SAVE_PATH);
+}
+
+static kvpair_t *mk_config(int entries)
+{
+    char *values[] = {"one", "", "three", NULL};
+    kvpair_t *head = NULL;
+    kvpair_t **tail = &head;
+    int i;
+
+    for (i = 0; i < entries; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "key%d", i);
+        /* Vary the number of values, including none */
+        *tail = mk_kvpair(key, i % 4 == 3 ? NULL : &values[i % 4]);
+        tail = &(*tail)->next;
+    }
+    return head;
+}
+
+static void test_missing_file(void)
+{
+    fail_unless(load_kvpairs(&handle, SAVE_PATH) == NULL, "Loaded nothing.");
+    fail_unless(warnings == 0, "Warned about a missing file.");
+}
+
+static void test_round_trip(void)
+{
+    kvpair_t *config = mk_config(1000);
+
+    fail_unless(save_kvpairs(&handle, config, SAVE_PATH), "Failed to save.");
+    pair = load_kvpairs(&handle, SAVE_PATH);
+    fail_if(pair == NULL, "Failed to load.");
+    check_pair_equality(config, pair);
+    fail_unless(strcmp(get_simple_kvpair_val(pair, "key997"), "") == 0,
+                "Couldn't find a loaded value.");
+
+    /* Loaded pairs can still be added to */
+    add_kvpair_value(pair, "extra");
+    fail_unless(strcmp(pair->values[pair->used_values - 1], "extra") == 0,
+                "Couldn't add to a loaded pair.");
+
+    free_kvpair(config);
+}
+
+static void test_replace(void)
+{
+    kvpair_t *config = mk_config(10);
+    kvpair_t *smaller = mk_config(3);
+
+    conf.save_fsync = false;
+    fail_unless(save_kvpairs(&handle, config, SAVE_PATH), "Failed to save.");
+    fail_unless(save_kvpairs(&handle, smaller, SAVE_PATH), "Failed to resave.");
+    pair = load_kvpairs(&handle, SAVE_PATH);
+    check_pair_equality(smaller, pair);
+
+    free_kvpair(config);
+    free_kvpair(smaller);
+}
+
+static void damage_file(long offset, bool truncate)
+{
+    FILE *f = fopen(SAVE_PATH, "rb");
+    char buf[65536];
+    size_t len;
+
+    fail_if(f == NULL, "Can't read the saved file.");
+    len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+
+    if (truncate) {
+        len = (size_t) offset;
+    } else {
+        buf[offset] ^= 0x20;
+    }
+
+    f = fopen(SAVE_PATH, "wb");
+    fail_if(f == NULL, "Can't write the saved file.");
+    fwrite(buf, 1, len, f);
+    fclose(f);
+}
+
+static void test_corrupt_file(void)
+{
+    kvpair_t *config = mk_config(10);
+
+    fail_unless(save_kvpairs(&handle, config, SAVE_PATH), "Failed to save.");
+    damage_file(40, false);
+    fail_unless(load_kvpairs(&handle, SAVE_PATH) == NULL,
+                "Loaded a corrupt config.");
+    fail_unless(warnings == 1, "Didn't warn about a corrupt config.");
+
+    fail_unless(save_kvpairs(&handle, config, SAVE_PATH), "Failed to save.");
+    damage_file(60, true);
+    fail_unless(load_kvpairs(&handle, SAVE_PATH) == NULL,
+                "Loaded a truncated config.");
+
+    free_kvpair(config);
+}
+
+static void check_private(const char *filename, const char *k, const char *v)
+{
+    char *value = conflate_get_private(&handle, k, filename);
+    if (v == NULL) {
+        fail_unless(value == NULL, "Found a deleted value.");
+    } else {
+        fail_unless(value && strcmp(value, v) == 0, "Wrong private value.");
+    }
+    free(value);
+}
+
+static void test_private_values(void)
+{
+    remove(PRIVATE_LOG);
+    check_private(PRIVATE_PATH, "config_is_private", NULL);
+
+    fail_unless(conflate_save_private(&handle, "config_is_private", "yes",
+                                      PRIVATE_PATH), "Failed to save.");
+    fail_unless(conflate_save_private(&handle, "other", "value",
+                                      PRIVATE_PATH), "Failed to save.");
+    fail_unless(conflate_save_private(&handle, "other", "changed",
+                                      PRIVATE_PATH), "Failed to resave.");
+    fail_unless(conflate_delete_private(&handle, "config_is_private",
+                                        PRIVATE_PATH), "Failed to delete.");
+    fail_unless(conflate_delete_private(&handle, "missing", PRIVATE_PATH),
+                "Failed to delete a missing value.");
+
+    check_private(PRIVATE_PATH, "config_is_private", NULL);
+    check_private(PRIVATE_PATH, "other", "changed");
+
+    /* Stores are cached by name, so another name for the same file
+       replays the log like a restart would */
+    check_private("./" PRIVATE_PATH, "config_is_private", NULL);
+    check_private("./" PRIVATE_PATH, "other", "changed");
+}
+
+static void test_private_torn_write(void)
+{
+    /* Half a frame, as if we crashed while appending it */
+    const char torn[] = { 1, 2, 3, 4, 100, 0, 0, 0, 'a', 'b', 'c' };
+    FILE *f = fopen(PRIVATE_LOG, "ab");
+    fail_if(f == NULL, "Can't append to the log.");
+    fwrite(torn, 1, sizeof(torn), f);
+    fclose(f);
+
+    check_private("././" PRIVATE_PATH, "other", "changed");
+    fail_unless(warnings == 1, "Didn't warn about the damaged log.");
+
+    /* The damage was cut off, so appending still works */
+    fail_unless(conflate_save_private(&handle, "after", "crash",
+                                      "././" PRIVATE_PATH), "Failed to save.");
+    check_private("./././" PRIVATE_PATH, "after", "crash");
+    check_private("./././" PRIVATE_PATH, "other", "changed");
+    fail_unless(warnings == 1, "Log was still damaged.");
+}
+
+static void test_private_batch(void)
+{
+    char *one[] = {"1", NULL};
+    char *two[] = {"2", NULL};
+    kvpair_t *changes = mk_kvpair("batch_a", one);
+
+    changes->next = mk_kvpair("batch_b", two);
+    changes->next->next = mk_kvpair("other", NULL);
+
+    fail_unless(conflate_update_private(&handle, changes, PRIVATE_PATH),
+                "Failed to apply the batch.");
+    check_private(PRIVATE_PATH, "batch_a", "1");
+    check_private(PRIVATE_PATH, "batch_b", "2");
+    check_private(PRIVATE_PATH, "other", NULL);
+
+    check_private(".//" PRIVATE_PATH, "batch_b", "2");
+    check_private(".//" PRIVATE_PATH, "other", NULL);
+
+    free_kvpair(changes);
+}
+
+static volatile bool race_started;
+
+static void race_to_load(void *arg)
+{
+    char key[32];
+
+    snprintf(key, sizeof(key), "thread_%d", (int)(intptr_t)arg);
+    while (!race_started) {
+    }
+    fail_unless(conflate_save_private(&handle, key, "here",
+                                      "./" RACE_PATH), "Failed to save.");
+}
+
+static void test_private_first_use_race(void)
+{
+    const char torn[] = { 1, 2, 3, 4, 100, 0, 0, 0, 'a', 'b', 'c' };
+    cb_thread_t threads[RACE_THREADS];
+    char key[32];
+    FILE *f;
+    int i;
+
+    /* Enough to make loading it take a while */
+    remove(RACE_LOG);
+    conf.save_fsync = false;
+    for (i = 0; i < 20000; i++) {
+        snprintf(key, sizeof(key), "before_%d", i);
+        fail_unless(conflate_save_private(&handle, key, "crash", RACE_PATH),
+                    "Failed to save.");
+    }
+    f = fopen(RACE_LOG, "ab");
+    fail_if(f == NULL, "Can't append to the log.");
+    fwrite(torn, 1, sizeof(torn), f);
+    fclose(f);
+
+    /* Everyone uses a new name for it at once, but only one of them
+       replays it and cuts off the damage */
+    race_started = false;
+    for (i = 0; i < RACE_THREADS; i++) {
+        fail_unless(cb_create_thread(&threads[i], race_to_load,
+                                     (void *)(intptr_t)i, 0) == 0,
+                    "Failed to start a thread.");
+    }
+    race_started = true;
+    for (i = 0; i < RACE_THREADS; i++) {
+        cb_join_thread(threads[i]);
+    }
+    fail_unless(warnings == 1, "The log was replayed more than once.");
+
+    check_private("././" RACE_PATH, "before_19999", "crash");
+    for (i = 0; i < RACE_THREADS; i++) {
+        snprintf(key, sizeof(key), "thread_%d", i);
+        check_private("././" RACE_PATH, key, "here");
+    }
+}
+
+static long file_size(const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    long rv;
+    fail_if(f == NULL, "Can't open file.");
+    fseek(f, 0, SEEK_END);
+    rv = ftell(f);
+    fclose(f);
+    return rv;
+}
+
+static void test_private_compaction(void)
+{
+    char value[64];
+    int i;
+
+    remove(COMPACT_LOG);
+    conf.save_fsync = false;
+    fail_unless(conflate_save_private(&handle, "keep", "me", COMPACT_PATH),
+                "Failed to save.");
+    for (i = 0; i < 5000; i++) {
+        snprintf(value, sizeof(value), "value %d", i);
+        fail_unless(conflate_save_private(&handle, "churn", value,
+                                          COMPACT_PATH), "Failed to save.");
+    }
+
+    for (i = 0; i < 500 && file_size(COMPACT_LOG) > 64 * 1024; i++) {
+        sleep_ms(10);
+    }
+    fail_unless(file_size(COMPACT_LOG) < 64 * 1024, "Log wasn't compacted.");
+
+    check_private(COMPACT_PATH, "churn", value);
+    check_private("./" COMPACT_PATH, "churn", value);
+    check_private("./" COMPACT_PATH, "keep", "me");
+}
+
+int main(void)
+{
+    typedef void (*testcase)(void);
+    testcase tc[] = {
+        test_missing_file,
+        test_round_trip,
+        test_replace,
+        test_corrupt_file,
+        test_private_values,
+        test_private_torn_write,
+        test_private_batch,
+        test_private_compaction,
+        test_private_first_use_race,
+        NULL
+    };
+    int ii = 0;
+
+    while (tc[ii] != 0) {
+        setup();
+        tc[ii++]();
+        teardown();
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,663 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libconflate/conflate.h>
+#include "conflate/conflate_internal.h"
+
+#include "fake_rest_server.h"
+#include "test_common.h"
+
+#define NUM_HANDLES 8
+#define NUM_CONFIGS 5
+#define WAIT_MS 10000
+
+struct watcher {
+    char name[32];
+    char bucket[40];
+    char url[256];
+    char *configs[NUM_CONFIGS + 1];
+    char save_path[64]; /* Empty to save nothing */
+    fake_rest_server_t *server;
+    conflate_handle_t *handle;
+
+    cb_mutex_t mutex;
+    int received;
+    int last_rev;
+    kvpair_t *last_config;
+    bool parse;
+    bool use_diff;
+    int race;
+    int retry_min_ms; /* Backoff policy, when not the default */
+    int retry_max_ms;
+    int idle_timeout_ms; /* When not the default */
+    int diffs;
+
+    bool crossed;
+    bool merged;
+};
+
+static conflate_result record_config(void *userdata, kvpair_t *conf)
+{
+    struct watcher *w = userdata;
+    char *contents = get_simple_kvpair_val(conf, "contents");
+    char *url = get_simple_kvpair_val(conf, "url");
+    char *rev;
+
+    cb_mutex_enter(&w->mutex);
+    w->received++;
+    conflate_snapshot_release(w->last_config);
+    w->last_config = conflate_snapshot_retain(conf);
+    if (url == NULL || strcmp(url, w->url) != 0) {
+        w->crossed = true;
+    } else if (w->parse) {
+        char *name = get_simple_kvpair_val(conf, "name");
+        char *host = get_simple_kvpair_val(conf, "nodes.1.hostname");
+        rev = get_simple_kvpair_val(conf, "rev");
+        if (contents != NULL || name == NULL || rev == NULL ||
+            strcmp(name, w->name) != 0 ||
+            host == NULL || strcmp(host, "h1") != 0) {
+            w->crossed = true;
+        } else {
+            w->last_rev = atoi(rev);
+        }
+    } else if (contents == NULL || strstr(contents, w->bucket) == NULL) {
+        w->crossed = true;
+    } else if ((rev = strstr(contents, "\"rev\":")) != NULL) {
+        w->last_rev = atoi(rev + strlen("\"rev\":"));
+        if (strstr(rev + 1, "\"rev\":") != NULL) {
+            w->merged = true;
+        }
+    }
+    cb_mutex_exit(&w->mutex);
+
+    return CONFLATE_SUCCESS;
+}
+
+static conflate_result record_diff(void *userdata, kvpair_t *added,
+                                  kvpair_t *removed, kvpair_t *changed)
+{
+    struct watcher *w = userdata;
+    char *contents = changed ? get_simple_kvpair_val(changed, "contents") : NULL;
+    char *rev;
+
+    cb_mutex_enter(&w->mutex);
+    w->diffs++;
+    if (added || removed || contents == NULL || changed->next != NULL) {
+        w->crossed = true;
+    } else if ((rev = strstr(contents, "\"rev\":")) != NULL) {
+        w->last_rev = atoi(rev + strlen("\"rev\":"));
+    }
+    cb_mutex_exit(&w->mutex);
+
+    return CONFLATE_SUCCESS;
+}
+
+/*
+ * Watchers outlive the tests that make them, since there's no way to
+ * stop a handle, so they're never freed.
+ */
+static struct watcher *mk_watcher(int id)
+{
+    struct watcher *w = calloc(1, sizeof(struct watcher));
+    int i;
+
+    fail_if(w == NULL, "Failed to allocate a watcher.");
+    cb_mutex_initialize(&w->mutex);
+
+    /* The trailing quote keeps b1 from matching b10 and friends. */
+    snprintf(w->name, sizeof(w->name), "b%d", id);
+    snprintf(w->bucket, sizeof(w->bucket), "\"%s\"", w->name);
+    for (i = 0; i < NUM_CONFIGS; i++) {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "{\"name\":%s,\"rev\":%d,"
+                 "\"nodes\":[{\"hostname\":\"h0\"},{\"hostname\":\"h1\"}]}",
+                 w->bucket, i + 1);
+        w->configs[i] = safe_strdup(buf);
+    }
+
+    w->server = start_fake_rest_server((const char **)w->configs, 20, false);
+    fake_rest_server_url(w->server, w->url, sizeof(w->url));
+    snprintf(w->save_path, sizeof(w->save_path), "check_rest_%d.cfg", id);
+    /* Start from scratch rather than what the last run saved */
+    remove(w->save_path);
+
+    return w;
+}
+
+static void start_watching(struct watcher *w, bool shared,
+                           const char *dead_url)
+{
+    conflate_config_t conf;
+    char host[512];
+
+    if (dead_url) {
+        /* Put a url nobody listens on in front of the real one. */
+        snprintf(host, sizeof(host), "%s|%s", dead_url, w->url);
+    } else {
+        snprintf(host, sizeof(host), "%s", w->url);
+    }
+
+    init_conflate(&conf);
+    conf.jid = "";
+    conf.pass = "";
+    conf.host = host;
+    conf.software = "check_rest";
+    conf.version = "1.0";
+    conf.save_path = w->save_path[0] ? w->save_path : NULL;
+    conf.userdata = w;
+    conf.new_config = record_config;
+    conf.shared_rest_engine = shared;
+    conf.parse_configs = w->parse;
+    conf.race_urls = w->race;
+    if (w->idle_timeout_ms) {
+        conf.idle_timeout_ms = w->idle_timeout_ms;
+    }
+    if (w->retry_min_ms) {
+        conf.retry_min_ms = w->retry_min_ms;
+        conf.retry_max_ms = w->retry_max_ms;
+    }
+    if (w->use_diff) {
+        conf.config_diff = record_diff;
+    }
+
+    w->handle = start_conflate_handle(conf);
+    fail_unless(w->handle != NULL, "Failed to start conflate.");
+}
+
+static bool watcher_done(struct watcher *w)
+{
+    bool rv;
+    cb_mutex_enter(&w->mutex);
+    rv = w->last_rev == NUM_CONFIGS;
+    cb_mutex_exit(&w->mutex);
+    return rv;
+}
+
+static void wait_for_watcher(struct watcher *w)
+{
+    int waited;
+    for (waited = 0; !watcher_done(w) && waited < WAIT_MS; waited += 10) {
+        sleep_ms(10);
+    }
+}
+
+static void check_watcher(struct watcher *w)
+{
+    cb_mutex_enter(&w->mutex);
+    fail_if(w->crossed, "Handle saw another handle's config.");
+    fail_if(w->merged, "Two configs were delivered as one.");
+    fail_unless(w->received > 0, "Handle saw no configs.");
+    fail_unless(w->last_rev == NUM_CONFIGS,
+                "Handle didn't see the last config.");
+    cb_mutex_exit(&w->mutex);
+}
+
+static void run_watchers(int first_id, bool shared)
+{
+    struct watcher *watchers[NUM_HANDLES];
+    int i;
+
+    for (i = 0; i < NUM_HANDLES; i++) {
+        watchers[i] = mk_watcher(first_id + i);
+        start_watching(watchers[i], shared, NULL);
+    }
+
+    for (i = 0; i < NUM_HANDLES; i++) {
+        wait_for_watcher(watchers[i]);
+        check_watcher(watchers[i]);
+    }
+}
+
+static void test_concurrent_handles(void)
+{
+    run_watchers(0, false);
+}
+
+static void test_failover(void)
+{
+    struct watcher *w = mk_watcher(200);
+    start_watching(w, false, "http://127.0.0.1:1/dead");
+    wait_for_watcher(w);
+    check_watcher(w);
+}
+
+static void test_split_delimiter(void)
+{
+    struct watcher *w = mk_watcher(300);
+    /* Every delimiter ends up split over two reads */
+    w->server->chunk_size = 3;
+    start_watching(w, false, NULL);
+    wait_for_watcher(w);
+    check_watcher(w);
+    fail_unless(w->received == NUM_CONFIGS, "Wrong number of configs.");
+}
+
+static void test_back_to_back_configs(void)
+{
+    struct watcher *w = mk_watcher(301);
+    /* Several configs will arrive in the same read */
+    w->server->delay_ms = 0;
+    start_watching(w, false, NULL);
+    wait_for_watcher(w);
+    check_watcher(w);
+    fail_unless(w->received == NUM_CONFIGS, "Wrong number of configs.");
+}
+
+static void test_heartbeats(void)
+{
+    struct watcher *w = mk_watcher(302);
+    w->server->heartbeats = true;
+    start_watching(w, false, NULL);
+    wait_for_watcher(w);
+    check_watcher(w);
+    fail_unless(w->received == NUM_CONFIGS, "Heartbeats became configs.");
+}
+
+static void test_unterminated_string(void)
+{
+    struct watcher *w = mk_watcher(303);
+    char buf[256];
+
+    /* The string never ends, but the config still does */
+    snprintf(buf, sizeof(buf), "{\"name\":%s,\"rev\":2,\"broken", w->bucket);
+    free(w->configs[1]);
+    w->configs[1] = safe_strdup(buf);
+    start_watching(w, false, NULL);
+    wait_for_watcher(w);
+    check_watcher(w);
+    fail_unless(w->received == NUM_CONFIGS, "Wrong number of configs.");
+}
+
+static void test_unsaved(void)
+{
+    struct watcher *w = mk_watcher(304);
+    char save_path[64];
+
+    strcpy(save_path, w->save_path);
+    w->save_path[0] = '\0';
+    start_watching(w, false, NULL);
+    wait_for_watcher(w);
+    check_watcher(w);
+    fail_unless(access(save_path, F_OK) != 0, "Saved without a save_path.");
+}
+
+static void test_parsed_configs(void)
+{
+    struct watcher *w = mk_watcher(400);
+    w->parse = true;
+    w->server->chunk_size = 7;
+    start_watching(w, false, NULL);
+    wait_for_watcher(w);
+    check_watcher(w);
+    fail_unless(w->received == NUM_CONFIGS, "Wrong number of configs.");
+}
+
+static void test_identical_configs(void)
+{
+    struct watcher *w = mk_watcher(500);
+    /* Push the first config three times before moving on */
+    free(w->configs[1]);
+    free(w->configs[2]);
+    w->configs[1] = w->configs[2] = w->configs[0];
+    start_watching(w, false, NULL);
+    wait_for_watcher(w);
+    check_watcher(w);
+    fail_unless(w->received == 3, "Repeated configs were delivered.");
+}
+
+static void test_config_diff(void)
+{
+    struct watcher *w = mk_watcher(501);
+    free(w->configs[2]);
+    w->configs[2] = w->configs[1];
+    w->use_diff = true;
+    start_watching(w, false, NULL);
+    wait_for_watcher(w);
+    check_watcher(w);
+    fail_unless(w->received == 1, "Only the first config should be whole.");
+    fail_unless(w->diffs == 3, "Wrong number of diffs.");
+}
+
+static bool saved_last_config(struct watcher *w)
+{
+    conflate_config_t conf;
+    conflate_handle_t handle;
+    kvpair_t *saved, *added, *removed, *changed;
+    bool rv = false;
+
+    init_conflate(&conf);
+    memset(&handle, 0, sizeof(handle));
+    handle.conf = &conf;
+
+    saved = load_kvpairs(&handle, w->save_path);
+    if (saved) {
+        cb_mutex_enter(&w->mutex);
+        rv = !diff_kvpair(w->last_config, saved, &added, &removed, &changed);
+        cb_mutex_exit(&w->mutex);
+        free_kvpair(added);
+        free_kvpair(removed);
+        free_kvpair(changed);
+        free_kvpair(saved);
+    }
+    return rv;
+}
+
+static void test_save_burst(void)
+{
+    struct watcher *w = mk_watcher(600);
+    int waited;
+
+    /* All the configs arrive at once, and only the last should stick */
+    w->server->delay_ms = 0;
+    start_watching(w, false, NULL);
+    wait_for_watcher(w);
+    check_watcher(w);
+
+    for (waited = 0; !saved_last_config(w) && waited < WAIT_MS; waited += 10) {
+        sleep_ms(10);
+    }
+    fail_unless(saved_last_config(w), "Last config wasn't saved.");
+}
+
+static void test_race(void)
+{
+    struct watcher *w = mk_watcher(700);
+    fake_rest_server_t *stalled = start_fake_rest_server(NULL, 0, false);
+    char stalled_url[256];
+    int waited;
+
+    /* Without racing, the stalled server would hold things up forever */
+    stalled->stall = true;
+    fake_rest_server_url(stalled, stalled_url, sizeof(stalled_url));
+    w->race = 2;
+    start_watching(w, false, stalled_url);
+    wait_for_watcher(w);
+    check_watcher(w);
+
+    /* The losing connection gets hung up on */
+    for (waited = 0; fake_rest_server_closed(stalled) == 0 && waited < WAIT_MS;
+         waited += 10) {
+        sleep_ms(10);
+    }
+    fail_unless(fake_rest_server_connections(stalled) == 1,
+                "Stalled server wasn't raced.");
+    fail_unless(fake_rest_server_closed(stalled) == 1,
+                "Losing connection wasn't closed.");
+}
+
+static void test_idle_failover(void)
+{
+    struct watcher *w = mk_watcher(750);
+    fake_rest_server_t *stalled = start_fake_rest_server(NULL, 0, false);
+    char stalled_url[256];
+    hrtime_t start = gethrtime();
+    conflate_config_t defaults;
+
+    init_conflate(&defaults);
+    fail_unless(defaults.idle_timeout_ms > 0,
+                "Stalled streams aren't given up on by default.");
+
+    /* A server that never says anything gets given up on in time */
+    stalled->stall = true;
+    fake_rest_server_url(stalled, stalled_url, sizeof(stalled_url));
+    w->idle_timeout_ms = 200;
+    start_watching(w, false, stalled_url);
+    wait_for_watcher(w);
+    check_watcher(w);
+
+    fail_unless(fake_rest_server_connections(stalled) >= 1,
+                "Stalled server wasn't tried first.");
+    fail_unless(gethrtime() - start < (hrtime_t)WAIT_MS / 2 * 1000000,
+                "Failing over took too long.");
+}
+
+static int wait_for_connections(fake_rest_server_t *server, int n)
+{
+    int waited;
+    for (waited = 0; fake_rest_server_connections(server) < n &&
+             waited < WAIT_MS; waited += 10) {
+        sleep_ms(10);
+    }
+    return fake_rest_server_connections(server);
+}
+
+static void test_healthy_first(void)
+{
+    struct watcher *w = mk_watcher(800);
+    static const char *nothing[] = { NULL };
+    fake_rest_server_t *broken = start_fake_rest_server(nothing, 0, true);
+    char broken_url[256];
+
+    /* Each stream ends after its configs, so the handle keeps coming
+       back, and should stop bothering with the url that failed it */
+    w->server->delay_ms = 0;
+    w->server->close_after = true;
+    w->retry_min_ms = 10;
+    w->retry_max_ms = 100;
+    fake_rest_server_url(broken, broken_url, sizeof(broken_url));
+    start_watching(w, false, broken_url);
+    wait_for_watcher(w);
+    check_watcher(w);
+
+    fail_unless(wait_for_connections(w->server, 10) >= 10,
+                "Handle didn't keep reconnecting.");
+    fail_unless(fake_rest_server_connections(broken) == 1,
+                "Failed url was tried ahead of the healthy one.");
+}
+
+static void test_backoff(void)
+{
+    static const char *nothing[] = { NULL };
+    fake_rest_server_t *broken = start_fake_rest_server(nothing, 0, true);
+    struct watcher *watchers[4];
+    int i, connections;
+
+    /* Handles that only ever fail should back off from 10ms to 80ms:
+       with jitter, 8 to 14 tries each in the first half second, where
+       a fixed 10ms interval would make about 50 */
+    for (i = 0; i < 4; i++) {
+        watchers[i] = mk_watcher(810 + i);
+        watchers[i]->retry_min_ms = 10;
+        watchers[i]->retry_max_ms = 80;
+        fake_rest_server_url(broken, watchers[i]->url,
+                             sizeof(watchers[i]->url));
+        start_watching(watchers[i], false, NULL);
+    }
+
+    fail_unless(wait_for_connections(broken, 4) >= 4,
+                "Handles never connected.");
+    sleep_ms(500);
+    connections = fake_rest_server_connections(broken);
+    fail_unless(connections >= 4 * 5, "Handles gave up retrying.");
+    fail_unless(connections <= 4 * 20, "Handles didn't back off.");
+}
+
+static void test_not_modified(void)
+{
+    struct watcher *w = mk_watcher(900);
+    fake_rest_server_t *server = w->server;
+    int received, not_modified = 0, waited;
+
+    /* Once the handle has the config, fetching it again while it
+       hasn't changed costs a 304 and no callback */
+    server->delay_ms = 0;
+    server->close_after = true;
+    server->single = true;
+    server->etag = "\"rev5\"";
+    w->retry_min_ms = 10;
+    w->retry_max_ms = 100;
+    start_watching(w, false, NULL);
+    wait_for_watcher(w);
+    check_watcher(w);
+
+    cb_mutex_enter(&w->mutex);
+    received = w->received;
+    cb_mutex_exit(&w->mutex);
+
+    for (waited = 0; waited < WAIT_MS; waited += 10) {
+        cb_mutex_enter(&server->mutex);
+        not_modified = server->not_modified;
+        cb_mutex_exit(&server->mutex);
+        if (not_modified >= 3) {
+            break;
+        }
+        sleep_ms(10);
+    }
+    fail_unless(not_modified >= 3, "Config wasn't fetched conditionally.");
+
+    cb_mutex_enter(&w->mutex);
+    fail_unless(w->received == received, "Unchanged config was delivered.");
+    cb_mutex_exit(&w->mutex);
+    cb_mutex_enter(&server->mutex);
+    fail_unless(server->compressible > 0, "Compression wasn't offered.");
+    cb_mutex_exit(&server->mutex);
+}
+
+static int64_t get_stat(kvpair_t *stats, const char *key)
+{
+    char *val = get_simple_kvpair_val(stats, key);
+    return val ? atoll(val) : -1;
+}
+
+static void test_stream_unconditional(void)
+{
+    struct watcher *w = mk_watcher(901);
+    fake_rest_server_t *server = w->server;
+    int waited;
+
+    /* A stream's ETag only describes its first config, so reconnecting
+       mustn't ask for the stream only if that has changed */
+    server->delay_ms = 0;
+    server->close_after = true;
+    server->etag = "\"rev1\"";
+    w->retry_min_ms = 10;
+    w->retry_max_ms = 100;
+    start_watching(w, false, NULL);
+    wait_for_watcher(w);
+    check_watcher(w);
+
+    for (waited = 0; fake_rest_server_connections(server) < 4 &&
+             waited < WAIT_MS; waited += 10) {
+        sleep_ms(10);
+    }
+    fail_unless(fake_rest_server_connections(server) >= 4,
+                "Handle didn't reconnect.");
+    cb_mutex_enter(&server->mutex);
+    fail_unless(server->not_modified == 0, "Stream was fetched conditionally.");
+    cb_mutex_exit(&server->mutex);
+}
+
+static void test_stats(void)
+{
+    struct watcher *w = mk_watcher(950);
+    kvpair_t *stats;
+
+    start_watching(w, false, "http://127.0.0.1:1/dead");
+    wait_for_watcher(w);
+    check_watcher(w);
+
+    stats = conflate_get_stats(w->handle);
+    fail_unless(get_stat(stats, "bytes_received") > 0, "No bytes counted.");
+    fail_unless(get_stat(stats, "connections") >= 2, "Connections not counted.");
+    fail_unless(get_stat(stats, "configs_received") == NUM_CONFIGS,
+                "Configs not counted.");
+    fail_unless(get_stat(stats, "configs_delivered") == NUM_CONFIGS,
+                "Deliveries not counted.");
+    fail_unless(get_stat(stats, "last_config_age_ms") >= 0,
+                "No time since the last config.");
+    fail_unless(get_stat(stats, "curl_errors.7") >= 1,
+                "Failed connection not counted.");
+    fail_unless(get_stat(stats, "url.1.connections") >= 1,
+                "Per url connections not counted.");
+    fail_unless(get_stat(stats, "url.1.latency_us") >= 0,
+                "Url latency missing.");
+    fail_unless(get_stat(stats, "parse_us.count") == NUM_CONFIGS,
+                "Parse times not recorded.");
+    fail_unless(get_stat(stats, "callback_us.count") == NUM_CONFIGS,
+                "Callback times not recorded.");
+    fail_unless(get_stat(stats, "callback_us.p50") <=
+                get_stat(stats, "callback_us.p99"),
+                "Percentiles out of order.");
+    fail_unless(get_stat(stats, "first_config_us.count") == 1,
+                "First config time not recorded.");
+    free_kvpair(stats);
+}
+
+static void test_shared_engine(void)
+{
+    fail_unless(start_conflate_engine(2), "Failed to start the engine.");
+    run_watchers(100, true);
+}
+
+/* How long a new watcher waits for its first config. */
+static hrtime_t time_first_config(struct watcher *w)
+{
+    hrtime_t start = gethrtime();
+    int waited;
+
+    start_watching(w, true, NULL);
+    for (waited = 0; waited < WAIT_MS; waited++) {
+        bool got;
+        cb_mutex_enter(&w->mutex);
+        got = w->received > 0;
+        cb_mutex_exit(&w->mutex);
+        if (got) {
+            break;
+        }
+        sleep_ms(1);
+    }
+    return gethrtime() - start;
+}
+
+static void test_shared_engine_wakeup(void)
+{
+    int i;
+
+    /* Each is added while the engine sleeps, and has to wake it rather
+       than wait for curl's timers or the poll interval to */
+    for (i = 0; i < 5; i++) {
+        struct watcher *w = mk_watcher(110 + i);
+        sleep_ms(50);
+        fail_unless(time_first_config(w) < 30000000,
+                    "Adding a handle didn't wake the engine.");
+        wait_for_watcher(w);
+        check_watcher(w);
+    }
+}
+
+int main(void)
+{
+    typedef void (*testcase)(void);
+    testcase tc[] = {
+        test_concurrent_handles,
+        test_failover,
+        test_split_delimiter,
+        test_back_to_back_configs,
+        test_heartbeats,
+        test_unterminated_string,
+        test_unsaved,
+        test_parsed_configs,
+        test_identical_configs,
+        test_config_diff,
+        test_save_burst,
+        test_race,
+        test_idle_failover,
+        test_healthy_first,
+        test_backoff,
+        test_not_modified,
+        test_stream_unconditional,
+        test_stats,
+        test_shared_engine,
+        test_shared_engine_wakeup,
+        NULL
+    };
+    int ii = 0;
+
+    while (tc[ii] != 0) {
+        tc[ii++]();
+    }
+
+    return EXIT_SUCCESS;
+}
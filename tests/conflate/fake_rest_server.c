@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "fake_rest_server.h"
+#include "test_common.h"
+
+#define END_OF_CONFIG "\n\n\n\n"
+
+struct connection {
+    fake_rest_server_t *server;
+    int fd;
+};
+
+static bool write_fully(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t w = send(fd, data, len, MSG_NOSIGNAL);
+        if (w <= 0) {
+            return false;
+        }
+        data += w;
+        len -= (size_t)w;
+    }
+    return true;
+}
+
+/* Send data the way the server is set up to, in pieces if need be. */
+static bool send_data(fake_rest_server_t *server, int fd,
+                      const char *data, size_t len)
+{
+    size_t chunk = server->chunk_size ? server->chunk_size : len;
+
+    while (len > 0) {
+        if (chunk > len) {
+            chunk = len;
+        }
+        if (!write_fully(fd, data, chunk)) {
+            return false;
+        }
+        data += chunk;
+        len -= chunk;
+        if (server->chunk_size && len > 0) {
+            sleep_ms(1);
+        }
+    }
+    return true;
+}
+
+static bool read_request(int fd, char *buf, size_t size)
+{
+    size_t used = 0;
+
+    while (used < size - 1) {
+        ssize_t r = recv(fd, buf + used, size - 1 - used, 0);
+        if (r <= 0) {
+            return false;
+        }
+        used += (size_t)r;
+        buf[used] = '\0';
+        if (strstr(buf, "\r\n\r\n")) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Whether the request has the header with the value in it. */
+static bool request_has(const char *request, const char *name,
+                        const char *value)
+{
+    const char *line = strstr(request, name);
+    const char *end;
+
+    if (line == NULL || line[strlen(name)] != ':') {
+        return false;
+    }
+    end = strstr(line, "\r\n");
+    line = strstr(line, value);
+    return line != NULL && line < end;
+}
+
+static void serve_connection(void *arg)
+{
+    struct connection *conn = arg;
+    fake_rest_server_t *server = conn->server;
+    char request[4096];
+    char header[256];
+    int i;
+
+    if (server->etag) {
+        snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: application/json\r\n"
+                 "ETag: %s\r\n\r\n", server->etag);
+    } else {
+        snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: application/json\r\n\r\n");
+    }
+
+    if (server->stall) {
+        char c;
+        while (recv(conn->fd, &c, 1, 0) > 0) {
+        }
+    } else if (!read_request(conn->fd, request, sizeof(request))) {
+        /* The client went away */
+    } else if (server->etag && request_has(request, "If-None-Match",
+                                           server->etag)) {
+        const char *unchanged = "HTTP/1.0 304 Not Modified\r\n\r\n";
+        cb_mutex_enter(&server->mutex);
+        server->not_modified++;
+        cb_mutex_exit(&server->mutex);
+        write_fully(conn->fd, unchanged, strlen(unchanged));
+    } else if (write_fully(conn->fd, header, strlen(header))) {
+        if (request_has(request, "Accept-Encoding", "gzip")) {
+            cb_mutex_enter(&server->mutex);
+            server->compressible++;
+            cb_mutex_exit(&server->mutex);
+        }
+
+        if (server->single) {
+            for (i = 0; server->configs[i + 1]; i++) {
+            }
+            send_data(server, conn->fd, server->configs[i],
+                      strlen(server->configs[i]));
+        } else {
+            for (i = 0; server->configs[i]; i++) {
+                if (i > 0 && server->delay_ms) {
+                    sleep_ms(server->delay_ms);
+                }
+                if (server->heartbeats &&
+                    !send_data(server, conn->fd, END_OF_CONFIG,
+                               strlen(END_OF_CONFIG))) {
+                    break;
+                }
+                if (!send_data(server, conn->fd, server->configs[i],
+                               strlen(server->configs[i])) ||
+                    !send_data(server, conn->fd, END_OF_CONFIG,
+                               strlen(END_OF_CONFIG))) {
+                    break;
+                }
+            }
+        }
+
+        if (!server->close_after) {
+            /* Hold the stream open until the client goes away. */
+            char c;
+            while (recv(conn->fd, &c, 1, 0) > 0) {
+            }
+        }
+    }
+
+    close(conn->fd);
+    free(conn);
+
+    cb_mutex_enter(&server->mutex);
+    server->closed++;
+    cb_mutex_exit(&server->mutex);
+}
+
+static void accept_loop(void *arg)
+{
+    fake_rest_server_t *server = arg;
+
+    while (true) {
+        cb_thread_t tid;
+        struct connection *conn;
+        int one = 1;
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+
+        cb_mutex_enter(&server->mutex);
+        server->connections++;
+        cb_mutex_exit(&server->mutex);
+
+        /* Make sure small writes go out as separate packets */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        conn = calloc(1, sizeof(struct connection));
+        assert(conn);
+        conn->server = server;
+        conn->fd = fd;
+        fail_unless(cb_create_thread(&tid, serve_connection, conn, 1) == 0,
+                    "Failed to start a connection thread.");
+    }
+}
+
+fake_rest_server_t *start_fake_rest_server(const char **configs,
+                                           int delay_ms, bool close_after)
+{
+    cb_thread_t tid;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    fake_rest_server_t *server = calloc(1, sizeof(fake_rest_server_t));
+    assert(server);
+
+    server->configs = configs;
+    server->delay_ms = delay_ms;
+    server->close_after = close_after;
+    cb_mutex_initialize(&server->mutex);
+
+    server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    fail_if(server->listen_fd < 0, "Failed to create a socket.");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    fail_unless(bind(server->listen_fd, (struct sockaddr*)&addr,
+                     sizeof(addr)) == 0, "Failed to bind.");
+    fail_unless(listen(server->listen_fd, 128) == 0, "Failed to listen.");
+    fail_unless(getsockname(server->listen_fd, (struct sockaddr*)&addr,
+                            &addrlen) == 0, "Failed to get the port.");
+    server->port = ntohs(addr.sin_port);
+
+    fail_unless(cb_create_thread(&tid, accept_loop, server, 1) == 0,
+                "Failed to start the server thread.");
+
+    return server;
+}
+
+void fake_rest_server_url(fake_rest_server_t *server, char *buf, size_t len)
+{
+    snprintf(buf, len, "http://127.0.0.1:%d/pools/default/bucketsStreaming",
+             server->port);
+}
+
+int fake_rest_server_connections(fake_rest_server_t *server)
+{
+    int rv;
+    cb_mutex_enter(&server->mutex);
+    rv = server->connections;
+    cb_mutex_exit(&server->mutex);
+    return rv;
+}
+
+int fake_rest_server_closed(fake_rest_server_t *server)
+{
+    int rv;
+    cb_mutex_enter(&server->mutex);
+    rv = server->closed;
+    cb_mutex_exit(&server->mutex);
+    return rv;
+}
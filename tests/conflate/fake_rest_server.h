@@ -0,0 +1,48 @@
+#ifndef FAKE_REST_SERVER_H
+#define FAKE_REST_SERVER_H 1
+
+#include <libconflate/conflate.h>
+
+/*
+ * A tiny HTTP server on localhost that streams a fixed list of configs
+ * to every client that connects, the way a REST streaming endpoint
+ * does.
+ */
+typedef struct fake_rest_server {
+    int listen_fd;
+    int port;
+
+    /* NULL-terminated list of configs sent on each connection. */
+    const char **configs;
+    /* Milliseconds to pause between configs. */
+    int delay_ms;
+    /* Close the connection after the last config (else hold it open). */
+    bool close_after;
+    /* Write in pieces of this many bytes (0 writes each config whole). */
+    size_t chunk_size;
+    /* Send an empty heartbeat message before each config. */
+    bool heartbeats;
+    /* Accept requests but never answer them. */
+    bool stall;
+    /* Send this ETag, and answer 304 to requests that already have it. */
+    const char *etag;
+    /* Answer with just the last config, as a plain response would. */
+    bool single;
+
+    cb_mutex_t mutex;
+    int connections;
+    int closed; /* Connections that have since been closed. */
+    int not_modified; /* Requests answered with a 304. */
+    int compressible; /* Requests that would take a gzipped response. */
+} fake_rest_server_t;
+
+fake_rest_server_t *start_fake_rest_server(const char **configs,
+                                           int delay_ms, bool close_after);
+
+void fake_rest_server_url(fake_rest_server_t *server, char *buf, size_t len);
+
+int fake_rest_server_connections(fake_rest_server_t *server);
+
+int fake_rest_server_closed(fake_rest_server_t *server);
+
+#endif /* FAKE_REST_SERVER_H */
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libconflate/conflate.h>
+#include "conflate/conflate_internal.h"
+
+#define SOCKET_PATH "load_mgmt.sock"
+#define DEFAULT_CALLS 200000
+#define MAX_CLIENTS 256
+
+struct client {
+    cb_thread_t thread;
+    int calls;
+    hrtime_t worst;
+};
+
+static enum conflate_mgmt_cb_result noop(void *opaque,
+                                         conflate_handle_t *handle,
+                                         const char *cmd,
+                                         bool direct,
+                                         kvpair_t *form,
+                                         conflate_form_result *r)
+{
+    (void)opaque;
+    (void)handle;
+    (void)cmd;
+    (void)direct;
+    (void)form;
+    conflate_add_field(r, "result", "ok");
+    return RV_OK;
+}
+
+static void run_client(void *arg)
+{
+    struct client *c = arg;
+    conflate_mgmt_client_t *client = conflate_mgmt_connect(SOCKET_PATH);
+    char *values[] = {"value", NULL};
+    kvpair_t *form = mk_kvpair("key", values);
+    int i;
+
+    if (client == NULL) {
+        perror("Failed to connect");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < c->calls; i++) {
+        hrtime_t start = gethrtime();
+        hrtime_t took;
+        if (conflate_mgmt_call(client, "noop", form, NULL, NULL) != RV_OK) {
+            fprintf(stderr, "Call failed\n");
+            exit(EXIT_FAILURE);
+        }
+        took = gethrtime() - start;
+        if (took > c->worst) {
+            c->worst = took;
+        }
+    }
+
+    free_kvpair(form);
+    conflate_mgmt_close(client);
+}
+
+static void run(int num_clients, int calls)
+{
+    struct client clients[MAX_CLIENTS];
+    hrtime_t start = gethrtime();
+    hrtime_t elapsed, worst = 0;
+    int i;
+
+    for (i = 0; i < num_clients; i++) {
+        clients[i].calls = calls / num_clients;
+        clients[i].worst = 0;
+        if (cb_create_thread(&clients[i].thread, run_client,
+                             &clients[i], 0) != 0) {
+            perror("Failed to create thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < num_clients; i++) {
+        cb_join_thread(clients[i].thread);
+        if (clients[i].worst > worst) {
+            worst = clients[i].worst;
+        }
+    }
+    elapsed = gethrtime() - start;
+
+    printf("%3d clients %8.1f us/call %10.0f calls/s %8.1f us worst\n",
+           num_clients, (double)elapsed / 1000 / calls * num_clients,
+           calls / ((double)elapsed / 1e9), (double)worst / 1000);
+}
+
+/*
+ * Drive the management socket with many clients at once, each waiting
+ * for its reply before sending the next request.
+ *
+ * usage: load_mgmt [calls] [max clients]
+ */
+int main(int argc, char **argv)
+{
+    static conflate_config_t conf;
+    static conflate_handle_t handle;
+    int calls = argc > 1 ? atoi(argv[1]) : DEFAULT_CALLS;
+    int max_clients = argc > 2 ? atoi(argv[2]) : 64;
+    int i;
+
+    if (calls <= 0 || max_clients <= 0 || max_clients > MAX_CLIENTS) {
+        fprintf(stderr, "usage: %s [calls] [max clients]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    init_conflate(&conf);
+    conf.mgmt_socket_path = SOCKET_PATH;
+    handle.conf = &conf;
+    conflate_register_mgmt_cb("noop", "Does nothing.", noop);
+    if (!conflate_start_mgmt_server(&handle)) {
+        return EXIT_FAILURE;
+    }
+
+    for (i = 1; i <= max_clients; i *= 2) {
+        run(i, calls);
+    }
+
+    remove(SOCKET_PATH);
+    return EXIT_SUCCESS;
+}
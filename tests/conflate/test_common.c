@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "test_common.h"
 
@@ -35,3 +36,8 @@ void check_pair_equality(kvpair_t *one, kvpair_t *two)
         fail_if(two->next, "No one->next, but a two->next");
     }
 }
+
+void sleep_ms(int ms)
+{
+    usleep(ms * 1000);
+}
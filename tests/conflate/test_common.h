@@ -11,4 +11,7 @@ void fail_if_impl(bool val, const char *msg, const char *file, int line);
 
 void check_pair_equality(kvpair_t *one, kvpair_t *two);
 
+/* Sleep for the given number of milliseconds. */
+void sleep_ms(int ms);
+
 #endif /* TEST_COMMMON_H */
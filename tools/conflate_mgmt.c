@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libconflate/conflate.h>
+
+static const char *result_name(enum conflate_mgmt_cb_result rv)
+{
+    switch (rv) {
+    case RV_OK:
+        return "OK";
+    case RV_ERROR:
+        return "ERROR";
+    case RV_BADARG:
+        return "BADARG";
+    case RV_UNKNOWN:
+        return "UNKNOWN";
+    case RV_PENDING:
+        return "PENDING";
+    case RV_TIMEOUT:
+        return "TIMEOUT";
+    }
+    return "?";
+}
+
+/* Add key=value to the form, as another value if the key's there. */
+static bool add_arg(kvpair_t **form, char *arg)
+{
+    char *eq = strchr(arg, '=');
+    kvpair_t *pair;
+
+    if (eq == NULL || eq == arg) {
+        return false;
+    }
+    *eq = '\0';
+    pair = find_kvpair(*form, arg);
+    if (pair) {
+        add_kvpair_value(pair, eq + 1);
+    } else {
+        char *values[2];
+        values[0] = eq + 1;
+        values[1] = NULL;
+        pair = mk_kvpair(arg, values);
+        pair->next = *form;
+        *form = pair;
+    }
+    return true;
+}
+
+/*
+ * Run a management command on a local agent, and print what it said,
+ * as JSON with -j.
+ *
+ * usage: conflate_mgmt [-j] <socket> <command> [key=value ...]
+ */
+int main(int argc, char **argv)
+{
+    conflate_mgmt_client_t *client;
+    enum conflate_mgmt_cb_result rv;
+    kvpair_t *form = NULL;
+    kvpair_t **reply;
+    int num_reply;
+    bool json = false;
+    int i, j, arg = 1;
+
+    if (argc > 1 && strcmp(argv[1], "-j") == 0) {
+        json = true;
+        arg++;
+    }
+    if (argc - arg < 2) {
+        fprintf(stderr, "usage: %s [-j] <socket> <command> [key=value ...]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (i = arg + 2; i < argc; i++) {
+        if (!add_arg(&form, argv[i])) {
+            fprintf(stderr, "Expected key=value, got \"%s\"\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    client = conflate_mgmt_connect(argv[arg]);
+    if (client == NULL) {
+        fprintf(stderr, "Failed to connect to %s: %s\n", argv[arg],
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (json) {
+        char *out;
+        rv = conflate_mgmt_call_json(client, argv[arg + 1], form, &out);
+        if (rv != RV_OK) {
+            fprintf(stderr, "%s\n", result_name(rv));
+        }
+        if (out) {
+            printf("%s\n", out);
+            free(out);
+        }
+        conflate_mgmt_close(client);
+        free_kvpair(form);
+        return rv == RV_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    rv = conflate_mgmt_call(client, argv[arg + 1], form, &reply, &num_reply);
+    printf("%s\n", result_name(rv));
+    for (i = 0; i < num_reply; i++) {
+        kvpair_t *pair;
+        if (i > 0) {
+            printf("\n");
+        }
+        for (pair = reply[i]; pair; pair = pair->next) {
+            for (j = 0; pair->values && pair->values[j]; j++) {
+                printf("%s=%s\n", pair->key, pair->values[j]);
+            }
+            if (pair->values == NULL || pair->values[0] == NULL) {
+                printf("%s\n", pair->key);
+            }
+        }
+    }
+
+    conflate_mgmt_free_reply(reply, num_reply);
+    conflate_mgmt_close(client);
+    free_kvpair(form);
+
+    return rv == RV_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+}